@@ -1,5 +1,6 @@
 #include <benchmark/benchmark.h>
 #include "lpz.h"
+#include <algorithm>
 
 extern std::vector<uint8_t> g_input;
 
@@ -7,11 +8,14 @@ static void BM_LPZ_Compress(benchmark::State& state) {
 
     size_t last_size = 0;
 
-    auto test = lpz::compress(g_input);
+    lpz::CompressOptions options;
+    options.threads = static_cast<unsigned>(state.range(0));
+
+    auto test = lpz::compress(g_input, options);
     if (!test) state.SkipWithError(test.error().m);
 
     for (auto _ : state) {
-        auto result = lpz::compress(g_input).value();
+        auto result = lpz::compress(g_input, options).value();
         last_size = result.size();
         benchmark::DoNotOptimize(result);
     }
@@ -29,20 +33,103 @@ static void BM_LPZ_Compress(benchmark::State& state) {
 
 static void BM_LPZ_Decompress(benchmark::State& state) {
 
+    lpz::DecompressOptions options;
+    options.threads = static_cast<unsigned>(state.range(0));
+
     auto comp = lpz::compress(g_input);
     if (!comp) state.SkipWithError(comp.error().m);
 
-    auto test = lpz::decompress(*comp);
+    auto test = lpz::decompress(*comp, options);
     if (!test) state.SkipWithError(test.error().m);
 
 
     for (auto _ : state) {
-        auto decomp = lpz::decompress(*comp).value();
+        auto decomp = lpz::decompress(*comp, options).value();
         benchmark::DoNotOptimize(decomp);
     }
 
     state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(g_input.size()));
 }
 
-BENCHMARK(BM_LPZ_Compress);
-BENCHMARK(BM_LPZ_Decompress);
+static void BM_LPZ_CompressInto(benchmark::State& state) {
+
+    std::vector<uint8_t> out(lpz::compress_bound(g_input.size()));
+    size_t last_size = 0;
+
+    auto test = lpz::compress_into(g_input, out);
+    if (!test) state.SkipWithError(test.error().m);
+
+    for (auto _ : state) {
+        last_size = lpz::compress_into(g_input, out).value();
+        benchmark::DoNotOptimize(out.data());
+    }
+
+    state.counters["Ratio"] = static_cast<double>(last_size) / g_input.size();
+
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(g_input.size()));
+}
+
+
+static void BM_LPZ_DecompressInto(benchmark::State& state) {
+
+    auto comp = lpz::compress(g_input);
+    if (!comp) state.SkipWithError(comp.error().m);
+
+    std::vector<uint8_t> out(g_input.size());
+
+    auto test = lpz::decompress_into(*comp, out);
+    if (!test) state.SkipWithError(test.error().m);
+
+    for (auto _ : state) {
+        lpz::decompress_into(*comp, out).value();
+        benchmark::DoNotOptimize(out.data());
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(g_input.size()));
+}
+
+static void BM_LPZ_CompressMessages(benchmark::State& state) {
+
+    const size_t message_size = static_cast<size_t>(state.range(0));
+    const size_t messages = std::max<size_t>(g_input.size() / message_size, 1);
+
+    lpz::CompressContext context;
+    std::vector<uint8_t> out(lpz::compress_bound(message_size));
+
+    for (auto _ : state) {
+        for (size_t i = 0; i < messages; i++) {
+            std::span<const uint8_t> message(g_input.data() + i * message_size, std::min(message_size, g_input.size()));
+            benchmark::DoNotOptimize(lpz::compress_into(message, out, context).value());
+        }
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations()) * int64_t(messages));
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(messages * message_size));
+}
+
+static void BM_LPZ_CompressLevel(benchmark::State& state) {
+
+    size_t last_size = 0;
+
+    lpz::CompressOptions options;
+    options.level = static_cast<int>(state.range(0));
+
+    auto test = lpz::compress(g_input, options);
+    if (!test) state.SkipWithError(test.error().m);
+
+    for (auto _ : state) {
+        auto result = lpz::compress(g_input, options).value();
+        last_size = result.size();
+        benchmark::DoNotOptimize(result);
+    }
+
+    state.counters["Ratio"] = static_cast<double>(last_size) / g_input.size();
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(g_input.size()));
+}
+
+BENCHMARK(BM_LPZ_Compress)->ArgName("threads")->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+BENCHMARK(BM_LPZ_Decompress)->ArgName("threads")->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+BENCHMARK(BM_LPZ_CompressInto);
+BENCHMARK(BM_LPZ_DecompressInto);
+BENCHMARK(BM_LPZ_CompressLevel)->ArgName("level")->DenseRange(lpz::MIN_LEVEL, lpz::MAX_LEVEL);
+BENCHMARK(BM_LPZ_CompressMessages)->ArgName("size")->Arg(1024)->Arg(4096)->Arg(16384);
@@ -39,7 +39,22 @@ inline std::expected<std::vector<uint8_t>, std::string> read_file(const std::fil
     return buffer;
 }
 
-inline std::expected<void, std::string> write_file(const std::filesystem::path& path, std::span<const uint8_t> data, bool overwrite = false)
+inline std::expected<std::ifstream, std::string> open_input_file(const std::filesystem::path& path)
+{
+    std::error_code e;
+    if (!std::filesystem::exists(path, e)) {
+        return std::unexpected( "Input file not found: " + path.string());
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return std::unexpected( "Error opening file: " + path.string() );
+    }
+
+    return file;
+}
+
+inline std::expected<std::ofstream, std::string> open_output_file(const std::filesystem::path& path, bool overwrite = false)
 {
 
     if (!overwrite) {
@@ -65,10 +80,21 @@ inline std::expected<void, std::string> write_file(const std::filesystem::path&
         return std::unexpected("Error opening file for writing: " + path.string());
     }
 
+    return file;
+}
+
+inline std::expected<void, std::string> write_file(const std::filesystem::path& path, std::span<const uint8_t> data, bool overwrite = false)
+{
+
+    auto file = open_output_file(path, overwrite);
+    if (!file) {
+        return std::unexpected(file.error());
+    }
+
     if (!data.empty()) {
-        file.write(reinterpret_cast<const char*>(data.data()), data.size());
+        file->write(reinterpret_cast<const char*>(data.data()), data.size());
 
-        if (!file) {
+        if (!*file) {
             return std::unexpected("Error while writing: " + path.string());
         }
     }
@@ -14,33 +14,115 @@ R"(
 Commands:
     compress [input file] [output file (optional)] 
     decompress [input file] [output file (optional)] 
+    train [samples directory] [dictionary file]
+
+Options:
+    -T [threads]    Number of worker threads, 0 = all hardware threads (default 1)
+    -L [level]      Compression level, 1 (fastest) to 10 (smallest) (default 5)
+    --linked        Let each block match into the one before: smaller output, but blocks
+                    are decompressed in order
+    --long [MiB]    Also match repeats up to this far back, 1 to 512 (implies --linked);
+                    compressing and decompressing each keep up to twice that much data
+                    in memory, plus up to 32 MiB of match table when compressing
+    -D [dictionary] Compress or decompress with a dictionary made by train; the whole file
+                    is then held in memory
+    --size [KiB]    Most content train puts in a dictionary, 1 to 63 (default 32)
 
 )";
 
 
 }
 
-int compress(std::filesystem::path input_file, std::optional<std::filesystem::path> output_file) {
+// Pumps input_file through an lpz::Compressor or lpz::Decompressor into output_file one chunk
+// at a time, so neither file has to fit in memory. A partial output file is removed on failure.
+template <typename Codec, typename Options>
+int stream_file(const std::filesystem::path& input_file, const std::filesystem::path& output_file, const Options& options, const std::string& action) {
 
-    auto in_res = read_file(input_file);
-    if (!in_res) {
-        std::cout << "Error reading file: " << in_res.error() << "\n";
+    auto in = open_input_file(input_file);
+    if (!in) {
+        std::cout << "Error reading file: " << in.error() << "\n";
         return 1;
     }
 
-    auto& in = *in_res;
+    auto out = open_output_file(output_file, false);
+    if (!out) {
+        std::cout << "Error writing file: " << out.error() << "\n";
+        return 1;
+    }
 
-    auto comp_res = lpz::compress(in);
-    if (!comp_res) {
-        std::cout << "Error compressing: " << comp_res.error().m << "\n";
+    auto fail = [&](const std::string& message) {
+        std::cout << message << "\n";
+        out->close();
+        std::error_code e;
+        std::filesystem::remove(output_file, e);
         return 1;
+    };
+
+    Codec codec([&](std::span<const uint8_t> data) -> std::expected<void, lpz::Error> {
+        out->write(reinterpret_cast<const char*>(data.data()), data.size());
+        if (!*out) {
+            return std::unexpected(lpz::Error{ lpz::ErrorCode::SystemError, "Error while writing: " + output_file.string() });
+        }
+        return {};
+    }, options);
+
+    std::vector<uint8_t> chunk(lpz::MAX_BLOCK);
+
+    while (*in) {
+        in->read(reinterpret_cast<char*>(chunk.data()), chunk.size());
+        size_t count = static_cast<size_t>(in->gcount());
+        if (count == 0) break;
+
+        auto res = codec.write({ chunk.data(), count });
+        if (!res) return fail("Error " + action + ": " + res.error().m);
     }
 
-    auto output_file_ = output_file.value_or(
-        std::filesystem::path(input_file).replace_extension(".lpz")
-    );
+    if (in->bad()) return fail("Error reading file: " + input_file.string());
 
-    auto res = write_file(output_file_, *comp_res, false);
+    auto res = codec.finish();
+    if (!res) return fail("Error " + action + ": " + res.error().m);
+
+    return 0;
+}
+
+std::optional<lpz::Dictionary> read_dictionary(const std::filesystem::path& path) {
+
+    auto data = read_file(path);
+    if (!data) {
+        std::cout << "Error reading dictionary: " << data.error() << "\n";
+        return std::nullopt;
+    }
+
+    auto dictionary = lpz::load_dictionary(*data);
+    if (!dictionary) {
+        std::cout << "Error loading dictionary: " << dictionary.error().m << "\n";
+        return std::nullopt;
+    }
+
+    return std::move(*dictionary);
+}
+
+// Runs the whole of input_file through `convert`, which takes the data and the dictionary, and
+// writes what it returns to output_file. The streaming codecs take no dictionary
+template <typename Convert>
+int convert_file(const std::filesystem::path& input_file, const std::filesystem::path& output_file, const std::filesystem::path& dictionary_file, Convert convert, const std::string& action) {
+
+    auto dictionary = read_dictionary(dictionary_file);
+    if (!dictionary) return 1;
+
+    auto data = read_file(input_file);
+    if (!data) {
+        std::cout << "Error reading file: " << data.error() << "\n";
+        return 1;
+    }
+
+    auto converted = convert(*data, *dictionary);
+    if (!converted) {
+        std::cout << "Error " << action << ": " << converted.error().m << "\n";
+        return 1;
+    }
+
+    auto res = write_file(output_file, *converted);
     if (!res) {
         std::cout << "Error writing file: " << res.error() << "\n";
         return 1;
@@ -49,27 +131,27 @@ int compress(std::filesystem::path input_file, std::optional<std::filesystem::pa
     return 0;
 }
 
-int decompress(std::filesystem::path input_file, std::optional<std::filesystem::path> output_file) {
+int compress(std::filesystem::path input_file, std::optional<std::filesystem::path> output_file, const lpz::CompressOptions& options, const std::optional<std::filesystem::path>& dictionary_file) {
 
+    auto output_file_ = output_file.value_or(
+        std::filesystem::path(input_file).replace_extension(".lpz")
+    );
 
-    auto in_res = read_file(input_file);
-    if (!in_res) {
-        std::cout << "Error reading file: " << in_res.error() << "\n";
-        return 1;
+    if (dictionary_file) {
+        return convert_file(input_file, output_file_, *dictionary_file, [&](std::span<const uint8_t> data, const lpz::Dictionary& dictionary) {
+            return lpz::compress(data, dictionary, options);
+        }, "compressing");
     }
 
-    auto& in = *in_res;
+    return stream_file<lpz::Compressor>(input_file, output_file_, options, "compressing");
+}
 
-    auto comp_res = lpz::decompress(in);
-    if (!comp_res) {
-        std::cout << "Error decompressing: " << comp_res.error().m << "\n";
-        return 1;
-    }
+int decompress(std::filesystem::path input_file, std::optional<std::filesystem::path> output_file, const lpz::DecompressOptions& options, const std::optional<std::filesystem::path>& dictionary_file) {
 
     std::filesystem::path output_file_;
     if (!output_file) {
         if (input_file.extension() == ".lpz") {
-            output_file_ = input_file.replace_extension();
+            output_file_ = std::filesystem::path(input_file).replace_extension();
         }
         else {
             std::cout << "Cannot infer output path: " << input_file.string() << "\n";
@@ -80,13 +162,55 @@ int decompress(std::filesystem::path input_file, std::optional<std::filesystem::
         output_file_ = *output_file;
     }
 
+    if (dictionary_file) {
+        return convert_file(input_file, output_file_, *dictionary_file, [&](std::span<const uint8_t> data, const lpz::Dictionary& dictionary) {
+            return lpz::decompress(data, dictionary, options);
+        }, "decompressing");
+    }
+
+    return stream_file<lpz::Decompressor>(input_file, output_file_, options, "decompressing");
+}
 
-    auto res = write_file(output_file_, *comp_res, false);
+// Trains a dictionary on every non-empty file under samples_dir, each file one sample
+int train(const std::filesystem::path& samples_dir, const std::filesystem::path& dictionary_file, size_t max_size, int level) {
+
+    std::error_code e;
+    if (!std::filesystem::is_directory(samples_dir, e)) {
+        std::cout << "Samples directory not found: " << samples_dir.string() << "\n";
+        return 1;
+    }
+
+    std::vector<std::vector<uint8_t>> samples;
+    for (std::filesystem::recursive_directory_iterator it(samples_dir, e), end; !e && it != end; it.increment(e)) {
+
+        if (!it->is_regular_file(e)) continue;
+
+        auto data = read_file(it->path());
+        if (!data) {
+            std::cout << "Error reading file: " << data.error() << "\n";
+            return 1;
+        }
+        if (!data->empty()) samples.push_back(std::move(*data));
+    }
+    if (e) {
+        std::cout << "Error listing directory: " << samples_dir.string() << "\n";
+        return 1;
+    }
+
+    std::vector<std::span<const uint8_t>> views(samples.begin(), samples.end());
+    auto dictionary = lpz::train_dictionary(views, max_size, level);
+    if (!dictionary) {
+        std::cout << "Error training: " << dictionary.error().m << "\n";
+        return 1;
+    }
+
+    auto res = write_file(dictionary_file, *dictionary);
     if (!res) {
         std::cout << "Error writing file: " << res.error() << "\n";
         return 1;
     }
 
+    std::cout << "Trained a " << dictionary->size() << " byte dictionary on " << samples.size() << " samples\n";
     return 0;
 }
 
@@ -97,14 +221,114 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    std::vector<std::string> args;
+    unsigned threads = 1;
+    int level = lpz::DEFAULT_LEVEL;
+    bool linked_blocks = false;
+    size_t long_window = 0;
+    std::optional<std::filesystem::path> dictionary_file;
+    size_t dictionary_size = lpz::DEFAULT_DICTIONARY;
+
+    for (int i = 2; i < argc; i++) {
+        if (argv[i] == std::string("-T")) {
+            if (i + 1 >= argc) {
+                std::cout << "Error: -T requires a thread count\n";
+                print_usage();
+                return 1;
+            }
+            try {
+                threads = static_cast<unsigned>(std::stoul(argv[++i]));
+            }
+            catch (const std::exception&) {
+                std::cout << "Error: Invalid thread count: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        else if (argv[i] == std::string("-L")) {
+            if (i + 1 >= argc) {
+                std::cout << "Error: -L requires a level\n";
+                print_usage();
+                return 1;
+            }
+            try {
+                level = std::stoi(argv[++i]);
+            }
+            catch (const std::exception&) {
+                level = 0;
+            }
+            if (level < lpz::MIN_LEVEL || level > lpz::MAX_LEVEL) {
+                std::cout << "Error: Invalid level: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        else if (argv[i] == std::string("--linked")) {
+            linked_blocks = true;
+        }
+        else if (argv[i] == std::string("--long")) {
+            if (i + 1 >= argc) {
+                std::cout << "Error: --long requires a window size\n";
+                print_usage();
+                return 1;
+            }
+            size_t mib = 0;
+            try {
+                mib = std::stoul(argv[++i]);
+            }
+            catch (const std::exception&) {
+                mib = 0;
+            }
+            if (mib == 0 || mib > 512) {
+                std::cout << "Error: Invalid window size: " << argv[i] << "\n";
+                return 1;
+            }
+            long_window = mib << 20;
+        }
+        else if (argv[i] == std::string("-D")) {
+            if (i + 1 >= argc) {
+                std::cout << "Error: -D requires a dictionary file\n";
+                print_usage();
+                return 1;
+            }
+            dictionary_file = argv[++i];
+        }
+        else if (argv[i] == std::string("--size")) {
+            if (i + 1 >= argc) {
+                std::cout << "Error: --size requires a dictionary size\n";
+                print_usage();
+                return 1;
+            }
+            size_t kib = 0;
+            try {
+                kib = std::stoul(argv[++i]);
+            }
+            catch (const std::exception&) {
+                kib = 0;
+            }
+            if (kib == 0 || kib * 1024 > lpz::MAX_DICTIONARY) {
+                std::cout << "Error: Invalid dictionary size: " << argv[i] << "\n";
+                return 1;
+            }
+            dictionary_size = kib * 1024;
+        }
+        else {
+            args.push_back(argv[i]);
+        }
+    }
+
    
     if (argv[1] == std::string("compress")) {
 
-        if (argc == 3) {
-            return compress(argv[2], std::nullopt);
+        lpz::CompressOptions options;
+        options.threads = threads;
+        options.level = level;
+        options.linked_blocks = linked_blocks;
+        options.long_window = long_window;
+
+        if (args.size() == 1) {
+            return compress(args[0], std::nullopt, options, dictionary_file);
         }
-        else if (argc == 4) {
-            return compress(argv[2], argv[3]);
+        else if (args.size() == 2) {
+            return compress(args[0], args[1], options, dictionary_file);
         }
         else {
             std::cout << "Error: Invalid argument count\n";
@@ -114,11 +338,25 @@ int main(int argc, char* argv[]) {
     }
     else if (argv[1] == std::string("decompress")) {
 
-        if (argc == 3) {
-            return decompress(argv[2], std::nullopt);
+        lpz::DecompressOptions options;
+        options.threads = threads;
+
+        if (args.size() == 1) {
+            return decompress(args[0], std::nullopt, options, dictionary_file);
         }
-        else if (argc == 4) {
-            return decompress(argv[2], argv[3]);
+        else if (args.size() == 2) {
+            return decompress(args[0], args[1], options, dictionary_file);
+        }
+        else {
+            std::cout << "Error: Invalid argument count\n";
+            print_usage();
+            return 1;
+        }
+    }
+    else if (argv[1] == std::string("train")) {
+
+        if (args.size() == 2) {
+            return train(args[0], args[1], dictionary_size, level);
         }
         else {
             std::cout << "Error: Invalid argument count\n";
@@ -138,6 +376,3 @@ int main(int argc, char* argv[]) {
 
 
  }
-
-
-
@@ -0,0 +1,619 @@
+#include "ans.h"
+#include "histogram.h"
+#include <array>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <expected>
+#include <limits>
+namespace {
+
+	constexpr size_t HEADER_SIZE = sizeof(uint32_t); // decoded size
+	constexpr size_t TABLE_SIZE_MAX = size_t(1) << lpz::ans::MAX_TABLE_LOG;
+
+	// Normalized counts header: widths of at most 13 bits, and a zero width followed by the
+	// number of further zero counts
+	constexpr int WIDTH_BITS = 4;
+	constexpr int ZERO_RUN_BITS = 4;
+
+	// The encoder takes this many symbols between flushes, and the decoder reads their bits
+	// after one reload: each is at most MAX_TABLE_LOG bits
+	constexpr int SYMBOLS_PER_FLUSH = 4;
+	static_assert(SYMBOLS_PER_FLUSH * lpz::ans::MAX_TABLE_LOG <= 56);
+
+	int highbit(uint32_t v) {
+		return std::bit_width(v) - 1;
+	}
+
+	// Spreads the symbols over the table so each is scattered across the whole state range.
+	// The step is odd, so it visits every slot once.
+	void spread_symbols(const lpz::ans::NormalizedCounts& counts, uint8_t* spread) {
+
+		const size_t size = size_t(1) << counts.table_log;
+		const size_t mask = size - 1;
+		const size_t step = (size >> 1) + (size >> 3) + 3;
+
+		size_t pos = 0;
+		for (int s = 0; s < 256; s++) {
+			for (int i = 0; i < counts.counts[s]; i++) {
+				spread[pos] = static_cast<uint8_t>(s);
+				pos = (pos + step) & mask;
+			}
+		}
+	}
+
+	// Little-endian bits written forward, flushed a whole number of bytes at a time with one
+	// 8-byte store, so the output needs 8 bytes of room past its end. At most 56 bits may be
+	// added between flushes.
+	struct BitWriter {
+		uint8_t* op;
+		uint64_t container = 0;
+		unsigned count = 0;
+
+		void add(uint32_t value, unsigned bits) {
+			container |= uint64_t(value) << count;
+			count += bits;
+		}
+
+		void flush() {
+			memcpy(op, &container, sizeof(container));
+			op += count >> 3;
+			container >>= count & ~7u;
+			count &= 7;
+		}
+
+		// Ends the stream with a 1 bit that marks where it stops. Returns the end of the output
+		uint8_t* close() {
+			add(1, 1);
+			flush();
+			return op + (count > 0);
+		}
+	};
+
+	// Reads a stream written by BitWriter from its end back, so the bits come out in the
+	// reverse order they went in
+	struct BackwardReader {
+		const uint8_t* start;
+		const uint8_t* ptr;        // start of the 8 bytes in the container
+		uint64_t container = 0;
+		unsigned consumed = 0;     // bits used from the top of the container
+
+		std::expected<void, lpz::Error> init(std::span<const uint8_t> data) {
+
+			if (data.empty() || data.back() == 0) {
+				return std::unexpected(lpz::Error{ lpz::ErrorCode::InputError, "Corrupted Data: ANS stream without an end mark" });
+			}
+
+			start = data.data();
+			consumed = 8 - highbit(data.back());
+
+			if (data.size() >= sizeof(container)) {
+				ptr = data.data() + data.size() - sizeof(container);
+				memcpy(&container, ptr, sizeof(container));
+			}
+			else {
+				ptr = start;
+				for (size_t i = 0; i < data.size(); i++) {
+					container |= uint64_t(data[i]) << (8 * i);
+				}
+				consumed += static_cast<unsigned>(8 * (sizeof(container) - data.size()));
+			}
+
+			return {};
+		}
+
+		// Moves the container back over the bytes used up. Reading past the start of a corrupt
+		// stream only shows in finished().
+		void reload() {
+			if (consumed > 64) return;
+
+			if (ptr >= start + sizeof(container)) {
+				ptr -= consumed >> 3;
+				consumed &= 7;
+			}
+			else if (ptr == start) {
+				return;
+			}
+			else {
+				size_t bytes = std::min<size_t>(consumed >> 3, static_cast<size_t>(ptr - start));
+				ptr -= bytes;
+				consumed -= static_cast<unsigned>(8 * bytes);
+			}
+
+			memcpy(&container, ptr, sizeof(container));
+		}
+
+		uint32_t read(unsigned bits) {
+			uint64_t value = ((container << (consumed & 63)) >> 1) >> ((63 - bits) & 63);
+			consumed += bits;
+			return static_cast<uint32_t>(value);
+		}
+
+		// Whether exactly every bit has been read
+		bool finished() const {
+			return ptr == start && consumed == 64;
+		}
+	};
+
+	struct EncodeTable {
+		// States in the order the encoder moves to them, grouped by symbol
+		std::array<uint16_t, TABLE_SIZE_MAX> states;
+
+		// Per symbol: turns a state into the bits to write (delta_bits) and the slot of the
+		// symbol's group to move to (delta_state)
+		struct Transform {
+			uint32_t delta_bits;
+			int32_t delta_state;
+		};
+		std::array<Transform, 256> transforms;
+
+		int table_log;
+
+		void build(const lpz::ans::NormalizedCounts& counts) {
+
+			table_log = counts.table_log;
+			const uint32_t size = uint32_t(1) << table_log;
+
+			std::array<uint8_t, TABLE_SIZE_MAX> spread;
+			spread_symbols(counts, spread.data());
+
+			std::array<uint32_t, 256> next;
+			uint32_t total = 0;
+			for (int s = 0; s < 256; s++) {
+				uint32_t count = counts.counts[s];
+				next[s] = total;
+
+				if (count == 1) {
+					transforms[s] = { (uint32_t(table_log) << 16) - size, static_cast<int32_t>(total) - 1 };
+				}
+				else if (count > 1) {
+					uint32_t max_bits = table_log - highbit(count - 1);
+					transforms[s] = { (max_bits << 16) - (count << max_bits), static_cast<int32_t>(total) - static_cast<int32_t>(count) };
+				}
+
+				total += count;
+			}
+
+			for (uint32_t u = 0; u < size; u++) {
+				states[next[spread[u]]++] = static_cast<uint16_t>(size + u);
+			}
+		}
+
+		// The first symbol coded by a state is taken in without writing any bits
+		uint32_t start(uint8_t symbol) const {
+			const auto& t = transforms[symbol];
+			uint32_t bits = (t.delta_bits + (1 << 15)) >> 16;
+			uint32_t value = (bits << 16) - t.delta_bits;
+			return states[(value >> bits) + t.delta_state];
+		}
+
+		void encode(uint32_t& state, uint8_t symbol, BitWriter& writer) const {
+			const auto& t = transforms[symbol];
+			uint32_t bits = (state + t.delta_bits) >> 16;
+			writer.add(state & ((1u << bits) - 1), bits);
+			state = states[(state >> bits) + t.delta_state];
+		}
+	};
+
+}
+
+namespace lpz::ans {
+
+	NormalizedCounts normalize_counts(const std::array<uint32_t, 256>& histogram, size_t total) {
+
+		NormalizedCounts result;
+
+		int distinct = 0;
+		for (uint32_t count : histogram) distinct += count != 0;
+		if (distinct == 0) return result;
+
+		// A table much larger than the input only costs header bits, but every symbol needs
+		// room for a count
+		int table_log = std::min(DEFAULT_TABLE_LOG, static_cast<int>(std::bit_width(total)) - 2);
+		table_log = std::max(table_log, static_cast<int>(std::bit_width(static_cast<unsigned>(distinct))) + 1);
+		table_log = std::clamp(table_log, MIN_TABLE_LOG, MAX_TABLE_LOG);
+
+		const int64_t size = int64_t(1) << table_log;
+		int64_t sum = 0;
+
+		for (int s = 0; s < 256; s++) {
+			if (histogram[s] == 0) continue;
+			uint64_t scaled = (uint64_t(histogram[s]) * size + total / 2) / total;
+			result.counts[s] = static_cast<uint16_t>(std::max<uint64_t>(scaled, 1));
+			sum += result.counts[s];
+		}
+
+		// Rounding leaves the sum a little off; move it one step at a time where that costs
+		// the fewest bits
+		while (sum != size) {
+			int best = -1;
+			double best_cost = 0;
+
+			for (int s = 0; s < 256; s++) {
+				uint32_t count = result.counts[s];
+				if (count == 0 || (sum > size && count == 1)) continue;
+
+				double cost = sum > size
+					? histogram[s] * std::log2(double(count) / (count - 1))
+					: -(histogram[s] * std::log2(double(count + 1) / count));
+
+				if (best < 0 || cost < best_cost) {
+					best = s;
+					best_cost = cost;
+				}
+			}
+
+			if (sum > size) {
+				result.counts[best]--;
+				sum--;
+			}
+			else {
+				result.counts[best]++;
+				sum++;
+			}
+		}
+
+		result.table_log = table_log;
+		return result;
+	}
+
+	size_t estimate_bits(const std::array<uint32_t, 256>& histogram, const NormalizedCounts& counts) {
+
+		double bits = 0;
+		for (int s = 0; s < 256; s++) {
+			if (histogram[s] == 0) continue;
+			if (counts.counts[s] == 0) return std::numeric_limits<size_t>::max();
+			bits += histogram[s] * (counts.table_log - std::log2(double(counts.counts[s])));
+		}
+
+		return static_cast<size_t>(std::ceil(bits));
+	}
+
+	size_t encode_bound(size_t size) {
+		return HEADER_SIZE + COUNTS_BOUND + encode_stream_bound(size);
+	}
+
+	std::expected<std::vector<uint8_t>, Error>
+	encode(std::span<const uint8_t> data) {
+
+		std::vector<uint8_t> coded_bytes(encode_bound(data.size()));
+
+		auto size = encode_into(data, coded_bytes);
+		if (!size) return std::unexpected(size.error());
+
+		coded_bytes.resize(*size);
+		return coded_bytes;
+	}
+
+	std::expected<size_t, Error>
+	encode_into(std::span<const uint8_t> data, std::span<uint8_t> out) {
+
+		if (data.size() >= std::numeric_limits<uint32_t>::max())
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS compress: Input too large" });
+		if (data.empty())
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS compress: Empty Input" });
+		if (out.size() < encode_bound(data.size()))
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS compress: Output buffer too small" });
+
+		auto counts = normalize_counts(create_histogram(data), data.size());
+
+		uint32_t uncompsize = static_cast<uint32_t>(data.size());
+		memcpy(out.data(), &uncompsize, sizeof(uncompsize));
+
+		size_t pos = HEADER_SIZE;
+		pos += write_counts(counts, out.data() + pos);
+
+		auto size = encode_stream_into(data, counts, out.subspan(pos));
+		if (!size) return std::unexpected(size.error());
+
+		return pos + *size;
+	}
+
+	std::expected<size_t, Error>
+	decoded_size(std::span<const uint8_t> data) {
+
+		if (data.size() < HEADER_SIZE)
+			return std::unexpected(Error{ ErrorCode::InputError, "Input too small" });
+
+		uint32_t out_size;
+		memcpy(&out_size, data.data(), sizeof(out_size));
+
+		if (out_size == 0)
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS decode: Output too small" });
+		if (out_size == std::numeric_limits<uint32_t>::max())
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS decode: Output too large" });
+
+		return out_size;
+	}
+
+	std::expected<std::vector<uint8_t>, Error>
+	decode(std::span<const uint8_t> data) {
+
+		auto out_size = decoded_size(data);
+		if (!out_size) return std::unexpected(out_size.error());
+
+		DecodeTable table;
+		std::vector<uint8_t> decoded(*out_size);
+
+		auto size = decode_into(data, decoded, table);
+		if (!size) return std::unexpected(size.error());
+
+		return decoded;
+	}
+
+	std::expected<size_t, Error>
+	decode_into(std::span<const uint8_t> data, std::span<uint8_t> out, DecodeTable& table) {
+
+		auto out_size = decoded_size(data);
+		if (!out_size) return std::unexpected(out_size.error());
+
+		if (out.size() < *out_size)
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS decode: Output buffer too small" });
+
+		NormalizedCounts counts;
+		auto counts_size = read_counts(data.subspan(HEADER_SIZE), counts);
+		if (!counts_size) return std::unexpected(counts_size.error());
+
+		auto built = build_decode_table(counts, table);
+		if (!built) return std::unexpected(built.error());
+
+		auto decoded = decode_stream_into(data.subspan(HEADER_SIZE + *counts_size), out.first(*out_size), table);
+		if (!decoded) return std::unexpected(decoded.error());
+
+		return *out_size;
+	}
+
+	size_t write_counts(const NormalizedCounts& counts, uint8_t* out) {
+
+		out[0] = static_cast<uint8_t>(counts.table_log);
+
+		// Little-endian bits after the table log byte
+		uint8_t* op = out + 1;
+		uint32_t container = 0;
+		int count = 0;
+
+		auto put = [&](uint32_t value, int bits) {
+			container |= value << count;
+			count += bits;
+			while (count >= 8) {
+				*op++ = static_cast<uint8_t>(container);
+				container >>= 8;
+				count -= 8;
+			}
+		};
+
+		const uint32_t size = uint32_t(1) << counts.table_log;
+		uint32_t sum = 0;
+
+		for (int s = 0; s < 256 && sum < size;) {
+			uint32_t value = counts.counts[s];
+
+			if (value == 0) {
+				int run = 0;
+				while (s + 1 + run < 256 && counts.counts[s + 1 + run] == 0 && run < (1 << ZERO_RUN_BITS) - 1) run++;
+				put(0, WIDTH_BITS);
+				put(run, ZERO_RUN_BITS);
+				s += 1 + run;
+				continue;
+			}
+
+			int width = std::bit_width(value);
+			put(width, WIDTH_BITS);
+			put(value & ((1u << (width - 1)) - 1), width - 1);
+			sum += value;
+			s++;
+		}
+
+		if (count > 0) *op++ = static_cast<uint8_t>(container);
+
+		return static_cast<size_t>(op - out);
+	}
+
+	std::expected<size_t, Error>
+	read_counts(std::span<const uint8_t> data, NormalizedCounts& counts) {
+
+		if (data.empty())
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS decode: Truncated counts" });
+
+		counts.table_log = data[0];
+		if (counts.table_log < MIN_TABLE_LOG || counts.table_log > MAX_TABLE_LOG)
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS decode: Invalid table log" });
+
+		size_t bit = 8;
+		auto get = [&](int bits) -> std::expected<uint32_t, Error> {
+			if (bit + bits > 8 * data.size())
+				return std::unexpected(Error{ ErrorCode::InputError, "ANS decode: Truncated counts" });
+			uint32_t value = 0;
+			for (int i = 0; i < bits; i++, bit++) {
+				value |= uint32_t((data[bit / 8] >> (bit % 8)) & 1) << i;
+			}
+			return value;
+		};
+
+		counts.counts.fill(0);
+
+		const uint32_t size = uint32_t(1) << counts.table_log;
+		uint32_t sum = 0;
+
+		for (int s = 0; sum < size; ) {
+			if (s >= 256)
+				return std::unexpected(Error{ ErrorCode::InputError, "ANS decode: Counts do not fill the table" });
+
+			auto width = get(WIDTH_BITS);
+			if (!width) return std::unexpected(width.error());
+
+			if (*width == 0) {
+				auto run = get(ZERO_RUN_BITS);
+				if (!run) return std::unexpected(run.error());
+				s += 1 + *run;
+				continue;
+			}
+
+			auto low = get(*width - 1);
+			if (!low) return std::unexpected(low.error());
+
+			uint32_t value = (1u << (*width - 1)) | *low;
+			if (value > size - sum)
+				return std::unexpected(Error{ ErrorCode::InputError, "ANS decode: Counts overflow the table" });
+
+			counts.counts[s++] = static_cast<uint16_t>(value);
+			sum += value;
+		}
+
+		return (bit + 7) / 8;
+	}
+
+	size_t encode_stream_bound(size_t size) {
+		// Every symbol takes at most MAX_TABLE_LOG bits, then two states and the end mark, then
+		// room for the last 8-byte store
+		return (size * MAX_TABLE_LOG + 2 * MAX_TABLE_LOG + 1 + 7) / 8 + sizeof(uint64_t);
+	}
+
+	std::expected<size_t, Error>
+	encode_stream_into(std::span<const uint8_t> data, const NormalizedCounts& counts, std::span<uint8_t> out) {
+
+		if (out.size() < encode_stream_bound(data.size()))
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS compress: Output buffer too small" });
+		if (data.empty()) return 0;
+
+		for (uint8_t value : data) {
+			if (counts.counts[value] == 0)
+				return std::unexpected(Error{ ErrorCode::InputError, "ANS compress: Symbol without a count" });
+		}
+
+		EncodeTable table;
+		table.build(counts);
+
+		const uint32_t size = uint32_t(1) << counts.table_log;
+
+		// Two states take turns over the symbols, even ones first, so the decoder can work on
+		// both at once. Symbols are coded last to first, since the decoder reads backwards.
+		BitWriter writer{ out.data() };
+		std::array<uint32_t, 2> states = { size, size };
+
+		size_t i = data.size() - 1;
+		states[i & 1] = table.start(data[i]);
+		if (i > 0) {
+			i--;
+			states[i & 1] = table.start(data[i]);
+		}
+
+		while (i >= SYMBOLS_PER_FLUSH) {
+			for (int k = 0; k < SYMBOLS_PER_FLUSH; k++) {
+				i--;
+				table.encode(states[i & 1], data[i], writer);
+			}
+			writer.flush();
+		}
+
+		while (i > 0) {
+			i--;
+			table.encode(states[i & 1], data[i], writer);
+			writer.flush();
+		}
+
+		if (data.size() >= 2) writer.add(states[1] - size, counts.table_log);
+		writer.add(states[0] - size, counts.table_log);
+		writer.flush();
+
+		return static_cast<size_t>(writer.close() - out.data());
+	}
+
+	std::expected<void, Error>
+	build_decode_table(const NormalizedCounts& counts, DecodeTable& table) {
+
+		if (counts.table_log < MIN_TABLE_LOG || counts.table_log > MAX_TABLE_LOG)
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS decode: Invalid table log" });
+
+		const uint32_t size = uint32_t(1) << counts.table_log;
+
+		uint32_t sum = 0;
+		for (uint16_t count : counts.counts) sum += count;
+		if (sum != size)
+			return std::unexpected(Error{ ErrorCode::InputError, "ANS decode: Counts do not fill the table" });
+
+		std::array<uint8_t, TABLE_SIZE_MAX> spread;
+		spread_symbols(counts, spread.data());
+
+		std::array<uint32_t, 256> next;
+		std::copy(counts.counts.begin(), counts.counts.end(), next.begin());
+
+		table.entries.resize(size);
+		table.table_log = counts.table_log;
+
+		for (uint32_t u = 0; u < size; u++) {
+			uint8_t symbol = spread[u];
+			uint32_t x = next[symbol]++;
+			uint32_t bits = counts.table_log - highbit(x);
+			table.entries[u] = { static_cast<uint16_t>((x << bits) - size), symbol, static_cast<uint8_t>(bits) };
+		}
+
+		return {};
+	}
+
+	std::expected<void, Error>
+	decode_stream_into(std::span<const uint8_t> data, std::span<uint8_t> out, const DecodeTable& table) {
+
+		const size_t n = out.size();
+
+		if (n == 0) {
+			if (!data.empty())
+				return std::unexpected(Error{ ErrorCode::InputError, "Corrupted Data: ANS stream longer than its symbols" });
+			return {};
+		}
+
+		BackwardReader reader;
+		auto init = reader.init(data);
+		if (!init) return init;
+
+		const DecodeTable::Entry* const entries = table.entries.data();
+		uint8_t* const op = out.data();
+
+		// Every state read is below the table size, and so is every state a valid table moves
+		// to, whatever the bits. Corruption only shows in how the stream ends.
+		uint32_t s0 = reader.read(table.table_log);
+		uint32_t s1 = n >= 2 ? reader.read(table.table_log) : 0;
+
+		// The last symbol of each state reads no bits
+		const size_t with_bits = n >= 2 ? n - 2 : 0;
+		size_t i = 0;
+
+		for (; i + SYMBOLS_PER_FLUSH <= with_bits; i += SYMBOLS_PER_FLUSH) {
+			reader.reload();
+
+			auto e0 = entries[s0];
+			auto e1 = entries[s1];
+			op[i] = e0.symbol;
+			op[i + 1] = e1.symbol;
+			s0 = e0.next_state + reader.read(e0.bits);
+			s1 = e1.next_state + reader.read(e1.bits);
+
+			e0 = entries[s0];
+			e1 = entries[s1];
+			op[i + 2] = e0.symbol;
+			op[i + 3] = e1.symbol;
+			s0 = e0.next_state + reader.read(e0.bits);
+			s1 = e1.next_state + reader.read(e1.bits);
+		}
+
+		for (; i < with_bits; i++) {
+			reader.reload();
+			uint32_t& state = i & 1 ? s1 : s0;
+			auto e = entries[state];
+			op[i] = e.symbol;
+			state = e.next_state + reader.read(e.bits);
+		}
+
+		for (; i < n; i++) {
+			op[i] = entries[i & 1 ? s1 : s0].symbol;
+		}
+
+		reader.reload();
+		if (!reader.finished())
+			return std::unexpected(Error{ ErrorCode::InputError, "Corrupted Data: ANS stream does not match its symbols" });
+
+		return {};
+	}
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include "lpz.h"
+#include <vector>
+#include <array>
+#include <span>
+#include <expected>
+
+// Table-based asymmetric numeral systems (tANS, as in FSE). Symbols cost fractional bits, so
+// skewed distributions such as LZ77 tokens code tighter than with Huffman.
+namespace lpz::ans {
+
+	constexpr int MIN_TABLE_LOG = 5;
+	constexpr int MAX_TABLE_LOG = 12;
+	constexpr int DEFAULT_TABLE_LOG = 11;
+
+	// Symbol counts scaled to sum to 1 << table_log. Every symbol of the data keeps at least 1
+	struct NormalizedCounts {
+		std::array<uint16_t, 256> counts = {};
+		int table_log = 0;
+	};
+
+	// State transition table, kept between calls so it is only allocated once
+	struct DecodeTable {
+		struct Entry {
+			uint16_t next_state; // lowest state that follows, before the bits read are added
+			uint8_t symbol;
+			uint8_t bits;        // bits to read for the next state
+		};
+		std::vector<Entry> entries;
+		int table_log = 0;
+	};
+
+	// Scales `histogram` of `total` symbols to a table size suited to that many symbols
+	NormalizedCounts normalize_counts(const std::array<uint32_t, 256>& histogram, size_t total);
+
+	// Bits the symbols counted in `histogram` take with `counts`, to within the few bits of the
+	// final states
+	size_t estimate_bits(const std::array<uint32_t, 256>& histogram, const NormalizedCounts& counts);
+
+	// Largest encoded size of `size` input bytes
+	size_t encode_bound(size_t size);
+
+	// Decoded size as a u32, the normalized counts, then the bitstream
+	std::expected<std::vector<uint8_t>, Error> encode(std::span<const uint8_t> data);
+	std::expected<size_t, Error> encode_into(std::span<const uint8_t> data, std::span<uint8_t> out);
+
+	// Size of the output `data` decodes to, read from its header
+	std::expected<size_t, Error> decoded_size(std::span<const uint8_t> data);
+
+	std::expected<std::vector<uint8_t>, Error> decode(std::span<const uint8_t> data);
+	std::expected<size_t, Error> decode_into(std::span<const uint8_t> data, std::span<uint8_t> out, DecodeTable& table);
+
+	// Building blocks for formats that store the decoded size themselves.
+
+	// The table log, then the bit width of each count and the count below its top bit, with
+	// runs of zero counts folded. Returns bytes written, at most COUNTS_BOUND
+	constexpr size_t COUNTS_BOUND = 1 + 2 * 256 + 1;
+	size_t write_counts(const NormalizedCounts& counts, uint8_t* out);
+	// Returns bytes read
+	std::expected<size_t, Error> read_counts(std::span<const uint8_t> data, NormalizedCounts& counts);
+
+	// Largest bitstream for `size` symbols
+	size_t encode_stream_bound(size_t size);
+	// Writes the bitstream alone. Every symbol of `data` must have a count. Returns bytes written
+	std::expected<size_t, Error> encode_stream_into(std::span<const uint8_t> data, const NormalizedCounts& counts, std::span<uint8_t> out);
+
+	std::expected<void, Error> build_decode_table(const NormalizedCounts& counts, DecodeTable& table);
+	// Decodes exactly out.size() symbols from a bitstream written by encode_stream_into
+	std::expected<void, Error> decode_stream_into(std::span<const uint8_t> data, std::span<uint8_t> out, const DecodeTable& table);
+
+}
@@ -6,36 +6,823 @@
 #include "block.h"
 #include "lz77.h"
 #include "huffman.h"
+#include "ans.h"
 #include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <cstring>
 
 
 
-std::expected<std::vector<uint8_t>, lpz::Error> lpz::compress_block(std::span<const uint8_t> data) {
+bool lpz::is_data_block(BlockType type) {
+	using enum BlockType;
+	return type == Compressed || type == Split || type == LinkedSplit || type == Stored || type == Rle;
+}
+
+size_t lpz::seek_table_size(size_t entries) {
+	return BLOCK_HEADER_SIZE + entries * sizeof(SeekEntry) + SEEK_FOOTER_SIZE;
+}
+
+void lpz::write_block_header(uint8_t* out, BlockHeader header) {
+
+	uint32_t value = (static_cast<uint32_t>(header.type) << BLOCK_SIZE_BITS) | header.size;
+	memcpy(out, &value, sizeof(value));
+}
+
+void lpz::write_block_header(std::vector<uint8_t>& out, BlockHeader header) {
+
+	out.resize(out.size() + BLOCK_HEADER_SIZE);
+	write_block_header(out.data() + out.size() - BLOCK_HEADER_SIZE, header);
+}
+
+void lpz::write_seek_table(uint8_t* out, std::span<const SeekEntry> entries) {
+
+	uint32_t count = static_cast<uint32_t>(entries.size());
+	uint32_t magic = SEEK_TABLE_MAGIC;
+
+	write_block_header(out, { BlockType::SeekTable, static_cast<uint32_t>(seek_table_size(count) - BLOCK_HEADER_SIZE) });
+	out += BLOCK_HEADER_SIZE;
+
+	memcpy(out, entries.data(), count * sizeof(SeekEntry));
+	out += count * sizeof(SeekEntry);
+	memcpy(out, &count, sizeof(count));
+	memcpy(out + sizeof(count), &magic, sizeof(magic));
+}
+
+void lpz::write_seek_table(std::vector<uint8_t>& out, std::span<const SeekEntry> entries) {
+
+	out.resize(out.size() + seek_table_size(entries.size()));
+	write_seek_table(out.data() + out.size() - seek_table_size(entries.size()), entries);
+}
+
+void lpz::write_window_block(uint8_t* out, size_t window) {
+
+	uint32_t value = static_cast<uint32_t>(window);
+
+	write_block_header(out, { BlockType::Window, sizeof(value) });
+	memcpy(out + BLOCK_HEADER_SIZE, &value, sizeof(value));
+}
+
+std::expected<size_t, lpz::Error> lpz::read_window_block(std::span<const uint8_t> payload) {
+
+	uint32_t value;
+	if (payload.size() != sizeof(value)) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Invalid window block" });
+	}
+
+	memcpy(&value, payload.data(), sizeof(value));
+	if (value > lz77::MAX_LONG_WINDOW) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Window too large" });
+	}
+
+	return std::max<size_t>(value, lz77::WINDOW_SIZE);
+}
+
+void lpz::write_dictionary_block(uint8_t* out, uint32_t id) {
+
+	write_block_header(out, { BlockType::Dictionary, sizeof(id) });
+	memcpy(out + BLOCK_HEADER_SIZE, &id, sizeof(id));
+}
+
+std::expected<uint32_t, lpz::Error> lpz::read_dictionary_block(std::span<const uint8_t> payload) {
+
+	uint32_t id;
+	if (payload.size() != sizeof(id)) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Invalid dictionary block" });
+	}
+
+	memcpy(&id, payload.data(), sizeof(id));
+	return id;
+}
+
+std::expected<lpz::BlockHeader, lpz::Error> lpz::decode_block_header(uint32_t value) {
+
+	BlockHeader header{ static_cast<BlockType>(value >> BLOCK_SIZE_BITS), value & MAX_BLOCK_PAYLOAD };
+
+	if (!is_data_block(header.type) && header.type != BlockType::SeekTable && header.type != BlockType::Window && header.type != BlockType::Dictionary) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Unknown block type" });
+	}
+
+	return header;
+}
+
+std::expected<lpz::BlockHeader, lpz::Error> lpz::read_block_header(std::span<const uint8_t> data) {
+
+	if (data.size() < BLOCK_HEADER_SIZE) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Truncated block header" });
+	}
+
+	uint32_t value;
+	memcpy(&value, data.data(), sizeof(value));
+
+	auto header = decode_block_header(value);
+	if (!header) return header;
+
+	if (data.size() - BLOCK_HEADER_SIZE < header->size) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Truncated block" });
+	}
+
+	return header;
+}
+namespace {
+
+	// Streams shorter than this are coded as one bitstream, since the jump table of the
+	// interleaved format would cost more than its faster decoding saves
+	constexpr size_t MIN_INTERLEAVED_STREAM = 1024;
+
+	// ANS decodes slower than interleaved Huffman, so it has to save at least 1/ANS_MIN_GAIN
+	// of the stream to be used
+	constexpr size_t ANS_MIN_GAIN = 32;
+
+	// Coded and Repeat streams store their decoded size as a LEB128 varint
+	constexpr size_t MAX_VARINT_SIZE = 5;
+
+	constexpr size_t RLE_PAYLOAD_SIZE = sizeof(uint32_t) + sizeof(uint8_t);
+
+	// Blocks at least this large are sampled before they are parsed: SAMPLE_CHUNKS chunks of
+	// SAMPLE_CHUNK bytes spread over the block. A sample whose Huffman code, code included,
+	// leaves it at INCOMPRESSIBLE_RATIO of its size or more marks the block as incompressible
+	constexpr size_t MIN_SAMPLED_BLOCK = 16 * 1024;
+	constexpr size_t SAMPLE_CHUNKS = 4;
+	constexpr size_t SAMPLE_CHUNK = 4 * 1024;
+	constexpr double INCOMPRESSIBLE_RATIO = 0.98;
+
+	// An incompressible block is only parsed at MIN_LEVEL and keeps its literals raw. It is
+	// stored unless its matches save at least 1/MIN_MATCH_GAIN of it
+	constexpr size_t MIN_MATCH_GAIN = 64;
+
+	bool is_run(std::span<const uint8_t> data) {
+		return memcmp(data.data(), data.data() + 1, data.size() - 1) == 0;
+	}
+
+	bool looks_incompressible(std::span<const uint8_t> data, std::vector<uint8_t>& sample) {
+
+		if (data.size() < MIN_SAMPLED_BLOCK) return false;
+
+		sample.clear();
+		for (size_t i = 0; i < SAMPLE_CHUNKS; i++) {
+			auto chunk = data.subspan(i * (data.size() - SAMPLE_CHUNK) / (SAMPLE_CHUNKS - 1), SAMPLE_CHUNK);
+			sample.insert(sample.end(), chunk.begin(), chunk.end());
+		}
+
+		return lpz::huffman::compute_ratio(sample) >= INCOMPRESSIBLE_RATIO;
+	}
+
+	size_t varint_size(uint32_t value) {
+		size_t size = 1;
+		for (; value >= 0x80; value >>= 7) size++;
+		return size;
+	}
+
+	uint8_t* write_varint(uint8_t* op, uint32_t value) {
+		for (; value >= 0x80; value >>= 7) {
+			*op++ = static_cast<uint8_t>(value | 0x80);
+		}
+		*op++ = static_cast<uint8_t>(value);
+		return op;
+	}
+
+	// Returns bytes read
+	std::expected<size_t, lpz::Error> read_varint(std::span<const uint8_t> data, uint32_t& value) {
+		value = 0;
+		for (size_t i = 0; i < std::min(data.size(), MAX_VARINT_SIZE); i++) {
+			value |= static_cast<uint32_t>(data[i] & 0x7F) << (7 * i);
+			if (!(data[i] & 0x80)) return i + 1;
+		}
+		return std::unexpected(lpz::Error{ lpz::ErrorCode::InputError, "Invalid stream size" });
+	}
+
+	bool is_interleaved(lpz::StreamMode mode) {
+		using enum lpz::StreamMode;
+		return mode == HuffmanInterleaved || mode == CodedInterleaved || mode == RepeatInterleaved;
+	}
+
+	// Largest Coded stream, after the decoded size, for `size` symbols counted in `histogram`
+	// with their own code `lengths`
+	size_t huffman_size(const std::array<uint32_t, 256>& histogram, const lpz::huffman::CodeLengths& lengths, size_t size) {
+		uint8_t code[lpz::huffman::CODE_LENGTHS_BOUND];
+		return lpz::huffman::write_code_lengths(lengths, code) + lpz::huffman::encode_bits_bound(lpz::huffman::encoded_bits(histogram, lengths), size >= MIN_INTERLEAVED_STREAM);
+	}
+
+	// Writes field `f` of `block` as a split block stream, in the mode plan_block chose for it.
+	// Returns bytes written
+	std::expected<size_t, lpz::Error> write_stream(const lpz::PreparedBlock& block, size_t f, std::span<uint8_t> out) {
+
+		using namespace lpz;
+
+		const auto& data = block.fields[f];
+		const StreamMode mode = block.modes[f];
+
+		uint8_t* const stream = out.data() + STREAM_HEADER_SIZE;
+		uint8_t* op = stream;
+
+		switch (mode) {
+		case StreamMode::Raw:
+			memcpy(op, data.data(), data.size());
+			op += data.size();
+			break;
+		case StreamMode::Coded:
+		case StreamMode::CodedInterleaved:
+		case StreamMode::Repeat:
+		case StreamMode::RepeatInterleaved: {
+			op = write_varint(op, static_cast<uint32_t>(data.size()));
+			if (mode == StreamMode::Coded || mode == StreamMode::CodedInterleaved) {
+				op += huffman::write_code_lengths(block.lengths[f], op);
+			}
+
+			auto size = huffman::encode_bits_into(data, block.lengths[f], block.bits[f], out.subspan(op - out.data()), is_interleaved(mode));
+			if (!size) return std::unexpected(size.error());
+			op += *size;
+			break;
+		}
+		case StreamMode::Ans:
+			op = write_varint(op, static_cast<uint32_t>(data.size()));
+			memcpy(op, block.ans[f].data(), block.ans[f].size());
+			op += block.ans[f].size();
+			break;
+		default:
+			return std::unexpected(Error{ ErrorCode::InputError, "Unknown stream mode" });
+		}
+
+		uint32_t stored_size = static_cast<uint32_t>(op - stream);
+		out[0] = static_cast<uint8_t>(mode);
+		memcpy(out.data() + 1, &stored_size, sizeof(stored_size));
+
+		return STREAM_HEADER_SIZE + stored_size;
+	}
+
+	// One split block stream with its header parsed
+	struct StreamView {
+		lpz::StreamMode mode;
+		std::span<const uint8_t> body; // raw bytes, the whole legacy Huffman stream, or what follows the size and code
+		uint32_t decoded_size = 0;     // Coded, Repeat and Ans streams
+		bool has_code = false;         // whether the stream stores its own code
+		lpz::huffman::CodeLengths lengths;
+		size_t read = 0;               // bytes taken, stream header included
+	};
+
+	std::expected<StreamView, lpz::Error> parse_stream(std::span<const uint8_t> data) {
+
+		using namespace lpz;
+
+		if (data.size() < STREAM_HEADER_SIZE) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Truncated stream header" });
+		}
+
+		StreamHeader header{ static_cast<StreamMode>(data[0]), 0 };
+		memcpy(&header.size, data.data() + 1, sizeof(header.size));
+
+		if (data.size() - STREAM_HEADER_SIZE < header.size) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Truncated stream" });
+		}
+
+		StreamView view;
+		view.mode = header.mode;
+		view.body = data.subspan(STREAM_HEADER_SIZE, header.size);
+		view.read = STREAM_HEADER_SIZE + header.size;
+
+		switch (header.mode) {
+		case StreamMode::Raw:
+			break;
+		case StreamMode::Huffman:
+		case StreamMode::HuffmanInterleaved:
+			if (view.body.size() < view.lengths.size()) {
+				return std::unexpected(Error{ ErrorCode::InputError, "Truncated stream" });
+			}
+			memcpy(view.lengths.data(), view.body.data(), view.lengths.size());
+			view.has_code = true;
+			break;
+		case StreamMode::Coded:
+		case StreamMode::CodedInterleaved:
+		case StreamMode::Repeat:
+		case StreamMode::RepeatInterleaved:
+		case StreamMode::Ans: {
+			auto read = read_varint(view.body, view.decoded_size);
+			if (!read) return std::unexpected(read.error());
+			view.body = view.body.subspan(*read);
+
+			if (view.decoded_size > lz77::encode_bound(MAX_BLOCK)) {
+				return std::unexpected(Error{ ErrorCode::InputError, "Stream too large" });
+			}
+
+			if (header.mode == StreamMode::Coded || header.mode == StreamMode::CodedInterleaved) {
+				auto code = huffman::read_code_lengths(view.body, view.lengths);
+				if (!code) return std::unexpected(code.error());
+				view.body = view.body.subspan(*code);
+				view.has_code = true;
+			}
+			break;
+		}
+		default:
+			return std::unexpected(Error{ ErrorCode::InputError, "Unknown stream mode" });
+		}
+
+		return view;
+	}
 
-	if (data.size() > MAX_BLOCK) {
+	// Decodes a parsed stream into `out`. `previous` is the field's Huffman code before this
+	// stream
+	std::expected<void, lpz::Error> decode_stream(const StreamView& stream, std::vector<uint8_t>& out, const lpz::huffman::CodeLengths& previous, lpz::BlockDecodeTables& tables) {
+
+		using namespace lpz;
+
+		switch (stream.mode) {
+		case StreamMode::Raw:
+			out.assign(stream.body.begin(), stream.body.end());
+			return {};
+		case StreamMode::Huffman:
+		case StreamMode::HuffmanInterleaved: {
+			auto size = huffman::decoded_size(stream.body);
+			if (!size) return std::unexpected(size.error());
+			out.resize(*size);
+			auto decoded = stream.mode == StreamMode::Huffman
+				? huffman::decode_into(stream.body, out, tables.legacy)
+				: huffman::decode_interleaved_into(stream.body, out, tables.legacy);
+			if (!decoded) return std::unexpected(decoded.error());
+			return {};
+		}
+		case StreamMode::Ans: {
+			ans::NormalizedCounts counts;
+			auto read = ans::read_counts(stream.body, counts);
+			if (!read) return std::unexpected(read.error());
+
+			auto built = ans::build_decode_table(counts, tables.ans);
+			if (!built) return built;
+
+			out.resize(stream.decoded_size);
+			return ans::decode_stream_into(stream.body.subspan(*read), out, tables.ans);
+		}
+		default: {
+			const auto& lengths = stream.has_code ? stream.lengths : previous;
+			if (lengths == huffman::CodeLengths{}) {
+				return std::unexpected(Error{ ErrorCode::InputError, "Repeat stream without a previous code" });
+			}
+
+			auto table = huffman::get_decode_table(lengths, tables.huffman);
+			if (!table) return std::unexpected(table.error());
+
+			out.resize(stream.decoded_size);
+			return huffman::decode_bits_into(stream.body, out, **table, is_interleaved(stream.mode));
+		}
+		}
+	}
+
+}
+
+size_t lpz::compress_block_bound(size_t size) {
+	// Every split stream is stored raw unless coding it is smaller, which also covers Stored
+	// and Rle blocks
+	return SPLIT_HEADER_SIZE + lz77::encode_bound(size);
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::compress_block(std::span<const uint8_t> data, int level) {
+
+	BlockCompressScratch scratch;
+	std::vector<uint8_t> out(BLOCK_HEADER_SIZE + compress_block_bound(data.size()));
+
+	auto size = compress_block_into(data, out, scratch, level);
+	if (!size) return std::unexpected(size.error());
+
+	out.resize(*size);
+	return out;
+}
+
+std::expected<size_t, lpz::Error> lpz::compress_block_into(std::span<const uint8_t> data, std::span<uint8_t> out, BlockCompressScratch& scratch, int level) {
+
+	if (out.size() < BLOCK_HEADER_SIZE + compress_block_bound(data.size())) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Output buffer too small" });
+	}
+
+	auto prepared = prepare_block(data, scratch.prepared, scratch, level);
+	if (!prepared) return std::unexpected(prepared.error());
+
+	BlockCodes codes;
+	plan_block(scratch.prepared, codes);
+
+	return write_block(scratch.prepared, out);
+}
+
+std::expected<void, lpz::Error> lpz::prepare_block(std::span<const uint8_t> data, PreparedBlock& out, BlockCompressScratch& scratch, int level, size_t history, std::span<const lz77::LongMatch> long_matches, const BlockDictionary* dictionary) {
+
+	if (history > lz77::WINDOW_SIZE || history > data.size()) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Invalid block history" });
+	}
+
+	const size_t size = data.size() - history;
+
+	if (size > MAX_BLOCK) {
 		return std::unexpected(Error{ ErrorCode::InputError, "Input block too large" });
 	}
-	if (data.size() == 0) {
+	if (size == 0) {
 		return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
 	}
+	if (level < MIN_LEVEL || level > MAX_LEVEL) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Invalid compression level" });
+	}
+
+	out.size = size;
+	out.input = data.subspan(history);
+	out.type = history > 0 ? BlockType::LinkedSplit : BlockType::Split;
 
-	auto lz77_comp = lpz::lz77::encode(data);
+	// Linked blocks stay split blocks, since the blocks after them may reach past their start
+	if (history == 0 && is_run(out.input)) {
+		out.type = BlockType::Rle;
+		return {};
+	}
+
+	// Incompressible data only gets the fast parse, for any long repeats, and its literals skip
+	// the entropy stage
+	out.entropy = !looks_incompressible(out.input, scratch.sample);
+
+	if (scratch.lz77.size() < lz77::encode_bound(size)) {
+		scratch.lz77.resize(lz77::encode_bound(size));
+	}
+
+	// Unlinked blocks are parsed after the dictionary, which stays in front of the input from
+	// block to block
+	std::span<const uint8_t> parsed = data;
+	size_t parsed_history = history;
+	const lz77::DictionaryTables* tables = nullptr;
+
+	if (dictionary && history == 0) {
+		auto& input = scratch.dictionary_input;
+		if (scratch.dictionary_serial != dictionary->tables->serial || input.size() < dictionary->content.size()) {
+			input.assign(dictionary->content.begin(), dictionary->content.end());
+			scratch.dictionary_serial = dictionary->tables->serial;
+		}
+		input.resize(dictionary->content.size());
+		input.insert(input.end(), data.begin(), data.end());
+
+		parsed = input;
+		parsed_history = dictionary->content.size();
+		tables = dictionary->tables;
+	}
+
+	// The fast parse does not look for repeat offsets, so its blocks are not made to track them.
+	// Other parses that end up taking none are written without them too
+	const int parse_level = out.entropy ? level : MIN_LEVEL;
+	out.format = parse_level == MIN_LEVEL ? lz77::Format::Plain : lz77::Format::RepeatOffsets;
+
+	auto lz77_comp = lpz::lz77::encode_into(parsed, scratch.lz77, scratch.tables, parse_level, parsed_history, long_matches, out.format, tables);
 	if (!lz77_comp) throw std::runtime_error("Compression failed: " + lz77_comp.error().m);
-	auto huffman_comp = lpz::huffman::encode(*lz77_comp);
-	if (!huffman_comp) throw std::runtime_error("Compression failed: " + huffman_comp.error().m);
-	return *huffman_comp;
-	
+
+	if (out.format == lz77::Format::RepeatOffsets) {
+		out.format = lz77::drop_repeat_offsets({ scratch.lz77.data(), *lz77_comp }, scratch.tables);
+	}
+
+	if (!out.entropy && history == 0 && *lz77_comp >= size - size / MIN_MATCH_GAIN) {
+		out.type = BlockType::Stored;
+		return {};
+	}
+
+	auto split = lpz::lz77::split_fields({ scratch.lz77.data(), *lz77_comp }, out.fields);
+	if (!split) return std::unexpected(Error{ ErrorCode::InputError, "Compression failed: " + split.error().m });
+
+	for (size_t f = 0; f < lz77::FIELD_COUNT; f++) {
+
+		const auto& field = out.fields[f];
+
+		out.ans[f].clear();
+		if (f == lz77::LITERALS && !out.entropy) continue;
+
+		out.histograms[f] = create_histogram(field);
+		out.lengths[f] = field.empty() ? huffman::CodeLengths{} : huffman::get_code_lengths(out.histograms[f]);
+
+		if (field.empty()) continue;
+
+		// ANS is only tried where its estimate clearly beats the field's own Huffman code
+		auto counts = ans::normalize_counts(out.histograms[f], field.size());
+
+		uint8_t counts_header[ans::COUNTS_BOUND];
+		size_t counts_size = ans::write_counts(counts, counts_header);
+		size_t ans_estimate = counts_size + (ans::estimate_bits(out.histograms[f], counts) + 7) / 8;
+		size_t huffman_estimate = huffman_size(out.histograms[f], out.lengths[f], field.size());
+		if (ans_estimate + huffman_estimate / ANS_MIN_GAIN >= huffman_estimate) continue;
+
+		out.ans[f].resize(counts_size + ans::encode_stream_bound(field.size()));
+		memcpy(out.ans[f].data(), counts_header, counts_size);
+
+		auto ans_size = ans::encode_stream_into(field, counts, std::span<uint8_t>(out.ans[f]).subspan(counts_size));
+		if (!ans_size) return std::unexpected(Error{ ErrorCode::InputError, "Compression failed: " + ans_size.error().m });
+		out.ans[f].resize(counts_size + *ans_size);
+	}
+
+	return {};
 }
 
-std::expected<std::vector<uint8_t>, lpz::Error> lpz::decompress_block(std::span<const uint8_t> data) {
+void lpz::plan_block(PreparedBlock& block, BlockCodes& codes) {
+
+	if (block.type == BlockType::Stored || block.type == BlockType::Rle) return;
+
+	size_t payload = SPLIT_HEADER_SIZE;
+
+	for (size_t f = 0; f < lz77::FIELD_COUNT; f++) {
+
+		const size_t size = block.fields[f].size();
+
+		StreamMode mode = StreamMode::Raw;
+		size_t cost = size;
+
+		if (size > 0 && (f != lz77::LITERALS || block.entropy)) {
+			const bool interleaved = size >= MIN_INTERLEAVED_STREAM;
+			const size_t size_bytes = varint_size(static_cast<uint32_t>(size));
 
-	if (data.size() == 0) {
+			size_t repeat_bits = huffman::encoded_bits(block.histograms[f], codes.lengths[f]);
+			size_t repeat_cost = repeat_bits == std::numeric_limits<size_t>::max()
+				? repeat_bits
+				: size_bytes + huffman::encode_bits_bound(repeat_bits, interleaved);
+
+			size_t own_bits = huffman::encoded_bits(block.histograms[f], block.lengths[f]);
+			size_t own_cost = size_bytes + huffman_size(block.histograms[f], block.lengths[f], size);
+
+			// Ties go to the modes that decode with less work
+			if (repeat_cost < cost) {
+				mode = interleaved ? StreamMode::RepeatInterleaved : StreamMode::Repeat;
+				cost = repeat_cost;
+				block.bits[f] = repeat_bits;
+			}
+			if (own_cost < cost) {
+				mode = interleaved ? StreamMode::CodedInterleaved : StreamMode::Coded;
+				cost = own_cost;
+				block.bits[f] = own_bits;
+			}
+			if (!block.ans[f].empty() && size_bytes + block.ans[f].size() + cost / ANS_MIN_GAIN < cost) {
+				mode = StreamMode::Ans;
+				cost = size_bytes + block.ans[f].size();
+			}
+		}
+
+		block.modes[f] = mode;
+		payload += cost;
+	}
+
+	// Stored before the codes are advanced, as the block will carry none
+	if (block.type == BlockType::Split && payload >= block.size) {
+		block.type = BlockType::Stored;
+		return;
+	}
+
+	for (size_t f = 0; f < lz77::FIELD_COUNT; f++) {
+
+		const StreamMode mode = block.modes[f];
+
+		// Raw and ANS streams leave the field's Huffman code as it was
+		if (mode == StreamMode::Repeat || mode == StreamMode::RepeatInterleaved) {
+			block.lengths[f] = codes.lengths[f];
+		}
+		else if (mode == StreamMode::Coded || mode == StreamMode::CodedInterleaved) {
+			codes.lengths[f] = block.lengths[f];
+		}
+	}
+}
+
+std::expected<size_t, lpz::Error> lpz::write_block(const PreparedBlock& block, std::span<uint8_t> out) {
+
+	if (out.size() < BLOCK_HEADER_SIZE + compress_block_bound(block.size)) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Output buffer too small" });
+	}
+
+	auto payload = out.subspan(BLOCK_HEADER_SIZE);
+	size_t pos = 0;
+
+	uint32_t decompressed_size = static_cast<uint32_t>(block.size);
+
+	switch (block.type) {
+	case BlockType::Stored:
+		memcpy(payload.data(), block.input.data(), block.size);
+		pos = block.size;
+		break;
+	case BlockType::Rle:
+		memcpy(payload.data(), &decompressed_size, sizeof(decompressed_size));
+		payload[sizeof(decompressed_size)] = block.input[0];
+		pos = RLE_PAYLOAD_SIZE;
+		break;
+	default: {
+		const uint32_t size_word = decompressed_size | (block.format == lz77::Format::RepeatOffsets ? SPLIT_REPEAT_OFFSETS : 0);
+		memcpy(payload.data(), &size_word, sizeof(size_word));
+		pos = sizeof(size_word);
+
+		for (size_t f = 0; f < lz77::FIELD_COUNT; f++) {
+			auto written = write_stream(block, f, payload.subspan(pos));
+			if (!written) return std::unexpected(Error{ ErrorCode::InputError, "Compression failed: " + written.error().m });
+			pos += *written;
+		}
+		break;
+	}
+	}
+
+	if (pos > MAX_BLOCK_PAYLOAD) {
+		return std::unexpected(Error{ ErrorCode::SystemError, "Compressed block too large" });
+	}
+
+	write_block_header(out.data(), { block.type, static_cast<uint32_t>(pos) });
+	return BLOCK_HEADER_SIZE + pos;
+}
+
+std::expected<void, lpz::Error> lpz::entropy_decode_block(Block block, DecodedBlock& out, BlockCodes& codes, BlockDecodeTables& tables) {
+
+	if (block.payload.size() == 0) {
 		return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
 	}
 
-	auto lz77_comp = lpz::huffman::decode(data);
-	if (!lz77_comp) return std::unexpected(Error{ ErrorCode::InputError,"Decompression failed: " + lz77_comp.error().m });
-	auto decomp = lpz::lz77::decode(*lz77_comp);
-	if (!decomp) return std::unexpected(Error{ ErrorCode::InputError,"Decompression failed: " + decomp.error().m });
+	out.type = block.type;
+
+	switch (block.type) {
+	case BlockType::Compressed: {
+		auto lz77_size = huffman::decoded_size(block.payload);
+		if (!lz77_size) return std::unexpected(lz77_size.error());
+		if (*lz77_size > lz77::encode_bound(MAX_BLOCK)) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Block too large" });
+		}
+
+		out.lz77.resize(*lz77_size);
+
+		auto lz77_comp = huffman::decode_into(block.payload, out.lz77, tables.legacy);
+		if (!lz77_comp) return std::unexpected(lz77_comp.error());
+
+		auto size = lz77::decoded_size(out.lz77);
+		if (!size) return std::unexpected(size.error());
+
+		out.size = *size;
+		out.format = lz77::Format::Plain;
+		return {};
+	}
+	case BlockType::Split:
+	case BlockType::LinkedSplit: {
+		if (block.payload.size() < SPLIT_HEADER_SIZE) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Truncated split block" });
+		}
+
+		uint32_t size_word;
+		memcpy(&size_word, block.payload.data(), sizeof(size_word));
+		if ((size_word & ~(SPLIT_SIZE_MASK | SPLIT_REPEAT_OFFSETS)) != 0 || (size_word & SPLIT_SIZE_MASK) > MAX_BLOCK) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Block too large" });
+		}
+
+		const uint32_t size = size_word & SPLIT_SIZE_MASK;
+		size_t pos = sizeof(size_word);
+		for (size_t f = 0; f < lz77::FIELD_COUNT; f++) {
+			auto stream = parse_stream(block.payload.subspan(pos));
+			if (!stream) return std::unexpected(stream.error());
+
+			auto decoded = decode_stream(*stream, out.fields[f], codes.lengths[f], tables);
+			if (!decoded) return decoded;
+
+			if (stream->has_code) codes.lengths[f] = stream->lengths;
+			pos += stream->read;
+		}
+
+		if (pos != block.payload.size()) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Trailing data in split block" });
+		}
+
+		out.size = size;
+		out.format = size_word & SPLIT_REPEAT_OFFSETS ? lz77::Format::RepeatOffsets : lz77::Format::Plain;
+		return {};
+	}
+	case BlockType::Stored:
+		if (block.payload.size() > MAX_BLOCK) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Block too large" });
+		}
+
+		out.stored = block.payload;
+		out.size = block.payload.size();
+		return {};
+	case BlockType::Rle: {
+		if (block.payload.size() != RLE_PAYLOAD_SIZE) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Invalid RLE block" });
+		}
+
+		uint32_t size;
+		memcpy(&size, block.payload.data(), sizeof(size));
+		if (size > MAX_BLOCK) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Block too large" });
+		}
+		// Empty blocks are never written as runs
+		if (size == 0) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Invalid RLE block" });
+		}
+
+		out.run = block.payload[sizeof(size)];
+		out.size = size;
+		return {};
+	}
+	default:
+		return std::unexpected(Error{ ErrorCode::InputError, "Not a data block" });
+	}
+}
+
+std::expected<void, lpz::Error> lpz::advance_block_codes(Block block, BlockCodes& codes) {
+
+	// Only split blocks carry codes
+	if (block.type != BlockType::Split && block.type != BlockType::LinkedSplit) return {};
+
+	if (block.payload.size() < SPLIT_HEADER_SIZE) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Truncated split block" });
+	}
+
+	size_t pos = sizeof(uint32_t);
+	for (size_t f = 0; f < lz77::FIELD_COUNT; f++) {
+		auto stream = parse_stream(block.payload.subspan(pos));
+		if (!stream) return std::unexpected(stream.error());
+
+		if (stream->has_code) codes.lengths[f] = stream->lengths;
+		pos += stream->read;
+	}
+
+	return {};
+}
+
+std::expected<size_t, lpz::Error> lpz::expand_block(const DecodedBlock& decoded, std::span<uint8_t> out, size_t history, std::span<const uint8_t> dictionary) {
+
+	if (history > out.size()) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Block history past the output" });
+	}
+
+	// Only linked blocks look at the output before them
+	if (decoded.type != BlockType::LinkedSplit) {
+		out = out.subspan(history);
+		history = 0;
+	}
+
+	if (out.size() - history < decoded.size) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Output buffer too small" });
+	}
+
+	out = out.first(history + decoded.size);
+
+	std::expected<size_t, Error> written;
+
+	if (decoded.type == BlockType::Stored) {
+		memcpy(out.data(), decoded.stored.data(), decoded.size);
+		return decoded.size;
+	}
+	else if (decoded.type == BlockType::Rle) {
+		memset(out.data(), decoded.run, decoded.size);
+		return decoded.size;
+	}
+	else if (decoded.type == BlockType::Split || decoded.type == BlockType::LinkedSplit) {
+		lz77::FieldsView fields;
+		std::copy(decoded.fields.begin(), decoded.fields.end(), fields.begin());
+		written = lz77::decode_fields_into(fields, out, history, decoded.format, decoded.type == BlockType::Split ? dictionary : std::span<const uint8_t>{});
+	}
+	else {
+		written = lz77::decode_into(decoded.lz77, out, decoded.format);
+	}
+
+	if (!written) return written;
+	if (*written != decoded.size) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Block size mismatch" });
+	}
+
+	return written;
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::decompress_block(std::span<const uint8_t> data) {
+
+	auto header = read_block_header(data);
+	if (!header) return std::unexpected(header.error());
+
+	BlockCodes codes;
+	BlockDecompressScratch scratch;
+	std::vector<uint8_t> out;
+
+	auto res = decompress_block({ header->type, data.subspan(BLOCK_HEADER_SIZE, header->size) }, out, codes, scratch);
+	if (!res) return std::unexpected(res.error());
+
+	return out;
+}
+
+std::expected<size_t, lpz::Error> lpz::decompress_block_into(Block block, std::span<uint8_t> out, BlockCodes& codes, BlockDecompressScratch& scratch, size_t history, std::span<const uint8_t> dictionary) {
+
+	auto decoded = entropy_decode_block(block, scratch.decoded, codes, scratch.tables);
+	if (!decoded) return std::unexpected(Error{ ErrorCode::InputError, "Decompression failed: " + decoded.error().m });
+
+	auto decomp = expand_block(scratch.decoded, out, history, dictionary);
+	if (!decomp) return std::unexpected(Error{ ErrorCode::InputError, "Decompression failed: " + decomp.error().m });
 	return *decomp;
-}
\ No newline at end of file
+}
+
+std::expected<void, lpz::Error> lpz::decompress_block(Block block, std::vector<uint8_t>& out, BlockCodes& codes, BlockDecompressScratch& scratch) {
+
+	auto decoded = entropy_decode_block(block, scratch.decoded, codes, scratch.tables);
+	if (!decoded) return std::unexpected(Error{ ErrorCode::InputError, "Decompression failed: " + decoded.error().m });
+
+	if (block.type != BlockType::LinkedSplit) out.clear();
+
+	const size_t history = out.size();
+	out.resize(history + scratch.decoded.size);
+
+	auto decomp = expand_block(scratch.decoded, out, history);
+	if (!decomp) return std::unexpected(Error{ ErrorCode::InputError, "Decompression failed: " + decomp.error().m });
+	return {};
+}
+
+size_t lpz::trim_history(std::vector<uint8_t>& history, size_t keep) {
+
+	if (history.size() <= 2 * keep) return 0;
+
+	const size_t drop = history.size() - keep;
+	history.erase(history.begin(), history.begin() + drop);
+	return drop;
+}
@@ -1,13 +1,228 @@
 #pragma once
+#include <array>
 #include <string>
 #include <vector>
 #include <span>
 #include <expected>
 #include "lpz.h"
+#include "lz77.h"
+#include "huffman.h"
+#include "ans.h"
 
 namespace lpz {
 
-	std::expected<std::vector<uint8_t>, Error> compress_block(std::span<const uint8_t> data);
+	// Every block in a stream is preceded by a little-endian u32: the low 24 bits hold the
+	// payload size and the high 8 bits the block type. Type 0 keeps older streams readable.
+	enum class BlockType : uint8_t {
+		Compressed = 0, // LZ77 stream, Huffman coded as a whole
+		SeekTable = 1,
+		Split = 2,      // LZ77 fields in separate streams, each Huffman coded or stored
+		LinkedSplit = 3, // as Split, with matches reaching back into the output of the blocks
+		                 // before, up to lz77::WINDOW_SIZE bytes but not past the last unlinked one
+		Stored = 4,      // the data as is
+		Rle = 5,         // u32 decompressed size and the one byte repeated
+		Window = 6,      // u32 farthest back the linked blocks after it reach, when past
+		                 // lz77::WINDOW_SIZE; decoders keep that much output
+		Dictionary = 7,  // u32 id of the dictionary the stream was compressed with, which its
+		                 // unlinked split blocks reach back into and whose codes they start from
+	};
+
+	// Whether blocks of `type` carry data, rather than metadata that decoders skip
+	bool is_data_block(BlockType type);
+
+	constexpr size_t BLOCK_HEADER_SIZE = sizeof(uint32_t);
+	constexpr uint32_t BLOCK_SIZE_BITS = 24;
+	constexpr uint32_t MAX_BLOCK_PAYLOAD = (1u << BLOCK_SIZE_BITS) - 1;
+
+	struct BlockHeader {
+		BlockType type;
+		uint32_t size;
+	};
+
+	// A block's payload and the type it is coded with
+	struct Block {
+		BlockType type;
+		std::span<const uint8_t> payload;
+	};
+
+	// Seek table payload: one SeekEntry per compressed block, then the entry count and magic,
+	// so a reader can find the table from the last 8 bytes of the stream.
+	constexpr uint32_t SEEK_TABLE_MAGIC = 0x53'5A'50'4C; // "LPZS"
+
+	struct SeekEntry {
+		uint32_t compressed_size; // including the block header
+		uint32_t decompressed_size;
+	};
+
+	constexpr size_t SEEK_FOOTER_SIZE = 2 * sizeof(uint32_t);
+	constexpr size_t MAX_SEEK_ENTRIES = (MAX_BLOCK_PAYLOAD - SEEK_FOOTER_SIZE) / sizeof(SeekEntry);
+
+	size_t seek_table_size(size_t entries);
+
+	void write_block_header(uint8_t* out, BlockHeader header);
+	void write_block_header(std::vector<uint8_t>& out, BlockHeader header);
+
+	constexpr size_t WINDOW_BLOCK_SIZE = BLOCK_HEADER_SIZE + sizeof(uint32_t);
+
+	// Writes the window block, header included; `out` must hold WINDOW_BLOCK_SIZE bytes
+	void write_window_block(uint8_t* out, size_t window);
+	// Reads the window from a window block's payload
+	std::expected<size_t, Error> read_window_block(std::span<const uint8_t> payload);
+
+	constexpr size_t DICTIONARY_BLOCK_SIZE = BLOCK_HEADER_SIZE + sizeof(uint32_t);
+
+	// Writes the dictionary block, header included; `out` must hold DICTIONARY_BLOCK_SIZE bytes
+	void write_dictionary_block(uint8_t* out, uint32_t id);
+	// Reads the dictionary id from a dictionary block's payload
+	std::expected<uint32_t, Error> read_dictionary_block(std::span<const uint8_t> payload);
+	// Writes the seek table block, header included; `out` must hold seek_table_size(entries.size()) bytes
+	void write_seek_table(uint8_t* out, std::span<const SeekEntry> entries);
+	void write_seek_table(std::vector<uint8_t>& out, std::span<const SeekEntry> entries);
+	std::expected<BlockHeader, Error> decode_block_header(uint32_t value);
+	// Decodes the header at the start of `data` and checks that its payload is present
+	std::expected<BlockHeader, Error> read_block_header(std::span<const uint8_t> data);
+
+	// Split block payload: the decompressed size, then for each LZ77 field a stream header
+	// followed by that stream's bytes. SPLIT_REPEAT_OFFSETS in the size marks fields in the
+	// lz77::Format::RepeatOffsets format, which blocks are written in when their matches take
+	// repeat codes
+	constexpr uint32_t SPLIT_REPEAT_OFFSETS = 1u << 31;
+	constexpr uint32_t SPLIT_SIZE_MASK = (1u << BLOCK_SIZE_BITS) - 1;
+
+	enum class StreamMode : uint8_t {
+		Raw = 0,
+		Huffman = 1,            // raw code lengths and u32 decoded size, then one bitstream
+		HuffmanInterleaved = 2, // as Huffman, with four interleaved bitstreams
+		Coded = 3,              // varint decoded size and compact code lengths, then one bitstream
+		CodedInterleaved = 4,
+		Repeat = 5,             // varint decoded size, then bits in the field's previous code
+		RepeatInterleaved = 6,
+		Ans = 7,                // varint decoded size, ANS normalized counts, then the bitstream
+	};
+
+	struct StreamHeader {
+		StreamMode mode;
+		uint32_t size;
+	};
+
+	constexpr size_t STREAM_HEADER_SIZE = sizeof(uint8_t) + sizeof(uint32_t);
+	constexpr size_t SPLIT_HEADER_SIZE = sizeof(uint32_t) + lz77::FIELD_COUNT * STREAM_HEADER_SIZE;
+
+	// Code of each field as of some block: that of the last stream of the field, in any
+	// earlier block, that stored one. Repeat streams are decoded with it, so the code has to
+	// be carried through the blocks in stream order.
+	struct BlockCodes {
+		std::array<huffman::CodeLengths, lz77::FIELD_COUNT> lengths = {};
+	};
+
+	// A block parsed and measured but not yet entropy coded. Blocks are prepared independently,
+	// planned in stream order since each may repeat the codes before it, then written
+	// independently again.
+	struct PreparedBlock {
+		size_t size = 0; // decompressed size
+		BlockType type = BlockType::Split; // Stored and Rle blocks skip the fields below
+		std::span<const uint8_t> input;    // the block's data, which Stored and Rle blocks are written from
+		bool entropy = true; // false when a sample showed the data will not entropy code: literals stay raw
+		lz77::Format format = lz77::Format::RepeatOffsets; // of the fields
+		lz77::Fields fields;
+		std::array<std::array<uint32_t, 256>, lz77::FIELD_COUNT> histograms;
+		std::array<huffman::CodeLengths, lz77::FIELD_COUNT> lengths; // code each field is written with
+		std::array<StreamMode, lz77::FIELD_COUNT> modes;
+		std::array<size_t, lz77::FIELD_COUNT> bits; // coded size of each field, for Huffman modes
+		std::array<std::vector<uint8_t>, lz77::FIELD_COUNT> ans; // ANS counts and bitstream, if they may beat Huffman
+	};
+
+	// Content that unlinked blocks are parsed as following, with its match finder tables
+	// digested for the level the blocks are parsed at
+	struct BlockDictionary {
+		std::span<const uint8_t> content;
+		const lz77::DictionaryTables* tables = nullptr;
+	};
+
+	// Work buffers reused from block to block, so steady-state block coding does not allocate
+	struct BlockCompressScratch {
+		lz77::EncodeTables tables;
+		std::vector<uint8_t> lz77;
+		std::vector<uint8_t> sample;
+		PreparedBlock prepared;
+		std::vector<uint8_t> dictionary_input; // dictionary content, then the block
+		uint64_t dictionary_serial = 0;        // of the content dictionary_input starts with
+	};
+
+	// A data block after entropy decoding, ready to be expanded
+	struct DecodedBlock {
+		BlockType type = BlockType::Compressed;
+		std::vector<uint8_t> lz77; // Compressed blocks
+		lz77::Fields fields;       // Split blocks
+		std::span<const uint8_t> stored; // Stored blocks, pointing into their payload
+		uint8_t run = 0;           // Rle blocks
+		size_t size = 0;           // decompressed size
+		lz77::Format format = lz77::Format::Plain; // of the LZ77 stream or fields
+	};
+
+	// Tables of the codes recent blocks used, shared by all fields. Streams in the formats
+	// that store 256 raw lengths have a table of their own
+	struct BlockDecodeTables {
+		huffman::DecodeTableCache huffman;
+		huffman::DecodeTable legacy;
+		ans::DecodeTable ans;
+	};
+
+	struct BlockDecompressScratch {
+		BlockDecodeTables tables;
+		DecodedBlock decoded;
+	};
+
+	// Largest compressed payload of a block of `size` bytes, excluding its header
+	size_t compress_block_bound(size_t size);
+
+	// Compresses into a block with its header. Blocks compressed on their own never repeat a code
+	std::expected<std::vector<uint8_t>, Error> compress_block(std::span<const uint8_t> data, int level = DEFAULT_LEVEL);
+	// Writes the block header and payload to `out`, which must hold BLOCK_HEADER_SIZE +
+	// compress_block_bound(data.size()) bytes. Returns bytes written, header included
+	std::expected<size_t, Error> compress_block_into(std::span<const uint8_t> data, std::span<uint8_t> out, BlockCompressScratch& scratch, int level = DEFAULT_LEVEL);
+
+	// The three steps of compress_block_into, for a run of blocks that share codes. Parses
+	// `data` and finds the code each field would get on its own. A nonzero `history` makes a
+	// linked block: the first `history` bytes of `data` end the block before and are only
+	// matched against. Blocks without history that are one repeated byte, or that a sample
+	// shows the parse and entropy stages cannot shrink, become Rle and Stored blocks, and
+	// `data` has to outlive write_block. `long_matches` come from lz77::find_long_matches.
+	// Blocks without history match into the end of `dictionary` when given one
+	std::expected<void, Error> prepare_block(std::span<const uint8_t> data, PreparedBlock& out, BlockCompressScratch& scratch, int level = DEFAULT_LEVEL, size_t history = 0, std::span<const lz77::LongMatch> long_matches = {}, const BlockDictionary* dictionary = nullptr);
+	// Chooses how each field is stored, given the codes of the blocks before, and advances `codes`.
+	// Unlinked blocks that would not come out smaller than their data are stored instead
+	void plan_block(PreparedBlock& block, BlockCodes& codes);
+	// Writes the planned block with its header; `out` must hold BLOCK_HEADER_SIZE +
+	// compress_block_bound(block.size) bytes. Returns bytes written, header included
+	std::expected<size_t, Error> write_block(const PreparedBlock& block, std::span<uint8_t> out);
+
+	// Decompresses a block with its header, as written by compress_block
 	std::expected<std::vector<uint8_t>, Error> decompress_block(std::span<const uint8_t> data);
+	// `codes` holds the codes of the blocks before and is advanced past this one. `out` starts
+	// with `history` bytes of earlier output for linked blocks to reach into, and the block is
+	// written after them. Unlinked split blocks reach past the start of `out` into `dictionary`
+	std::expected<size_t, Error> decompress_block_into(Block block, std::span<uint8_t> out, BlockCodes& codes, BlockDecompressScratch& scratch, size_t history = 0, std::span<const uint8_t> dictionary = {});
+	// Decodes onto the end of `out`; reusing `out` keeps its capacity between blocks. Linked
+	// blocks reach back into what `out` already holds, which other blocks clear first
+	std::expected<void, Error> decompress_block(Block block, std::vector<uint8_t>& out, BlockCodes& codes, BlockDecompressScratch& scratch);
+
+	// The two halves of block decompression, so the output offset of every block can be known
+	// before any is expanded. Entropy decoding fills `out` and its decompressed size, and
+	// advances `codes` as above
+	std::expected<void, Error> entropy_decode_block(Block block, DecodedBlock& out, BlockCodes& codes, BlockDecodeTables& tables);
+	// Expands into `out` after its first `history` bytes, which linked blocks may reach into,
+	// as unlinked split blocks may into `dictionary`; `out` must hold history + decoded.size
+	// bytes. Returns bytes written
+	std::expected<size_t, Error> expand_block(const DecodedBlock& decoded, std::span<uint8_t> out, size_t history = 0, std::span<const uint8_t> dictionary = {});
+
+	// Advances `codes` past `block` from its stream headers alone, so blocks that follow can be
+	// decoded without decoding this one
+	std::expected<void, Error> advance_block_codes(Block block, BlockCodes& codes);
+
+	// Keeps the last `keep` bytes of `history`, the data linked blocks reach back into, once it
+	// holds more than twice that. Trimming no sooner moves each byte once on average, and it
+	// never holds more than 2 * keep bytes before the next data goes on. Returns bytes dropped
+	size_t trim_history(std::vector<uint8_t>& history, size_t keep);
 
 }
\ No newline at end of file
@@ -0,0 +1,42 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include "lpz.h"
+#include "block.h"
+
+namespace lpz {
+
+	// One set of block work buffers per worker thread, grown on demand and kept for reuse
+	struct CompressContext::State {
+		std::vector<BlockCompressScratch> workers;
+		std::vector<SeekEntry> seek_entries;
+		lz77::LongMatchTable long_matches;
+		std::vector<lz77::LongMatch> block_long_matches;
+
+		void reserve(unsigned threads) {
+			if (workers.size() < threads) workers.resize(threads);
+		}
+	};
+
+	struct DecompressContext::State {
+		std::vector<BlockDecompressScratch> workers;
+
+		void reserve(unsigned threads) {
+			if (workers.size() < threads) workers.resize(threads);
+		}
+	};
+
+	struct Dictionary::State {
+		std::vector<uint8_t> content;
+		BlockCodes codes; // that blocks start from
+		uint32_t id = 0;
+
+		// Match finder tables for the content, digested once for MAX_LEVEL and once for the
+		// level the other levels are first used at
+		mutable std::array<std::once_flag, 2> digested;
+		mutable std::array<lz77::DictionaryTables, 2> tables;
+
+		const lz77::DictionaryTables& tables_for(int level) const;
+	};
+
+}
@@ -0,0 +1,274 @@
+#include "lpz.h"
+#include "block.h"
+#include "lz77.h"
+#include "huffman.h"
+#include "context.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+namespace {
+
+	// Trained dictionaries start with this, then the compact code lengths of each LZ77 field,
+	// then the content
+	constexpr uint32_t DICTIONARY_MAGIC = 0x44'5A'50'4C; // "LPZD"
+
+	// Training scores SEGMENT_SIZE byte segments of the samples by the DMER_SIZE byte strings
+	// in them: each distinct one adds the number of samples it occurs in. The strings are
+	// counted by a hash of 2^DMER_HASH_BITS buckets
+	constexpr size_t DMER_SIZE = 8;
+	constexpr size_t SEGMENT_SIZE = 64;
+	constexpr uint32_t DMER_HASH_BITS = 20;
+
+	// Samples are split into about one epoch per this many segments of content, and each
+	// round picks the best segment of every epoch, so the content is drawn from all samples
+	constexpr size_t SEGMENTS_PER_EPOCH = 4;
+
+	// Histogram counts are scaled to at most this many bits before codes are built from them
+	constexpr int MAX_COUNT_BITS = 24;
+
+	uint32_t dmer_hash(const uint8_t* p) {
+		uint64_t value;
+		memcpy(&value, p, sizeof(value));
+		return static_cast<uint32_t>((value * 0x9E3779B97F4A7C15ull) >> (64 - DMER_HASH_BITS));
+	}
+
+	uint32_t dictionary_id(std::span<const uint8_t> data) {
+
+		uint64_t hash = data.size();
+		size_t i = 0;
+		for (; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+			uint64_t word;
+			memcpy(&word, data.data() + i, sizeof(word));
+			hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+			hash ^= hash >> 29;
+		}
+		for (; i < data.size(); i++) {
+			hash = (hash ^ data[i]) * 0x9E3779B97F4A7C15ull;
+			hash ^= hash >> 29;
+		}
+
+		return static_cast<uint32_t>(hash ^ (hash >> 32));
+	}
+
+	struct Segment {
+		size_t begin = 0;
+		uint64_t score = 0;
+	};
+
+	// Best segment starting in data[begin, end). `active` counts the strings of the segment
+	// under the window, and is left all zero again
+	Segment best_segment(std::span<const uint8_t> data, size_t begin, size_t end, const std::vector<uint32_t>& frequencies, std::vector<uint16_t>& active) {
+
+		Segment best{ begin, 0 };
+		uint64_t score = 0;
+		size_t window = begin;
+
+		for (size_t p = begin; p < end && p + DMER_SIZE <= data.size(); p++) {
+
+			uint32_t h = dmer_hash(data.data() + p);
+			if (active[h]++ == 0) score += frequencies[h];
+
+			if (p + DMER_SIZE - window > SEGMENT_SIZE) {
+				uint32_t out = dmer_hash(data.data() + window);
+				if (--active[out] == 0) score -= frequencies[out];
+				window++;
+			}
+
+			if (score > best.score) best = { window, score };
+		}
+
+		for (size_t p = window; p < end && p + DMER_SIZE <= data.size(); p++) {
+			active[dmer_hash(data.data() + p)] = 0;
+		}
+
+		return best;
+	}
+
+	// Content of at most `max_size` bytes for `samples`, which `data` holds back to back. The
+	// best segment of each epoch is taken in turn, and its strings score nothing after, until
+	// the content is full or no segment scores. The first segments taken go last, where
+	// matches reach them with the shortest distances
+	std::vector<uint8_t> select_content(std::span<const uint8_t> data, std::span<const std::span<const uint8_t>> samples, size_t max_size) {
+
+		std::vector<uint32_t> frequencies(size_t(1) << DMER_HASH_BITS);
+		{
+			std::vector<uint32_t> counted(frequencies.size()); // sample, plus one, each string was last counted for
+			size_t start = 0;
+			for (size_t s = 0; s < samples.size(); s++) {
+				for (size_t p = start; p + DMER_SIZE <= start + samples[s].size(); p++) {
+					uint32_t h = dmer_hash(data.data() + p);
+					if (counted[h] == s + 1) continue;
+					counted[h] = static_cast<uint32_t>(s + 1);
+					frequencies[h]++;
+				}
+				start += samples[s].size();
+			}
+		}
+
+		const size_t epochs = std::clamp<size_t>(max_size / (SEGMENTS_PER_EPOCH * SEGMENT_SIZE), 1, std::max<size_t>(data.size() / (SEGMENTS_PER_EPOCH * SEGMENT_SIZE), 1));
+		const size_t epoch_size = data.size() / epochs;
+
+		std::vector<uint16_t> active(frequencies.size());
+		std::vector<std::span<const uint8_t>> taken;
+		size_t size = 0;
+		size_t idle = 0; // epochs in a row without a segment that scores
+
+		for (size_t epoch = 0; size < max_size && idle < epochs; epoch = (epoch + 1) % epochs) {
+
+			const size_t begin = epoch * epoch_size;
+			const size_t end = epoch + 1 == epochs ? data.size() : begin + epoch_size;
+
+			Segment best = best_segment(data, begin, end, frequencies, active);
+			if (best.score == 0) {
+				idle++;
+				continue;
+			}
+			idle = 0;
+
+			auto segment = data.subspan(best.begin, std::min({ SEGMENT_SIZE, data.size() - best.begin, max_size - size }));
+			for (size_t p = 0; p + DMER_SIZE <= segment.size(); p++) {
+				frequencies[dmer_hash(segment.data() + p)] = 0;
+			}
+
+			taken.push_back(segment);
+			size += segment.size();
+		}
+
+		std::vector<uint8_t> content;
+		content.reserve(size);
+		for (auto segment = taken.rbegin(); segment != taken.rend(); ++segment) {
+			content.insert(content.end(), segment->begin(), segment->end());
+		}
+
+		return content;
+	}
+
+}
+
+lpz::Dictionary::Dictionary(std::unique_ptr<State> state) : state_(std::move(state)) {}
+lpz::Dictionary::~Dictionary() = default;
+lpz::Dictionary::Dictionary(Dictionary&&) noexcept = default;
+lpz::Dictionary& lpz::Dictionary::operator=(Dictionary&&) noexcept = default;
+
+uint32_t lpz::Dictionary::id() const {
+	return state_->id;
+}
+
+const lpz::lz77::DictionaryTables& lpz::Dictionary::State::tables_for(int level) const {
+
+	// Every level but MAX_LEVEL finds matches in the head and chain tables alone, which are
+	// the same whichever of them digests the content
+	const size_t slot = level == MAX_LEVEL ? 1 : 0;
+	std::call_once(digested[slot], [&] { lz77::digest_dictionary(content, level, tables[slot]); });
+	return tables[slot];
+}
+
+std::expected<lpz::Dictionary, lpz::Error> lpz::load_dictionary(std::span<const uint8_t> data) {
+
+	auto state = std::make_unique<Dictionary::State>();
+	std::span<const uint8_t> content = data;
+
+	uint32_t magic = 0;
+	if (data.size() >= sizeof(magic)) memcpy(&magic, data.data(), sizeof(magic));
+
+	if (magic == DICTIONARY_MAGIC) {
+
+		size_t pos = sizeof(magic);
+		for (auto& lengths : state->codes.lengths) {
+
+			auto read = huffman::read_code_lengths(data.subspan(pos), lengths);
+			if (!read) return std::unexpected(Error{ ErrorCode::InputError, "Corrupt dictionary: " + read.error().m });
+			pos += *read;
+
+			// Fields the samples never had data for have no code
+			if (std::ranges::all_of(lengths, [](uint8_t length) { return length == 0; })) continue;
+
+			huffman::DecodeTable table;
+			auto built = huffman::build_decode_table(lengths, table);
+			if (!built) return std::unexpected(Error{ ErrorCode::InputError, "Corrupt dictionary: " + built.error().m });
+		}
+
+		content = data.subspan(pos);
+	}
+
+	if (content.empty()) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Dictionary empty" });
+	}
+	if (content.size() > MAX_DICTIONARY) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Dictionary too large" });
+	}
+
+	state->content.assign(content.begin(), content.end());
+	state->id = dictionary_id(data);
+
+	return Dictionary(std::move(state));
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::train_dictionary(std::span<const std::span<const uint8_t>> samples, size_t max_size, int level) {
+
+	if (max_size == 0 || max_size > MAX_DICTIONARY) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Invalid dictionary size" });
+	}
+	if (level < MIN_LEVEL || level > MAX_LEVEL) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Invalid compression level" });
+	}
+
+	std::vector<uint8_t> data;
+	for (auto sample : samples) data.insert(data.end(), sample.begin(), sample.end());
+
+	auto content = select_content(data, samples, max_size);
+	if (content.empty()) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Samples too small to train a dictionary on" });
+	}
+
+	auto dictionary = load_dictionary(content);
+	if (!dictionary) return std::unexpected(dictionary.error());
+
+	// Codes are fitted to the fields of the samples parsed with the content. Every byte value
+	// keeps a code, so that blocks can start from them whatever their data
+	const Dictionary::State& state = dictionary->state();
+	BlockDictionary block_dictionary{ state.content, &state.tables_for(level) };
+	BlockCompressScratch scratch;
+
+	std::array<std::array<uint64_t, 256>, lz77::FIELD_COUNT> counts = {};
+
+	for (auto sample : samples) {
+
+		if (sample.empty()) continue;
+
+		auto prepared = prepare_block(sample.first(std::min(sample.size(), MAX_BLOCK)), scratch.prepared, scratch, level, 0, {}, &block_dictionary);
+		if (!prepared) return std::unexpected(prepared.error());
+
+		const PreparedBlock& block = scratch.prepared;
+		if (block.type != BlockType::Split) continue;
+
+		for (size_t f = 0; f < lz77::FIELD_COUNT; f++) {
+			if (block.fields[f].empty() || (f == lz77::LITERALS && !block.entropy)) continue;
+			for (size_t v = 0; v < 256; v++) counts[f][v] += block.histograms[f][v];
+		}
+	}
+
+	std::vector<uint8_t> out(sizeof(DICTIONARY_MAGIC) + lz77::FIELD_COUNT * huffman::CODE_LENGTHS_BOUND);
+	memcpy(out.data(), &DICTIONARY_MAGIC, sizeof(DICTIONARY_MAGIC));
+	size_t pos = sizeof(DICTIONARY_MAGIC);
+
+	for (const auto& field : counts) {
+
+		huffman::CodeLengths lengths = {};
+
+		const uint64_t largest = *std::ranges::max_element(field);
+		if (largest > 0) {
+			const int shift = std::max(static_cast<int>(std::bit_width(largest)) - MAX_COUNT_BITS, 0);
+			std::array<uint32_t, 256> histogram;
+			for (size_t v = 0; v < 256; v++) histogram[v] = static_cast<uint32_t>(field[v] >> shift) + 1;
+			lengths = huffman::get_code_lengths(histogram);
+		}
+
+		pos += huffman::write_code_lengths(lengths, out.data() + pos);
+	}
+
+	out.resize(pos);
+	out.insert(out.end(), content.begin(), content.end());
+	return out;
+}
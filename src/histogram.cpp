@@ -0,0 +1,49 @@
+#include "histogram.h"
+#include <cstring>
+
+namespace {
+
+	constexpr size_t BANKS = 4;
+
+	// Counts the bytes of one little-endian word, byte k into bank k % BANKS
+	inline void count_word(std::array<lpz::Histogram, BANKS>& banks, uint64_t word) {
+		banks[0][word & 0xFF]++;
+		banks[1][(word >> 8) & 0xFF]++;
+		banks[2][(word >> 16) & 0xFF]++;
+		banks[3][(word >> 24) & 0xFF]++;
+		banks[0][(word >> 32) & 0xFF]++;
+		banks[1][(word >> 40) & 0xFF]++;
+		banks[2][(word >> 48) & 0xFF]++;
+		banks[3][word >> 56]++;
+	}
+
+}
+
+lpz::Histogram lpz::create_histogram(std::span<const uint8_t> data) {
+
+	std::array<Histogram, BANKS> banks = {};
+
+	const uint8_t* ip = data.data();
+	const uint8_t* const end = ip + data.size();
+
+	// Two words per step, both loaded before either is counted
+	while (end - ip >= 16) {
+		uint64_t a, b;
+		memcpy(&a, ip, sizeof(a));
+		memcpy(&b, ip + 8, sizeof(b));
+		count_word(banks, a);
+		count_word(banks, b);
+		ip += 16;
+	}
+
+	for (size_t k = 0; ip < end; k++) {
+		banks[k % BANKS][*ip++]++;
+	}
+
+	Histogram histogram;
+	for (size_t s = 0; s < histogram.size(); s++) {
+		histogram[s] = banks[0][s] + banks[1][s] + banks[2][s] + banks[3][s];
+	}
+
+	return histogram;
+}
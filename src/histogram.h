@@ -0,0 +1,16 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <span>
+
+namespace lpz {
+
+	// Occurrences of each byte value
+	using Histogram = std::array<uint32_t, 256>;
+
+	// Counts the bytes of `data`. With a single set of counters, a run of one value makes every
+	// increment wait for the store of the one before; consecutive bytes here go to separate
+	// banks of counters, summed at the end.
+	Histogram create_histogram(std::span<const uint8_t> data);
+
+}
@@ -3,29 +3,37 @@
 #include <algorithm>
 #include <expected>
 #include <format>
+#include <cstring>
+#include <limits>
 namespace {
 
 	constexpr int MAX_BITS = 14;
-
-	std::array<uint32_t, 256> create_histogram(std::span<const uint8_t> data) {
-
-		std::array<uint32_t, 256> f = {};
-
-		for (uint8_t value : data) {
-			f[value]++;
-		}
-
-		return f;
-	}
-
+	constexpr size_t HEADER_SIZE = 256 + sizeof(uint32_t); // code lengths + decoded size
+	constexpr size_t JUMP_TABLE_SIZE = (lpz::huffman::STREAMS - 1) * sizeof(uint32_t); // sizes of all streams but the last
+
+	// Decode tables index a small primary table by the next PRIMARY_BITS bits, and codes longer
+	// than that by SUB_BITS more bits in a subtable
+	constexpr int PRIMARY_BITS = 11;
+	constexpr size_t PRIMARY_SIZE = size_t(1) << PRIMARY_BITS;
+	constexpr int SUB_BITS = MAX_BITS - PRIMARY_BITS;
+	constexpr size_t SUB_SIZE = size_t(1) << SUB_BITS;
+
+	// Lookups the fast loops make per refill; each takes at most MAX_BITS bits and writes at
+	// most two symbols
+	constexpr int LOOKUPS_PER_REFILL = 56 / MAX_BITS;
+	constexpr size_t FAST_OUT_SLACK = 2 * LOOKUPS_PER_REFILL;
+
+	// Compact code lengths: nibble that starts a run of at least MIN_ZERO_RUN zero lengths
+	constexpr uint8_t ZERO_RUN = 15;
+	constexpr size_t MIN_ZERO_RUN = 2;
+
+	// Reverses the low `n` bits of `v`, for `n` up to 16, by swapping ever smaller halves
 	uint32_t reverse_bits(uint32_t v, int n) {
-		uint32_t r = 0;
-		for (int i = 0; i < n; i++) {
-			if (v & (1 << i)) {
-				r |= (1 << (n - 1 - i));
-			}
-		}
-		return r;
+		v = ((v >> 1) & 0x5555) | ((v & 0x5555) << 1);
+		v = ((v >> 2) & 0x3333) | ((v & 0x3333) << 2);
+		v = ((v >> 4) & 0x0F0F) | ((v & 0x0F0F) << 4);
+		v = ((v >> 8) & 0x00FF) | ((v & 0x00FF) << 8);
+		return v >> (16 - n);
 	}
 
 	std::expected<std::array<uint32_t, 256>,lpz::Error>
@@ -66,21 +74,418 @@ namespace {
 		return result_codes;
 	}
 
-	std::array<uint8_t, 256> get_code_lengths(std::array<uint32_t, 256> histogram) {
+	// Code and length of a symbol side by side, so each symbol costs a single table load
+	struct EncodeEntry {
+		uint16_t code;
+		uint16_t length;
+	};
+	using EncodeTable = std::array<EncodeEntry, 256>;
+
+	// Symbols the encoder adds between stores: at most 7 bits are left over from the last
+	// store, so this many codes always fit in the 64-bit buffer
+	constexpr int SYMBOLS_PER_STORE = 56 / MAX_BITS;
+
+	std::expected<EncodeTable, lpz::Error> make_encode_table(std::span<const uint8_t> lengths) {
+
+		auto codes = lengths_to_codes(lengths);
+		if (!codes) return std::unexpected(codes.error());
+
+		EncodeTable table;
+		for (int i = 0; i < 256; i++) {
+			table[i] = { static_cast<uint16_t>((*codes)[i]), lengths[i] };
+		}
+		return table;
+	}
+
+	// Writes the codes for `data` as a little-endian bitstream padded to whole bytes, storing
+	// a whole word after every SYMBOLS_PER_STORE symbols while at least 8 bytes remain before
+	// `out_end`. Returns the end of the output
+	uint8_t* write_bits(std::span<const uint8_t> data, const EncodeTable& table, uint8_t* op, uint8_t* const out_end) {
+
+		uint64_t bit_buff = 0;
+		int buff_size = 0;
+
+		const uint8_t* ip = data.data();
+		const uint8_t* const ip_end = ip + data.size();
+
+		auto put = [&](uint8_t val) {
+			EncodeEntry e = table[val];
+			bit_buff |= uint64_t(e.code) << buff_size;
+			buff_size += e.length;
+		};
+
+		while (ip_end - ip >= SYMBOLS_PER_STORE && out_end - op >= int(sizeof(uint64_t))) {
+			for (int i = 0; i < SYMBOLS_PER_STORE; i++) put(ip[i]);
+			ip += SYMBOLS_PER_STORE;
+
+			memcpy(op, &bit_buff, sizeof(bit_buff));
+			op += buff_size >> 3;
+			bit_buff >>= buff_size & ~7;
+			buff_size &= 7;
+		}
+
+		for (; ip < ip_end; ip++) {
+			put(*ip);
+			while (buff_size >= 8) {
+				*op++ = uint8_t(bit_buff);
+				bit_buff >>= 8;
+				buff_size -= 8;
+			}
+		}
+
+		if (buff_size > 0) *op++ = uint8_t(bit_buff);
+
+		return op;
+	}
+
+	// Fills `table` for the code `lengths` describes. Primary slots whose bits hold two whole
+	// codes decode both, which halves the lookups for the short codes that dominate the input.
+	std::expected<void, lpz::Error> build_table(std::span<const uint8_t> lengths, lpz::huffman::DecodeTable& table) {
+
+		using lpz::huffman::DecodeTable;
+
+		auto canonical_codes_res = lengths_to_codes(lengths);
+		if (!canonical_codes_res) {
+			return std::unexpected(lpz::Error{ lpz::ErrorCode::InputError, "Calculating codes during decompression returned: " + canonical_codes_res.error().m });
+		}
+		std::array<uint32_t,256> canonical_codes = *canonical_codes_res;
+
+		size_t kraft_sum = 0;
+		for (int s = 0; s < 256; s++) {
+			if (lengths[s] != 0) kraft_sum += size_t(1) << (MAX_BITS - lengths[s]);
+		}
+
+		if (kraft_sum > (size_t(1) << MAX_BITS)) {
+			return std::unexpected(lpz::Error{ lpz::ErrorCode::InputError, "Corrupted Data: Oversubscribed Huffman code" });
+		}
+
+		// Every primary slot shared by long codes gets a subtable; unused slots of an incomplete
+		// code stay zeroed, which reads as invalid
+		std::array<bool, PRIMARY_SIZE> linked = {};
+		size_t subtables = 0;
+		for (int s = 0; s < 256; s++) {
+			if (lengths[s] > PRIMARY_BITS) {
+				size_t prefix = canonical_codes[s] & (PRIMARY_SIZE - 1);
+				if (!linked[prefix]) subtables++;
+				linked[prefix] = true;
+			}
+		}
+
+		table.entries.assign(PRIMARY_SIZE + subtables * SUB_SIZE, {});
+		DecodeTable::Entry* const entries = table.entries.data();
+
+		size_t next_subtable = PRIMARY_SIZE;
+
+		for (int s = 0; s < 256; s++) {
+			int len = lengths[s];
+			if (len == 0) continue;
+
+			uint32_t code = canonical_codes[s];
+
+			if (len <= PRIMARY_BITS) {
+				int fill = 1 << (PRIMARY_BITS - len);
+				for (int i = 0; i < fill; i++) {
+					entries[code | (i << len)] = { { (uint8_t)s, 0 }, (uint8_t)len, (uint8_t)len };
+				}
+				continue;
+			}
+
+			auto& link = entries[code & (PRIMARY_SIZE - 1)];
+			if (link.length == 0) {
+				uint16_t offset = static_cast<uint16_t>(next_subtable);
+				memcpy(link.symbols, &offset, sizeof(offset));
+				link.length = PRIMARY_BITS;
+				next_subtable += SUB_SIZE;
+			}
+
+			uint16_t offset;
+			memcpy(&offset, link.symbols, sizeof(offset));
+
+			int sub_len = len - PRIMARY_BITS;
+			int fill = 1 << (SUB_BITS - sub_len);
+			for (int i = 0; i < fill; i++) {
+				entries[offset + ((code >> PRIMARY_BITS) | (i << sub_len))] = { { (uint8_t)s, 0 }, (uint8_t)len, (uint8_t)len };
+			}
+		}
+
+		// Pair each short code with the code after it when both fit in the primary bits. Only
+		// first symbols are read, so pairing in place is safe.
+		for (size_t i = 0; i < PRIMARY_SIZE; i++) {
+			auto& first = entries[i];
+			if (first.first_length == 0) continue;
+
+			const auto& second = entries[i >> first.first_length];
+			if (second.first_length == 0 || first.first_length + second.first_length > PRIMARY_BITS) continue;
+
+			first.symbols[1] = second.symbols[0];
+			first.length = first.first_length + second.first_length;
+		}
+
+		return {};
+	}
+
+	// Reads one little-endian bitstream
+	struct BitReader {
+		const uint8_t* ptr;
+		const uint8_t* end;
+		uint64_t bitbuf = 0;
+		int bits_in_buf = 0;
+
+		// Tops the buffer up to at least 57 bits, or to the end of the stream, a byte at a time
+		void refill() {
+			while (bits_in_buf <= 56 && ptr < end) {
+				bitbuf |= uint64_t(*ptr++) << bits_in_buf;
+				bits_in_buf += 8;
+			}
+		}
+
+		// Tops the buffer up to at least 56 bits with one load, for a stream with at least 8
+		// bytes left. Bits past the whole bytes taken are loaded again by the next refill.
+		void refill_fast() {
+			uint64_t word;
+			memcpy(&word, ptr, sizeof(word));
+			bitbuf |= word << bits_in_buf;
+			ptr += (63 - bits_in_buf) >> 3;
+			bits_in_buf |= 56;
+		}
+
+		// Entry for the next bits, following a link to its subtable. An entry of length 0
+		// marks an invalid code.
+		lpz::huffman::DecodeTable::Entry lookup(const lpz::huffman::DecodeTable::Entry* entries) const {
+			auto e = entries[bitbuf & (PRIMARY_SIZE - 1)];
+			if (e.first_length == 0 && e.length != 0) [[unlikely]] {
+				uint16_t offset;
+				memcpy(&offset, e.symbols, sizeof(offset));
+				e = entries[offset + ((bitbuf >> PRIMARY_BITS) & (SUB_SIZE - 1))];
+			}
+			return e;
+		}
+
+		// Decodes the symbols of one lookup to `op`, which must have room for two; the caller
+		// has made sure enough bits are buffered for any code. Returns the symbols written.
+		size_t decode_fast(const lpz::huffman::DecodeTable::Entry* entries, uint8_t* op, bool& valid) {
+			auto e = lookup(entries);
+			valid &= e.length != 0;
+			memcpy(op, e.symbols, 2);
+			bitbuf >>= e.length;
+			bits_in_buf -= e.length;
+			return 1 + (e.length > e.first_length);
+		}
+
+		// Decodes only the first symbol of one lookup. With several streams in flight the
+		// lookups already overlap, and a fixed step keeps the output stores independent of them.
+		uint8_t decode_one(const lpz::huffman::DecodeTable::Entry* entries, bool& valid) {
+			auto e = lookup(entries);
+			valid &= e.length != 0;
+			bitbuf >>= e.first_length;
+			bits_in_buf -= e.first_length;
+			return e.symbols[0];
+		}
+
+		// Decodes exactly up to `op_end`, checking every code against the bits left
+		std::expected<void, lpz::Error> decode_exact(const lpz::huffman::DecodeTable::Entry* entries, uint8_t* op, uint8_t* op_end) {
+
+			using lpz::Error, lpz::ErrorCode;
+
+			while (op < op_end) {
+
+				refill();
+
+				auto e = lookup(entries);
+
+				if (e.length == 0) [[unlikely]] {
+					return std::unexpected(Error{ ErrorCode::InputError, "Corrupted Data: Invalid Huffman Code" });
+				}
+
+				// Near the end a pair may run past the output or the input; take its first code
+				int length = e.length;
+				size_t count = 1 + (e.length > e.first_length);
+				if (count == 2 && (op_end - op < 2 || bits_in_buf < length)) {
+					length = e.first_length;
+					count = 1;
+				}
+
+				if (bits_in_buf < length) [[unlikely]] {
+					return std::unexpected(Error{ ErrorCode::InputError, "Unexpected EOF (Truncated Input)" });
+				}
+
+				memcpy(op, e.symbols, count);
+				op += count;
+				bitbuf >>= length;
+				bits_in_buf -= length;
+			}
+
+			return {};
+		}
+	};
+
+	// Decodes one bitstream into exactly `out`
+	std::expected<void, lpz::Error> decode_stream(std::span<const uint8_t> data, std::span<uint8_t> out, const lpz::huffman::DecodeTable::Entry* entries) {
+
+		BitReader reader{ data.data(), data.data() + data.size() };
+
+		uint8_t* op = out.data();
+		uint8_t* const op_end = op + out.size();
+
+		bool valid = true;
+
+		while (reader.end - reader.ptr >= 8 && static_cast<size_t>(op_end - op) >= FAST_OUT_SLACK) {
+			reader.refill_fast();
+			for (int k = 0; k < LOOKUPS_PER_REFILL; k++) {
+				op += reader.decode_fast(entries, op, valid);
+			}
+		}
+
+		if (!valid) {
+			return std::unexpected(lpz::Error{ lpz::ErrorCode::InputError, "Corrupted Data: Invalid Huffman Code" });
+		}
+
+		return reader.decode_exact(entries, op, op_end);
+	}
+
+	// The self-contained format of encode_into and encode_interleaved_into: raw code lengths
+	// and the decoded size, then the bitstreams
+	std::expected<size_t, lpz::Error> encode_with_header(std::span<const uint8_t> data, std::span<uint8_t> out, bool interleaved) {
+
+		using lpz::Error, lpz::ErrorCode;
+
+		if (data.size() >= std::numeric_limits<uint32_t>::max())
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman compress: Input too large" });
+		if (data.empty())
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman compress: Empty Input" });
+		if (out.size() < HEADER_SIZE)
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman compress: Output buffer too small" });
+
+		std::array<uint32_t, 256> histogram = lpz::create_histogram(data);
+		auto lengths = lpz::huffman::get_code_lengths(histogram);
+
+		uint32_t uncompsize = static_cast<uint32_t>(data.size());
+		memcpy(out.data(), lengths.data(), lengths.size());
+		memcpy(out.data() + lengths.size(), &uncompsize, sizeof(uncompsize));
+
+		auto size = lpz::huffman::encode_bits_into(data, lengths, lpz::huffman::encoded_bits(histogram, lengths), out.subspan(HEADER_SIZE), interleaved);
+		if (!size) return std::unexpected(size.error());
+
+		return HEADER_SIZE + *size;
+	}
+
+	std::expected<size_t, lpz::Error> decode_with_header(std::span<const uint8_t> data, std::span<uint8_t> out, lpz::huffman::DecodeTable& table, bool interleaved) {
+
+		using lpz::Error, lpz::ErrorCode;
+
+		if (data.size() >= std::numeric_limits<uint32_t>::max())
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman decompress: Input too large" });
+
+		auto out_size = lpz::huffman::decoded_size(data);
+		if (!out_size) return std::unexpected(out_size.error());
+
+		if (out.size() < *out_size)
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman decode: Output buffer too small" });
+
+		lpz::huffman::CodeLengths lengths;
+		memcpy(lengths.data(), data.data(), lengths.size());
+
+		auto built = lpz::huffman::build_decode_table(lengths, table);
+		if (!built) return std::unexpected(built.error());
+
+		auto decoded = lpz::huffman::decode_bits_into(data.subspan(HEADER_SIZE), out.first(*out_size), table, interleaved);
+		if (!decoded) return std::unexpected(decoded.error());
+
+		return *out_size;
+	}
+}
+
+namespace lpz::huffman {
+
+	CodeLengths get_code_lengths(std::array<uint32_t, 256> histogram) {
+
+		// Symbols by ascending count, as count << 8 | symbol so the sort compares plain integers
+		std::array<uint64_t, 256> keys;
+		int n = 0;
+		for (int i = 0; i < 256; i++) {
+			if (histogram[i] > 0) keys[n++] = uint64_t(histogram[i]) << 8 | uint64_t(i);
+		}
+
+		CodeLengths lengths = {};
+
+		if (n == 0) return lengths;
+		if (n == 1) {
+			lengths[keys[0] & 0xFF] = 1;
+			return lengths;
+		}
+
+		std::sort(keys.begin(), keys.begin() + n);
+
+		std::array<uint32_t, 256> a;
+		for (int i = 0; i < n; i++) a[i] = static_cast<uint32_t>(keys[i] >> 8);
+
+		// Minimum-redundancy code lengths computed in place (Moffat and Katajainen). First each
+		// internal node t takes the weight of its two lightest children; leaves are read from
+		// `s` on and nodes built so far from `r` on, which are turned into parent links
+		int s = 0, r = 0;
+		for (int t = 0; t < n - 1; t++) {
+			for (int child = 0; child < 2; child++) {
+				uint32_t w;
+				if (s >= n || (r < t && a[r] < a[s])) {
+					w = a[r];
+					a[r++] = static_cast<uint32_t>(t);
+				}
+				else {
+					w = a[s++];
+				}
+				a[t] = child ? a[t] + w : w;
+			}
+		}
+
+		// Then parent links become node depths, the root being last
+		a[n - 2] = 0;
+		for (int t = n - 3; t >= 0; t--) a[t] = a[a[t]] + 1;
+
+		// And the free slots at each depth become leaves, filled from the heaviest symbol down
+		int available = 1, used = 0, depth = 0, t = n - 2, x = n - 1;
+		while (available > 0) {
+			while (t >= 0 && a[t] == static_cast<uint32_t>(depth)) {
+				used++;
+				t--;
+			}
+			while (available > used) {
+				a[x--] = static_cast<uint32_t>(depth);
+				available--;
+			}
+			available = 2 * used;
+			depth++;
+			used = 0;
+		}
+
+		// The lightest symbol has the longest code; past the limit the optimal lengths need
+		// the slower package-merge
+		if (a[0] > MAX_BITS) return package_merge_code_lengths(histogram);
+
+		for (int i = 0; i < n; i++) lengths[keys[i] & 0xFF] = static_cast<uint8_t>(a[i]);
+		return lengths;
+	}
+
+	CodeLengths package_merge_code_lengths(const std::array<uint32_t, 256>& histogram) {
 
 		struct Package {
 			uint32_t weight;
 			int original_index; // -1 = merged node
 		};
 
-		std::vector<Package> leaves;
+		// Fixed-capacity levels keep code length construction free of heap allocations
+		std::array<Package, 256> leaves;
+		size_t leaf_count = 0;
 		for (int i = 0; i < 256; i++) {
 			if (histogram[i] > 0) {
-				leaves.push_back({ histogram[i], i });
+				leaves[leaf_count++] = { histogram[i], i };
 			}
 		}
 
-		if (leaves.size() == 1) {
+		if (leaf_count == 0) {
+			return {};
+		}
+
+		if (leaf_count == 1) {
 			std::array<uint8_t, 256> lengths = {};
 			lengths[leaves[0].original_index] = 1; 
 			return lengths;
@@ -95,28 +500,32 @@ namespace {
 			};
 
 
-		std::sort(leaves.begin(), leaves.end(), sort_packages);
+		std::sort(leaves.begin(), leaves.begin() + leaf_count, sort_packages);
 
 		std::array<uint8_t, 256> lengths = {};
 
-		int n = static_cast<int>(leaves.size());
+		int n = static_cast<int>(leaf_count);
 
-		std::vector<std::vector<Package>> levels(MAX_BITS);
-		levels[0] = leaves;
+		std::array<std::array<Package, 2 * 256>, MAX_BITS> levels;
+		std::array<size_t, MAX_BITS> level_sizes = {};
+
+		std::copy(leaves.begin(), leaves.begin() + leaf_count, levels[0].begin());
+		level_sizes[0] = leaf_count;
 
 		for (int i = 0; i < MAX_BITS - 1; ++i) {
-			std::vector<Package> new_packages;
+			std::array<Package, 256> new_packages;
+			size_t package_count = 0;
 			const auto& prev_level = levels[i];
-			for (size_t k = 0; k + 1 < prev_level.size(); k += 2) {
+			for (size_t k = 0; k + 1 < level_sizes[i]; k += 2) {
 				uint32_t sum_weight = prev_level[k].weight + prev_level[k + 1].weight;
-				new_packages.push_back({ sum_weight, -1 });
+				new_packages[package_count++] = { sum_weight, -1 };
 			}
 
 			// Merge new packages with the leaves
-			levels[static_cast<size_t>(i) + 1].resize(leaves.size() + new_packages.size());
+			level_sizes[static_cast<size_t>(i) + 1] = leaf_count + package_count;
 			std::merge(
-				leaves.begin(), leaves.end(),
-				new_packages.begin(), new_packages.end(),
+				leaves.begin(), leaves.begin() + leaf_count,
+				new_packages.begin(), new_packages.begin() + package_count,
 				levels[static_cast<size_t>(i) + 1].begin(),
 				sort_packages
 			);
@@ -142,9 +551,7 @@ namespace {
 		}
 		return lengths;	
 	}
-}
 
-namespace lpz::huffman {
 
 	double compute_ratio(std::span<const uint8_t> data) {
 
@@ -167,142 +574,343 @@ namespace lpz::huffman {
 
 	}
 
+	size_t encode_bound(size_t size) {
+		// A length-limited optimal code never does worse than 8 bits per symbol
+		return HEADER_SIZE + size + 1;
+	}
+
 	std::expected<std::vector<uint8_t>, Error>
 	encode(std::span<const uint8_t> data) {
-		
-		if (data.size() >= std::numeric_limits<uint32_t>::max()) 
-			return std::unexpected(Error{ ErrorCode::InputError, "Huffman compress: Input too large" });
-		if (data.empty()) 
-			return std::unexpected(Error{ ErrorCode::InputError, "Huffman compress: Empty Input" });
 
-		std::array<uint32_t,256> histogram = create_histogram(data);
+		std::vector<uint8_t> coded_bytes(encode_bound(data.size()));
 
-		auto lengths = get_code_lengths(histogram);
-		
-		auto canonical_codes_res = lengths_to_codes(lengths);
-		if (!canonical_codes_res) {
-			return std::unexpected(Error{ ErrorCode::InputError, "Calculating codes during compression returned: " + canonical_codes_res.error().m});
-		}
-		std::array<uint32_t, 256> canonical_codes = *canonical_codes_res;
+		auto size = encode_into(data, coded_bytes);
+		if (!size) return std::unexpected(size.error());
 
-		std::vector<uint8_t> coded_bytes;
-		coded_bytes.reserve(data.size()); 
+		coded_bytes.resize(*size);
+		return coded_bytes;
+	}
 
-		uint32_t uncompsize = static_cast<uint32_t>(data.size());
-		const uint8_t* size_ptr = reinterpret_cast<const uint8_t*>(&uncompsize);
-		coded_bytes.insert(coded_bytes.end(), lengths.cbegin(), lengths.cend());
-		coded_bytes.insert(coded_bytes.end(), size_ptr, size_ptr + sizeof(uint32_t));
+	std::expected<size_t, Error>
+	encode_into(std::span<const uint8_t> data, std::span<uint8_t> out) {
+		return encode_with_header(data, out, false);
+	}
 
-		uint64_t bit_buff = 0; 
-		int buff_size = 0;
+	std::expected<size_t, Error>
+	decoded_size(std::span<const uint8_t> data) {
+
+		if (data.size() < HEADER_SIZE)
+			return std::unexpected(Error{ ErrorCode::InputError, "Input too small" });
 
-		for (uint8_t val : data) {
-			uint32_t code = canonical_codes[val];
-			int len = lengths[val];
+		uint32_t out_size;
+		memcpy(&out_size, data.data() + 256, sizeof(out_size));
 
-			bit_buff |= (uint64_t)code << buff_size;
-			buff_size += len;
+		if (out_size == 0)
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman decode: Output too small" });
+		if (out_size == std::numeric_limits<uint32_t>::max())
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman decode: Output too large" });
+
+		return out_size;
+	}
 
-			while (buff_size >= 32) {
-				uint32_t out = (uint32_t)bit_buff;
-				coded_bytes.push_back((uint8_t)(out));
-				coded_bytes.push_back((uint8_t)(out >> 8));
-				coded_bytes.push_back((uint8_t)(out >> 16));
-				coded_bytes.push_back((uint8_t)(out >> 24));
-				bit_buff >>= 32;
-				buff_size -= 32;
+	std::expected<std::vector<uint8_t>,Error>
+	decode(std::span<const uint8_t> data) {
+
+		if (data.size() >= std::numeric_limits<uint32_t>::max())
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman decompress: Input too large" });
 
+		auto out_size = decoded_size(data);
+		if (!out_size) return std::unexpected(out_size.error());
+
+		DecodeTable table;
+		std::vector<uint8_t> decoded(*out_size);
+
+		auto size = decode_into(data, decoded, table);
+		if (!size) return std::unexpected(size.error());
+
+		return decoded;
+	}
+
+	std::expected<size_t, Error>
+	decode_into(std::span<const uint8_t> data, std::span<uint8_t> out, DecodeTable& table) {
+		return decode_with_header(data, out, table, false);
+	}
+
+	size_t encode_interleaved_bound(size_t size) {
+		return HEADER_SIZE + encode_bits_bound(8 * size, true);
+	}
+
+	std::expected<size_t, Error>
+	encode_interleaved_into(std::span<const uint8_t> data, std::span<uint8_t> out) {
+		return encode_with_header(data, out, true);
+	}
+
+	std::expected<size_t, Error>
+	decode_interleaved_into(std::span<const uint8_t> data, std::span<uint8_t> out, DecodeTable& table) {
+		return decode_with_header(data, out, table, true);
+	}
+
+	size_t write_code_lengths(const CodeLengths& lengths, uint8_t* out) {
+
+		size_t count = 256;
+		while (count > 1 && lengths[count - 1] == 0) count--;
+
+		uint8_t* op = out;
+		*op++ = static_cast<uint8_t>(count - 1);
+
+		// Nibbles, low one first: a code length, or ZERO_RUN and then a run of zero lengths
+		bool high = false;
+		auto put = [&](uint8_t nibble) {
+			if (high) op[-1] |= nibble << 4;
+			else *op++ = nibble;
+			high = !high;
+		};
+
+		for (size_t s = 0; s < count;) {
+			size_t run = 0;
+			while (s + run < count && lengths[s + run] == 0 && run < MIN_ZERO_RUN + 15) run++;
+
+			if (run >= MIN_ZERO_RUN) {
+				put(ZERO_RUN);
+				put(static_cast<uint8_t>(run - MIN_ZERO_RUN));
+				s += run;
+			}
+			else {
+				put(lengths[s]);
+				s++;
 			}
 		}
 
-		while (buff_size >= 8) {
-			coded_bytes.push_back(uint8_t(bit_buff));
-			bit_buff >>= 8;
-			buff_size -= 8;
+		return static_cast<size_t>(op - out);
+	}
+
+	std::expected<size_t, Error>
+	read_code_lengths(std::span<const uint8_t> data, CodeLengths& lengths) {
+
+		if (data.empty())
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman decode: Truncated code lengths" });
+
+		const size_t count = size_t(data[0]) + 1;
+		size_t nibble = 0;
+
+		auto get = [&]() -> std::expected<uint8_t, Error> {
+			size_t byte = 1 + nibble / 2;
+			if (byte >= data.size())
+				return std::unexpected(Error{ ErrorCode::InputError, "Huffman decode: Truncated code lengths" });
+			uint8_t value = nibble % 2 ? data[byte] >> 4 : data[byte] & 0x0F;
+			nibble++;
+			return value;
+		};
+
+		lengths.fill(0);
+
+		for (size_t s = 0; s < count;) {
+			auto value = get();
+			if (!value) return std::unexpected(value.error());
+
+			if (*value != ZERO_RUN) {
+				lengths[s++] = *value;
+				continue;
+			}
+
+			auto run = get();
+			if (!run) return std::unexpected(run.error());
+
+			s += MIN_ZERO_RUN + *run;
+			if (s > count)
+				return std::unexpected(Error{ ErrorCode::InputError, "Huffman decode: Code lengths overrun" });
 		}
 
-		if (buff_size > 0) {
-			coded_bytes.push_back(uint8_t(bit_buff));
+		return 1 + (nibble + 1) / 2;
+	}
+
+	size_t encoded_bits(const std::array<uint32_t, 256>& histogram, const CodeLengths& lengths) {
+
+		size_t bits = 0;
+		for (int i = 0; i < 256; i++) {
+			if (histogram[i] != 0 && lengths[i] == 0) return std::numeric_limits<size_t>::max();
+			bits += static_cast<size_t>(lengths[i]) * histogram[i];
 		}
+		return bits;
+	}
 
-		return coded_bytes;
+	size_t encode_bits_bound(size_t bits, bool interleaved) {
+		// Each interleaved stream may end with a partly used byte
+		return (bits + 7) / 8 + (interleaved ? JUMP_TABLE_SIZE + STREAMS - 1 : 0);
 	}
 
-	std::expected<std::vector<uint8_t>,Error>
-	decode(std::span<const uint8_t> data) {
+	std::expected<size_t, Error>
+	encode_bits_into(std::span<const uint8_t> data, const CodeLengths& lengths, size_t bits, std::span<uint8_t> out, bool interleaved) {
 
-		if (data.size() >= std::numeric_limits<uint32_t>::max())
-			return std::unexpected(Error{ ErrorCode::InputError, "Huffman decompress: Input too large" });
-		if (data.size() < 257)
-			return std::unexpected(Error{ ErrorCode::InputError, "Input too small" });
-		
-		
-		constexpr int TABLE_BITS = MAX_BITS;
-		constexpr int TABLE_SIZE = 1 << TABLE_BITS;
-
-		struct Entry {
-			uint8_t symbol;
-			uint8_t length;  
-		};
+		auto table = make_encode_table(lengths);
+		if (!table) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Calculating codes during compression returned: " + table.error().m});
+		}
 
-		auto canonical_codes_res = lengths_to_codes(data);
-		if (!canonical_codes_res) {
-			return std::unexpected(Error{ ErrorCode::InputError, "Calculating codes during decompression returned: " + canonical_codes_res.error().m });
+		if (bits == std::numeric_limits<size_t>::max())
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman compress: Symbol without a code" });
+		if (out.size() < encode_bits_bound(bits, interleaved))
+			return std::unexpected(Error{ ErrorCode::InputError, "Huffman compress: Output buffer too small" });
+
+		uint8_t* const out_begin = out.data();
+		uint8_t* const out_end = out_begin + out.size();
+
+		if (!interleaved) {
+			return static_cast<size_t>(write_bits(data, *table, out_begin, out_end) - out_begin);
 		}
-		std::array<uint32_t,256> canonical_codes = *canonical_codes_res;
 
-		std::vector<Entry> table(TABLE_SIZE);
-		for (auto& e : table) e.length = 0;
+		const size_t segment = (data.size() + STREAMS - 1) / STREAMS;
 
-		for (int s = 0; s < 256; s++) {
-			int len = data[s];  
-			if (len == 0) continue;
+		std::array<uint32_t, STREAMS> stream_sizes;
+		uint8_t* op = out_begin + JUMP_TABLE_SIZE;
 
-			uint32_t code = canonical_codes[s];
-			int fill = 1 << (TABLE_BITS - len);
-			for (int i = 0; i < fill; i++) {
-				int index = code | (i << len);
-				table[index] = { (uint8_t)s, (uint8_t)len };
-			}
+		for (size_t s = 0; s < STREAMS; s++) {
+			size_t begin = std::min(data.size(), s * segment);
+			uint8_t* stream_end = write_bits(data.subspan(begin, std::min(data.size() - begin, segment)), *table, op, out_end);
+			stream_sizes[s] = static_cast<uint32_t>(stream_end - op);
+			op = stream_end;
 		}
 
-		size_t out_size = 0;
-		memcpy(&out_size, data.data() + 256, 4);
+		memcpy(out_begin, stream_sizes.data(), JUMP_TABLE_SIZE);
 
-		if (out_size == 0)
-			return std::unexpected(Error{ ErrorCode::InputError, "Huffman decode: Output too small" });
-		if (out_size >= std::numeric_limits<uint32_t>::max())
-			return std::unexpected(Error{ ErrorCode::InputError, "Huffman decode: Output too large" });
+		return static_cast<size_t>(op - out_begin);
+	}
 
-		std::vector<uint8_t> decoded(out_size);
+	std::expected<void, Error>
+	build_decode_table(const CodeLengths& lengths, DecodeTable& table) {
 
-		uint64_t bitbuf = 0;
-		int bits_in_buf = 0;
-		size_t pos = 256ull + 4;
-		size_t byte_size = data.size();
+		// Blocks that repeat a table hand it over unchanged
+		if (table.built && table.lengths == lengths) return {};
 
-		size_t out_pos = 0;
-		while (out_pos < out_size) {
+		table.built = false;
 
-			while (bits_in_buf < TABLE_BITS && pos < byte_size) {
-				bitbuf |= uint64_t(data[pos++]) << bits_in_buf;
-				bits_in_buf += 8;
-			}
+		auto built = build_table(lengths, table);
+		if (!built) return built;
+
+		table.lengths = lengths;
+		table.built = true;
+		return {};
+	}
 
-			Entry e = table[bitbuf & (static_cast<size_t>(TABLE_SIZE) - 1)];
+	std::expected<const DecodeTable*, Error>
+	get_decode_table(const CodeLengths& lengths, DecodeTableCache& cache) {
+
+		uint64_t hash = 0;
+		for (size_t i = 0; i < lengths.size(); i += sizeof(uint64_t)) {
+			uint64_t word;
+			memcpy(&word, lengths.data() + i, sizeof(word));
+			hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+			hash ^= hash >> 29;
+		}
 
-			if (e.length == 0) [[unlikely]] {
-				return std::unexpected(Error{ ErrorCode::InputError, "Corrupted Data: Invalid Huffman Code" });
+		cache.uses++;
+
+		size_t slot = 0;
+		for (size_t i = 0; i < DecodeTableCache::SLOTS; i++) {
+			DecodeTable& table = cache.tables[i];
+			if (cache.hashes[i] == hash && table.built && table.lengths == lengths) {
+				cache.last_use[i] = cache.uses;
+				return &table;
 			}
-			if (bits_in_buf < e.length) [[unlikely]] {
+			if (cache.last_use[i] < cache.last_use[slot]) slot = i;
+		}
+
+		cache.last_use[slot] = 0;
+		auto built = build_decode_table(lengths, cache.tables[slot]);
+		if (!built) return std::unexpected(built.error());
+
+		cache.hashes[slot] = hash;
+		cache.last_use[slot] = cache.uses;
+		return &cache.tables[slot];
+	}
+
+	std::expected<void, Error>
+	decode_bits_into(std::span<const uint8_t> data, std::span<uint8_t> out, const DecodeTable& table, bool interleaved) {
+
+		const DecodeTable::Entry* const entries = table.entries.data();
+
+		if (!interleaved) {
+			return decode_stream(data, out, entries);
+		}
+
+		if (data.size() < JUMP_TABLE_SIZE)
+			return std::unexpected(Error{ ErrorCode::InputError, "Unexpected EOF (Truncated Input)" });
+
+		std::array<uint32_t, STREAMS - 1> stream_sizes;
+		memcpy(stream_sizes.data(), data.data(), JUMP_TABLE_SIZE);
+
+		const uint8_t* const in_end = data.data() + data.size();
+		const uint8_t* ip = data.data() + JUMP_TABLE_SIZE;
+
+		const size_t out_size = out.size();
+		const size_t segment = (out_size + STREAMS - 1) / STREAMS;
+		uint8_t* const decoded = out.data();
+
+		std::array<BitReader, STREAMS> readers;
+		std::array<uint8_t*, STREAMS> ops;
+		std::array<uint8_t*, STREAMS> op_ends;
+
+		for (size_t s = 0; s < STREAMS; s++) {
+			size_t size = s < STREAMS - 1 ? stream_sizes[s] : static_cast<size_t>(in_end - ip);
+			if (static_cast<size_t>(in_end - ip) < size)
 				return std::unexpected(Error{ ErrorCode::InputError, "Unexpected EOF (Truncated Input)" });
+
+			readers[s] = { ip, ip + size };
+			ip += size;
+
+			ops[s] = decoded + std::min(out_size, s * segment);
+			op_ends[s] = decoded + std::min(out_size, (s + 1) * segment);
+		}
+
+		bool valid = true;
+
+		// A round refills every stream and decodes LOOKUPS_PER_REFILL symbols from each. It reads
+		// at most 7 bytes per stream, so the number of rounds that stay clear of every end is
+		// known up front and the rounds need no checks.
+		static_assert(STREAMS == 4, "the round below is written out for four streams");
+
+		while (true) {
+
+			size_t rounds = std::numeric_limits<size_t>::max();
+			for (size_t s = 0; s < STREAMS; s++) {
+				size_t in_left = static_cast<size_t>(readers[s].end - readers[s].ptr);
+				size_t out_left = static_cast<size_t>(op_ends[s] - ops[s]);
+				if (in_left < sizeof(uint64_t)) in_left = 0;
+				else in_left = (in_left - sizeof(uint64_t)) / 7 + 1;
+				rounds = std::min({ rounds, in_left, out_left / LOOKUPS_PER_REFILL });
+			}
+			if (rounds == 0) break;
+
+			// Kept in locals so the four chains stay in registers
+			BitReader r0 = readers[0], r1 = readers[1], r2 = readers[2], r3 = readers[3];
+			uint8_t* op0 = ops[0], * op1 = ops[1], * op2 = ops[2], * op3 = ops[3];
+
+			for (; rounds > 0; rounds--) {
+				r0.refill_fast();
+				r1.refill_fast();
+				r2.refill_fast();
+				r3.refill_fast();
+				for (int k = 0; k < LOOKUPS_PER_REFILL; k++) {
+					*op0++ = r0.decode_one(entries, valid);
+					*op1++ = r1.decode_one(entries, valid);
+					*op2++ = r2.decode_one(entries, valid);
+					*op3++ = r3.decode_one(entries, valid);
+				}
 			}
 
-			decoded[out_pos++] = e.symbol;
-			bitbuf >>= e.length;
-			bits_in_buf -= e.length;
+			readers = { r0, r1, r2, r3 };
+			ops = { op0, op1, op2, op3 };
 		}
 
-		return decoded;
+		if (!valid) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Corrupted Data: Invalid Huffman Code" });
+		}
+
+		for (size_t s = 0; s < STREAMS; s++) {
+			auto tail = readers[s].decode_exact(entries, ops[s], op_ends[s]);
+			if (!tail) return std::unexpected(tail.error());
+		}
+
+		return {};
 	}
 }
\ No newline at end of file
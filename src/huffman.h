@@ -1,13 +1,93 @@
 #pragma once
 #include "lpz.h"
+#include "histogram.h"
 #include <vector>
+#include <array>
 #include <span>
 #include <expected>
 
 namespace lpz::huffman {
 
+	// Code length of each byte value; 0 for values without a code
+	using CodeLengths = std::array<uint8_t, 256>;
+
+	// Symbol lookup table, kept between calls so it is only allocated once. A small primary
+	// table holds one or two whole codes per entry, or links to a subtable for longer codes.
+	struct DecodeTable {
+		struct Entry {
+			uint8_t symbols[2];   // for a link, the subtable offset as a little-endian u16
+			uint8_t length;       // bits taken by all symbols of the entry; 0 for an invalid code
+			uint8_t first_length; // bits taken by the first symbol; 0 for a link
+		};
+		std::vector<Entry> entries;
+		CodeLengths lengths = {}; // the code the entries were built for
+		bool built = false;
+	};
+
+	// The last few tables built, found again by a hash of their code lengths, so blocks that
+	// return to an earlier code reuse its table instead of rebuilding it
+	struct DecodeTableCache {
+		static constexpr size_t SLOTS = 8;
+		std::array<DecodeTable, SLOTS> tables;
+		std::array<uint64_t, SLOTS> hashes = {};
+		std::array<uint64_t, SLOTS> last_use = {}; // 0 for a slot not built yet
+		uint64_t uses = 0;
+	};
+
+	// Optimal code lengths for `histogram` of at most 14 bits; unused symbols get length 0.
+	// Built in place on the stack, falling back to package_merge_code_lengths only when the
+	// unlimited code would be too deep
+	CodeLengths get_code_lengths(std::array<uint32_t, 256> histogram);
+	// Length-limited code lengths by package-merge, always within the limit but slower
+	CodeLengths package_merge_code_lengths(const std::array<uint32_t, 256>& histogram);
+
 	double compute_ratio(std::span<const uint8_t> data);
+
+	// Largest encoded size of `size` input bytes
+	size_t encode_bound(size_t size);
+
 	std::expected<std::vector<uint8_t>, Error> encode(std::span<const uint8_t> data);
+	std::expected<size_t, Error> encode_into(std::span<const uint8_t> data, std::span<uint8_t> out);
+
+	// Size of the output `data` decodes to, read from its header
+	std::expected<size_t, Error> decoded_size(std::span<const uint8_t> data);
+
 	std::expected<std::vector<uint8_t>, Error> decode(std::span<const uint8_t> data);
+	std::expected<size_t, Error> decode_into(std::span<const uint8_t> data, std::span<uint8_t> out, DecodeTable& table);
+
+	// Interleaved format: the same header, then a jump table with the sizes of all streams but
+	// the last, then STREAMS bitstreams that each code one consecutive part of the input. The
+	// streams share one code but not their state, so a decoder can follow all of them at once.
+	// decoded_size works on both formats.
+	constexpr size_t STREAMS = 4;
+
+	size_t encode_interleaved_bound(size_t size);
+	std::expected<size_t, Error> encode_interleaved_into(std::span<const uint8_t> data, std::span<uint8_t> out);
+	std::expected<size_t, Error> decode_interleaved_into(std::span<const uint8_t> data, std::span<uint8_t> out, DecodeTable& table);
+
+	// Building blocks for formats that store the code and decoded size themselves.
+
+	// Compact code lengths: the last symbol with a code, then one nibble per length with runs
+	// of zero lengths folded. Returns bytes written, at most CODE_LENGTHS_BOUND
+	constexpr size_t CODE_LENGTHS_BOUND = 1 + 256 / 2;
+	size_t write_code_lengths(const CodeLengths& lengths, uint8_t* out);
+	// Returns bytes read
+	std::expected<size_t, Error> read_code_lengths(std::span<const uint8_t> data, CodeLengths& lengths);
+
+	// Bits the symbols counted in `histogram` take with `lengths`, or SIZE_MAX if one of them
+	// has no code
+	size_t encoded_bits(const std::array<uint32_t, 256>& histogram, const CodeLengths& lengths);
+
+	// Largest bitstream output for `bits` bits of codes, with a jump table when `interleaved`
+	size_t encode_bits_bound(size_t bits, bool interleaved);
+	// Writes the bitstream(s) alone. `bits` is encoded_bits for `data`. Returns bytes written
+	std::expected<size_t, Error> encode_bits_into(std::span<const uint8_t> data, const CodeLengths& lengths, size_t bits, std::span<uint8_t> out, bool interleaved);
+
+	// Builds `table` for `lengths`; a table already built for the same code is kept as it is
+	std::expected<void, Error> build_decode_table(const CodeLengths& lengths, DecodeTable& table);
+	// Table for `lengths` from `cache`, built into the least recently used slot when missing
+	std::expected<const DecodeTable*, Error> get_decode_table(const CodeLengths& lengths, DecodeTableCache& cache);
+	// Decodes exactly out.size() symbols from bitstream(s) written by encode_bits_into
+	std::expected<void, Error> decode_bits_into(std::span<const uint8_t> data, std::span<uint8_t> out, const DecodeTable& table, bool interleaved);
 
 }
\ No newline at end of file
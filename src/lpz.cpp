@@ -1,85 +1,732 @@
 #include "lpz.h"
 #include "block.h"
+#include "lz77.h"
+#include "huffman.h"
+#include "parallel.h"
+#include "context.h"
 #include <format>
+#include <algorithm>
+#include <cstring>
+#include <limits>
 
+namespace {
 
-std::expected<std::vector<uint8_t>, lpz::Error> lpz::compress(std::span<const uint8_t> data) {
+	struct BlockIndex {
+		std::vector<lpz::Block> blocks;
+		std::vector<uint64_t> offsets; // decompressed offset of each block, plus the total size
+	};
 
-	if (data.size() == 0) {
-		return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
+	std::expected<std::vector<lpz::Block>, lpz::Error> split_blocks(std::span<const uint8_t> data) {
+
+		std::vector<lpz::Block> blocks;
+
+		size_t pos = 0;
+		while (pos < data.size()) {
+
+			auto header = lpz::read_block_header(data.subspan(pos));
+			if (!header) return std::unexpected(header.error());
+
+			pos += lpz::BLOCK_HEADER_SIZE;
+
+			if (lpz::is_data_block(header->type)) {
+				blocks.push_back({ header->type, data.subspan(pos, header->size) });
+			}
+
+			pos += header->size;
+		}
+
+		return blocks;
+	}
+
+	// How far back the linked blocks of a stream reach, from the window block it starts with
+	// when it has one
+	std::expected<size_t, lpz::Error> stream_window(std::span<const uint8_t> data) {
+
+		auto header = lpz::read_block_header(data);
+		if (!header || header->type != lpz::BlockType::Window) return lpz::lz77::WINDOW_SIZE;
+
+		return lpz::read_window_block(data.subspan(lpz::BLOCK_HEADER_SIZE, header->size));
 	}
 
-	std::vector<uint8_t> out;
+	// State of the dictionary the stream was compressed with, which has to be `dictionary`,
+	// going by the dictionary block among the metadata blocks it starts with. Null for streams
+	// compressed without one
+	std::expected<const lpz::Dictionary::State*, lpz::Error> stream_dictionary(std::span<const uint8_t> data, const lpz::Dictionary* dictionary) {
+
+		using lpz::Error, lpz::ErrorCode;
+
+		size_t pos = 0;
+		while (pos < data.size()) {
+
+			auto header = lpz::read_block_header(data.subspan(pos));
+			if (!header || lpz::is_data_block(header->type)) break;
+
+			if (header->type == lpz::BlockType::Dictionary) {
+				auto id = lpz::read_dictionary_block(data.subspan(pos + lpz::BLOCK_HEADER_SIZE, header->size));
+				if (!id) return std::unexpected(id.error());
+
+				if (!dictionary) return std::unexpected(Error{ ErrorCode::InputError, "Stream needs a dictionary" });
+				if (*id != dictionary->id()) return std::unexpected(Error{ ErrorCode::InputError, "Stream needs a different dictionary" });
+				return &dictionary->state();
+			}
+
+			pos += lpz::BLOCK_HEADER_SIZE + header->size;
+		}
+
+		return nullptr;
+	}
+
+	// Returns the index stored in the stream's seek table, or an empty index if the stream has none.
+	std::expected<BlockIndex, lpz::Error> read_seek_table(std::span<const uint8_t> data) {
+
+		if (data.size() < lpz::BLOCK_HEADER_SIZE + lpz::SEEK_FOOTER_SIZE) return BlockIndex{};
+
+		uint32_t count, magic;
+		memcpy(&count, data.data() + data.size() - lpz::SEEK_FOOTER_SIZE, sizeof(count));
+		memcpy(&magic, data.data() + data.size() - sizeof(magic), sizeof(magic));
+
+		if (magic != lpz::SEEK_TABLE_MAGIC) return BlockIndex{};
+
+		uint64_t table_size = static_cast<uint64_t>(count) * sizeof(lpz::SeekEntry) + lpz::SEEK_FOOTER_SIZE;
+		if (table_size + lpz::BLOCK_HEADER_SIZE > data.size()) return BlockIndex{};
+
+		size_t table_pos = data.size() - table_size - lpz::BLOCK_HEADER_SIZE;
+
+		auto header = lpz::read_block_header(data.subspan(table_pos));
+		if (!header || header->type != lpz::BlockType::SeekTable || header->size != table_size) return BlockIndex{};
+
+		BlockIndex index;
+		index.blocks.reserve(count);
+		index.offsets.reserve(static_cast<size_t>(count) + 1);
+
+		const uint8_t* entry_ptr = data.data() + table_pos + lpz::BLOCK_HEADER_SIZE;
+
+		uint64_t compressed_offset = 0;
+		uint64_t decompressed_offset = 0;
+
+		// The table leaves out the metadata blocks in front of the first data block
+		while (compressed_offset < table_pos) {
+			auto block_header = lpz::read_block_header(data.subspan(compressed_offset));
+			if (!block_header || lpz::is_data_block(block_header->type)) break;
+			compressed_offset += lpz::BLOCK_HEADER_SIZE + block_header->size;
+		}
+
+		for (uint32_t i = 0; i < count; i++) {
+
+			lpz::SeekEntry entry;
+			memcpy(&entry, entry_ptr + i * sizeof(lpz::SeekEntry), sizeof(entry));
+
+			if (entry.compressed_size < lpz::BLOCK_HEADER_SIZE || compressed_offset + entry.compressed_size > table_pos) {
+				return std::unexpected(lpz::Error{ lpz::ErrorCode::InputError, "Corrupt seek table" });
+			}
+
+			auto block_header = lpz::read_block_header(data.subspan(compressed_offset, entry.compressed_size));
+			if (!block_header || !lpz::is_data_block(block_header->type) || block_header->size != entry.compressed_size - lpz::BLOCK_HEADER_SIZE) {
+				return std::unexpected(lpz::Error{ lpz::ErrorCode::InputError, "Seek table does not match blocks" });
+			}
+
+			index.blocks.push_back({ block_header->type, data.subspan(compressed_offset + lpz::BLOCK_HEADER_SIZE, block_header->size) });
+			index.offsets.push_back(decompressed_offset);
+
+			compressed_offset += entry.compressed_size;
+			decompressed_offset += entry.decompressed_size;
+		}
+
+		index.offsets.push_back(decompressed_offset);
+
+		return index;
+	}
+
+	// Decodes `blocks` back to back into a single buffer, `threads` blocks at a time. `codes`
+	// holds the codes in effect before the first block and is advanced past the last. The
+	// first block must start a chain. Unlinked blocks reach back into `dictionary`
+	std::expected<std::vector<uint8_t>, lpz::Error> decode_blocks(std::span<const lpz::Block> blocks, unsigned threads, lpz::DecompressContext::State& context, lpz::BlockCodes& codes, std::span<const uint8_t> dictionary = {}) {
+
+		using lpz::Error;
+
+		context.reserve(threads);
+
+		// Blocks may repeat the codes of the blocks before them, so walk the stream headers
+		// first to give every block its codes up front
+		std::vector<lpz::BlockCodes> block_codes(blocks.size());
+		for (size_t i = 0; i < blocks.size(); i++) {
+			block_codes[i] = codes;
+			auto advanced = lpz::advance_block_codes(blocks[i], codes);
+			if (!advanced) return std::unexpected(Error{ lpz::ErrorCode::SystemError, "Block decompression failed: " + advanced.error().m });
+		}
+
+		// Pass 1: entropy-decode every block and measure its output, so each block's final
+		// offset is known before any LZ77 expansion happens.
+		std::vector<lpz::DecodedBlock> decoded(blocks.size());
+		std::vector<std::expected<void, Error>> decode_results(blocks.size());
+
+		lpz::parallel_for(blocks.size(), threads, [&](size_t i, unsigned worker) {
+			decode_results[i] = lpz::entropy_decode_block(blocks[i], decoded[i], block_codes[i], context.workers[worker].tables);
+		});
+
+		std::vector<size_t> out_offsets(blocks.size());
+		size_t out_size = 0;
+
+		for (size_t i = 0; i < blocks.size(); i++) {
+			if (!decode_results[i]) return std::unexpected(Error{ lpz::ErrorCode::SystemError, "Block decompression failed: " + decode_results[i].error().m });
+			out_offsets[i] = out_size;
+			out_size += decoded[i].size;
+		}
+
+		// Pass 2: expand each block straight into its slot of the output. A linked block reads
+		// the output of the blocks before it, so each run of linked blocks is expanded in order
+		// after the unlinked block that starts it, and the runs in parallel. The whole run is
+		// in the output, so long matches need no window of their own.
+		std::vector<size_t> chains;
+		for (size_t i = 0; i < blocks.size(); i++) {
+			if (i == 0 || blocks[i].type != lpz::BlockType::LinkedSplit) chains.push_back(i);
+		}
+
+		std::vector<uint8_t> out(out_size);
+		std::vector<std::expected<size_t, Error>> results(blocks.size());
+
+		lpz::parallel_for(chains.size(), std::min<unsigned>(threads, static_cast<unsigned>(chains.size())), [&](size_t c) {
+
+			const size_t first = chains[c];
+			const size_t last = c + 1 < chains.size() ? chains[c + 1] : blocks.size();
+			const size_t chain_begin = out_offsets[first];
+
+			for (size_t i = first; i < last; i++) {
+				const size_t linked = out_offsets[i] - chain_begin;
+				results[i] = lpz::expand_block(decoded[i], { out.data() + chain_begin, linked + decoded[i].size }, linked, dictionary);
+				decoded[i] = {};
+			}
+		});
+
+		for (auto& result : results) {
+			if (!result) return std::unexpected(Error{ lpz::ErrorCode::SystemError, "Block decompression failed: " + result.error().m });
+		}
+
+		return out;
+	}
+
+	std::expected<std::vector<uint8_t>, lpz::Error> compress_buffer(std::span<const uint8_t> data, lpz::CompressContext& context, const lpz::Dictionary* dictionary, const lpz::CompressOptions& options) {
+
+		using namespace lpz;
+
+		if (data.size() == 0) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
+		}
+		if (options.level < MIN_LEVEL || options.level > MAX_LEVEL) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Invalid compression level" });
+		}
+		if (options.long_window > lz77::MAX_LONG_WINDOW) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Long window too large" });
+		}
+
+		const bool linked = options.linked_blocks || options.long_window > 0;
+
+		// Digested before the workers start, which would otherwise wait on each other for it
+		BlockDictionary block_dictionary;
+		if (dictionary) block_dictionary = { dictionary->state().content, &dictionary->state().tables_for(options.level) };
+
+		std::vector<uint8_t> out;
+
+
+		std::vector < std::span<const uint8_t> > in_blocks;
+
+		const uint8_t* const in_end = data.data() + data.size();
+		const uint8_t* in_pos = data.data();
+
+		while (in_pos < in_end) {
+
+			size_t block_size = std::min(MAX_BLOCK, static_cast<size_t>(in_end - in_pos));
+
+			in_blocks.push_back( { in_pos , block_size } );
+
+			in_pos += block_size;
+
+		}
+
+		if (options.seek_table && in_blocks.size() > MAX_SEEK_ENTRIES) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Input too large for a seek table" });
+		}
+
+		std::vector<std::expected<std::vector<uint8_t>, Error>> out_blocks(in_blocks.size());
+
+		unsigned threads = resolve_threads(options.threads, in_blocks.size());
+		context.state().reserve(threads);
+
+		// Blocks are parsed in parallel, then choose their codes in order, since each may repeat
+		// the codes of the blocks before it, then are entropy coded in parallel again
+		std::vector<PreparedBlock> prepared(in_blocks.size());
+		std::vector<std::expected<void, Error>> prepare_results(in_blocks.size());
+
+		// Long matches are found first, block by block in stream order, since the table carries
+		// every block before
+		std::vector<std::vector<lz77::LongMatch>> long_matches(in_blocks.size());
+		if (options.long_window > 0) {
+			lz77::reset_long_matches(context.state().long_matches, options.long_window);
+			for (size_t i = 0; i < in_blocks.size(); i++) {
+				lz77::find_long_matches(data.first(i * MAX_BLOCK + in_blocks[i].size()), i * MAX_BLOCK, 0, context.state().long_matches, long_matches[i]);
+			}
+		}
+
+		lpz::parallel_for(in_blocks.size(), threads, [&](size_t i, unsigned worker) {
+			size_t history = linked ? std::min(lz77::WINDOW_SIZE, i * MAX_BLOCK) : 0;
+			prepare_results[i] = lpz::prepare_block({ in_blocks[i].data() - history, history + in_blocks[i].size() }, prepared[i], context.state().workers[worker], options.level, history, long_matches[i], dictionary ? &block_dictionary : nullptr);
+		});
+
+		BlockCodes codes = dictionary ? dictionary->state().codes : BlockCodes{};
+		for (size_t i = 0; i < in_blocks.size(); i++) {
+			if (!prepare_results[i]) return std::unexpected(Error{ ErrorCode::SystemError, "Block compression failed: " + prepare_results[i].error().m });
+			lpz::plan_block(prepared[i], codes);
+		}
+
+		lpz::parallel_for(in_blocks.size(), threads, [&](size_t i) {
+			std::vector<uint8_t> comp(BLOCK_HEADER_SIZE + compress_block_bound(in_blocks[i].size()));
+
+			auto size = lpz::write_block(prepared[i], comp);
+			prepared[i] = {};
+			if (!size) {
+				out_blocks[i] = std::unexpected(size.error());
+				return;
+			}
+
+			comp.resize(*size);
+			out_blocks[i] = std::move(comp);
+		});
+
+		size_t out_size = 0;
+		for (auto& comp_res : out_blocks) {
+			if (!comp_res) return std::unexpected(Error{ ErrorCode::SystemError, "Block compression failed: " + comp_res.error().m });
+			out_size += comp_res->size();
+		}
+		out.reserve(WINDOW_BLOCK_SIZE + DICTIONARY_BLOCK_SIZE + out_size);
+
+		if (options.long_window > 0) {
+			out.resize(WINDOW_BLOCK_SIZE);
+			write_window_block(out.data(), options.long_window);
+		}
+		if (dictionary) {
+			out.resize(out.size() + DICTIONARY_BLOCK_SIZE);
+			write_dictionary_block(out.data() + out.size() - DICTIONARY_BLOCK_SIZE, dictionary->id());
+		}
+
+		std::vector<SeekEntry> seek_entries;
+
+		for (size_t i = 0; i < out_blocks.size(); i++) {
+
+			auto& comp = *out_blocks[i];
+
+			out.insert(out.end(), comp.begin(), comp.end());
+
+			if (options.seek_table) {
+				seek_entries.push_back({ static_cast<uint32_t>(comp.size()), static_cast<uint32_t>(in_blocks[i].size()) });
+			}
+
+			comp = {};
+		}
+
+		if (options.seek_table) {
+			write_seek_table(out, seek_entries);
+		}
+
+		return out;
+
+	}
+
+	std::expected<std::vector<uint8_t>, lpz::Error> decompress_buffer(std::span<const uint8_t> data, lpz::DecompressContext& context, const lpz::Dictionary* dictionary, const lpz::DecompressOptions& options) {
+
+		using namespace lpz;
+
+		if (data.size() == 0) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
+		}
+
+		auto in_blocks = split_blocks(data);
+		if (!in_blocks) return std::unexpected(in_blocks.error());
+
+		auto state = stream_dictionary(data, dictionary);
+		if (!state) return std::unexpected(state.error());
+
+		BlockCodes codes = *state ? (*state)->codes : BlockCodes{};
+		return decode_blocks(*in_blocks, resolve_threads(options.threads, in_blocks->size()), context.state(), codes, *state ? std::span<const uint8_t>((*state)->content) : std::span<const uint8_t>{});
+
+	}
+
+	std::expected<size_t, lpz::Error> compress_buffer_into(std::span<const uint8_t> data, std::span<uint8_t> out, lpz::CompressContext& context, const lpz::Dictionary* dictionary, const lpz::CompressOptions& options) {
+
+		using namespace lpz;
+
+		if (data.size() == 0) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
+		}
+
+		if (options.long_window > lz77::MAX_LONG_WINDOW) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Long window too large" });
+		}
+
+		const bool linked = options.linked_blocks || options.long_window > 0;
+
+		BlockDictionary block_dictionary;
+		if (dictionary) block_dictionary = { dictionary->state().content, &dictionary->state().tables_for(options.level) };
+
+		context.state().reserve(1);
+		auto& scratch = context.state().workers[0];
+		auto& seek_entries = context.state().seek_entries;
+		auto& long_matches = context.state().block_long_matches;
+
+		seek_entries.clear();
+		long_matches.clear();
+
+		BlockCodes codes = dictionary ? dictionary->state().codes : BlockCodes{};
+		size_t out_pos = 0;
+
+		if (options.long_window > 0) {
+			if (out.size() < WINDOW_BLOCK_SIZE) {
+				return std::unexpected(Error{ ErrorCode::InputError, "Output buffer too small" });
+			}
+			write_window_block(out.data(), options.long_window);
+			out_pos += WINDOW_BLOCK_SIZE;
+			lz77::reset_long_matches(context.state().long_matches, options.long_window);
+		}
+		if (dictionary) {
+			if (out.size() - out_pos < DICTIONARY_BLOCK_SIZE) {
+				return std::unexpected(Error{ ErrorCode::InputError, "Output buffer too small" });
+			}
+			write_dictionary_block(out.data() + out_pos, dictionary->id());
+			out_pos += DICTIONARY_BLOCK_SIZE;
+		}
 
+		for (size_t in_pos = 0; in_pos < data.size(); in_pos += MAX_BLOCK) {
 
-	std::vector < std::span<const uint8_t> > in_blocks;
+			auto in_block = data.subspan(in_pos, std::min(MAX_BLOCK, data.size() - in_pos));
 
-	const uint8_t const* in_end = data.data() + data.size();
-	const uint8_t* in_pos = data.data();
+			if (out.size() - out_pos < BLOCK_HEADER_SIZE + compress_block_bound(in_block.size())) {
+				return std::unexpected(Error{ ErrorCode::InputError, "Output buffer too small" });
+			}
 
-	while (in_pos < in_end) {
+			if (options.long_window > 0) {
+				long_matches.clear();
+				lz77::find_long_matches(data.first(in_pos + in_block.size()), in_pos, 0, context.state().long_matches, long_matches);
+			}
 
-		size_t block_size = std::min(MAX_BLOCK, static_cast<size_t>(in_end - in_pos));
+			size_t history = linked ? std::min(lz77::WINDOW_SIZE, in_pos) : 0;
+			auto prepared = lpz::prepare_block(data.subspan(in_pos - history, history + in_block.size()), scratch.prepared, scratch, options.level, history, long_matches, dictionary ? &block_dictionary : nullptr);
+			if (!prepared) return std::unexpected(Error{ prepared.error().c, "Block compression failed: " + prepared.error().m });
 
-		in_blocks.push_back( { in_pos , block_size } );
+			lpz::plan_block(scratch.prepared, codes);
 
-		in_pos += block_size;
+			auto comp_size = lpz::write_block(scratch.prepared, out.subspan(out_pos));
+			if (!comp_size) return std::unexpected(Error{ comp_size.error().c, "Block compression failed: " + comp_size.error().m });
+
+			out_pos += *comp_size;
+
+			if (options.seek_table) {
+				seek_entries.push_back({ static_cast<uint32_t>(*comp_size), static_cast<uint32_t>(in_block.size()) });
+			}
+		}
+
+		if (options.seek_table) {
+
+			if (seek_entries.size() > MAX_SEEK_ENTRIES) {
+				return std::unexpected(Error{ ErrorCode::InputError, "Input too large for a seek table" });
+			}
+			if (out.size() - out_pos < seek_table_size(seek_entries.size())) {
+				return std::unexpected(Error{ ErrorCode::InputError, "Output buffer too small" });
+			}
+
+			write_seek_table(out.data() + out_pos, seek_entries);
+			out_pos += seek_table_size(seek_entries.size());
+		}
+
+		return out_pos;
 
 	}
 
-	for (auto& in_block : in_blocks) {
+	std::expected<size_t, lpz::Error> decompress_buffer_into(std::span<const uint8_t> data, std::span<uint8_t> out, lpz::DecompressContext& context, const lpz::Dictionary* dictionary) {
+
+		using namespace lpz;
+
+		if (data.size() == 0) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
+		}
+
+		auto state = stream_dictionary(data, dictionary);
+		if (!state) return std::unexpected(state.error());
+
+		context.state().reserve(1);
+		auto& scratch = context.state().workers[0];
+
+		BlockCodes codes = *state ? (*state)->codes : BlockCodes{};
+		std::span<const uint8_t> content = *state ? std::span<const uint8_t>((*state)->content) : std::span<const uint8_t>{};
+		size_t in_pos = 0;
+		size_t out_pos = 0;
+		size_t chain_begin = 0; // output offset of the last unlinked block
+
+		while (in_pos < data.size()) {
+
+			auto header = read_block_header(data.subspan(in_pos));
+			if (!header) return std::unexpected(header.error());
 
-		auto comp_res = lpz::compress_block(in_block);
-		if (!comp_res) return std::unexpected(Error{ ErrorCode::SystemError, "Block compression failed: " + comp_res.error().m });
-		auto& comp = *comp_res;
+			in_pos += BLOCK_HEADER_SIZE;
 
-		uint32_t size = comp.size();
-		out.insert(out.end(), reinterpret_cast<uint8_t*>(&size), reinterpret_cast<uint8_t*>(&size) + sizeof(size));
+			if (is_data_block(header->type)) {
+				if (header->type != BlockType::LinkedSplit) chain_begin = out_pos;
+				size_t history = out_pos - chain_begin;
+
+				auto decomp_size = lpz::decompress_block_into({ header->type, data.subspan(in_pos, header->size) }, out.subspan(out_pos - history), codes, scratch, history, content);
+				if (!decomp_size) return std::unexpected(Error{ ErrorCode::InputError, "Block decompression failed: " + decomp_size.error().m });
+				out_pos += *decomp_size;
+			}
+
+			in_pos += header->size;
+		}
+
+		return out_pos;
 
-		out.insert(out.end(), comp.begin(), comp.end());
 	}
 
-	return out;
+}
+
+
+lpz::CompressContext::CompressContext() : state_(std::make_unique<State>()) {}
+lpz::CompressContext::~CompressContext() = default;
+lpz::CompressContext::CompressContext(CompressContext&&) noexcept = default;
+lpz::CompressContext& lpz::CompressContext::operator=(CompressContext&&) noexcept = default;
 
+lpz::DecompressContext::DecompressContext() : state_(std::make_unique<State>()) {}
+lpz::DecompressContext::~DecompressContext() = default;
+lpz::DecompressContext::DecompressContext(DecompressContext&&) noexcept = default;
+lpz::DecompressContext& lpz::DecompressContext::operator=(DecompressContext&&) noexcept = default;
+
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::compress(std::span<const uint8_t> data, const CompressOptions& options) {
+	CompressContext context;
+	return compress(data, context, options);
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::compress(std::span<const uint8_t> data, CompressContext& context, const CompressOptions& options) {
+	return compress_buffer(data, context, nullptr, options);
 }
 
-std::expected<std::vector<uint8_t>, lpz::Error> lpz::decompress(std::span<const uint8_t> data) {
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::decompress(std::span<const uint8_t> data, const DecompressOptions& options) {
+	DecompressContext context;
+	return decompress(data, context, options);
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::decompress(std::span<const uint8_t> data, DecompressContext& context, const DecompressOptions& options) {
+	return decompress_buffer(data, context, nullptr, options);
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::compress(std::span<const uint8_t> data, const Dictionary& dictionary, const CompressOptions& options) {
+	CompressContext context;
+	return compress(data, context, dictionary, options);
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::compress(std::span<const uint8_t> data, CompressContext& context, const Dictionary& dictionary, const CompressOptions& options) {
+	return compress_buffer(data, context, &dictionary, options);
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::decompress(std::span<const uint8_t> data, const Dictionary& dictionary, const DecompressOptions& options) {
+	DecompressContext context;
+	return decompress(data, context, dictionary, options);
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::decompress(std::span<const uint8_t> data, DecompressContext& context, const Dictionary& dictionary, const DecompressOptions& options) {
+	return decompress_buffer(data, context, &dictionary, options);
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::decompress_range(std::span<const uint8_t> data, uint64_t offset, uint64_t length, const DecompressOptions& options) {
+	DecompressContext context;
+	return decompress_range(data, offset, length, context, options);
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> lpz::decompress_range(std::span<const uint8_t> data, uint64_t offset, uint64_t length, DecompressContext& context, const DecompressOptions& options) {
 
 	if (data.size() == 0) {
 		return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
 	}
 
-	std::vector<uint8_t> out;
+	uint64_t range_end = length > std::numeric_limits<uint64_t>::max() - offset ? std::numeric_limits<uint64_t>::max() : offset + length;
 
-	std::vector < std::span<const uint8_t> > in_blocks;
+	auto dictionary = stream_dictionary(data, nullptr);
+	if (!dictionary) return std::unexpected(dictionary.error());
 
+	auto index = read_seek_table(data);
+	if (!index) return std::unexpected(index.error());
 
-	const uint8_t const* in_begin = data.data();
-	const uint8_t const* in_end = in_begin + data.size();
-	const uint8_t* in_pos = in_begin;
+	if (index->blocks.empty()) {
 
-	while (in_pos < in_end) {
+		// No seek table: decode from the start and stop once the range is covered.
+		auto in_blocks = split_blocks(data);
+		if (!in_blocks) return std::unexpected(in_blocks.error());
 
-		uint32_t block_size;
-		memcpy(&block_size, in_pos, sizeof(block_size));
+		auto window = stream_window(data);
+		if (!window) return std::unexpected(window.error());
 
-		in_pos += sizeof(block_size);
+		context.state().reserve(1);
+		auto& scratch = context.state().workers[0];
 
-		in_blocks.push_back({ in_pos , block_size });
+		std::vector<uint8_t> out;
+		uint64_t block_offset = 0;
+		BlockCodes codes;
+		std::vector<uint8_t> chain; // output of the run of linked blocks so far, or its last `window` bytes and more
+
+		for (const Block& in_block : *in_blocks) {
+
+			if (block_offset >= range_end) break;
+
+			auto decoded = entropy_decode_block(in_block, scratch.decoded, codes, scratch.tables);
+			if (!decoded) return std::unexpected(Error{ ErrorCode::SystemError, "Block decompression failed: " + decoded.error().m });
+
+			if (in_block.type != BlockType::LinkedSplit) chain.clear();
+			else trim_history(chain, *window);
+
+			const size_t history = chain.size();
+			chain.resize(history + scratch.decoded.size);
+
+			auto expanded = expand_block(scratch.decoded, chain, history);
+			if (!expanded) return std::unexpected(Error{ ErrorCode::SystemError, "Block decompression failed: " + expanded.error().m });
+
+			uint64_t block_end = block_offset + scratch.decoded.size;
+
+			if (block_end > offset) {
+				size_t first = static_cast<size_t>(std::max(offset, block_offset) - block_offset);
+				size_t last = static_cast<size_t>(std::min(range_end, block_end) - block_offset);
+				out.insert(out.end(), chain.begin() + history + first, chain.begin() + history + last);
+			}
+
+			block_offset = block_end;
+		}
+
+		if (offset > block_offset) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Range starts past the end of the data" });
+		}
+
+		return out;
+	}
 
-		in_pos += block_size;
+	uint64_t total = index->offsets.back();
 
+	if (offset > total) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Range starts past the end of the data" });
 	}
 
-	for (auto& in_block : in_blocks) {
+	uint64_t end = std::min(range_end, total);
+	if (end == offset) return std::vector<uint8_t>{};
 
-		auto comp_res = lpz::decompress_block(in_block);
-		if (!comp_res) return std::unexpected(Error{ ErrorCode::SystemError, "Block decompression failed: " + comp_res.error().m });
-		auto& comp = *comp_res;
+	// First block ending after `offset`, and one past the last block starting before `end`.
+	size_t first = std::upper_bound(index->offsets.begin(), index->offsets.end() - 1, offset) - index->offsets.begin() - 1;
+	size_t last = std::lower_bound(index->offsets.begin(), index->offsets.end() - 1, end) - index->offsets.begin();
 
-		out.insert(out.end(), comp.begin(), comp.end());
+	// Linked blocks need the blocks before them back to the last unlinked one
+	while (first > 0 && index->blocks[first].type == BlockType::LinkedSplit) first--;
+
+	// Only the stream headers of the blocks before the range are read, for their codes
+	BlockCodes codes;
+	for (size_t i = 0; i < first; i++) {
+		auto advanced = advance_block_codes(index->blocks[i], codes);
+		if (!advanced) return std::unexpected(advanced.error());
+	}
+
+	std::span<const Block> blocks(index->blocks.data() + first, last - first);
+
+	auto decomp = decode_blocks(blocks, resolve_threads(options.threads, blocks.size()), context.state(), codes);
+	if (!decomp) return std::unexpected(decomp.error());
+
+	if (decomp->size() != index->offsets[last] - index->offsets[first]) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Seek table does not match blocks" });
+	}
+
+	size_t skip = static_cast<size_t>(offset - index->offsets[first]);
+	decomp->erase(decomp->begin(), decomp->begin() + skip);
+	decomp->resize(static_cast<size_t>(end - offset));
+
+	return decomp;
+
+}
+
+size_t lpz::compress_bound(size_t size) {
+
+	size_t blocks = std::max<size_t>((size + MAX_BLOCK - 1) / MAX_BLOCK, 1);
+	size_t full_blocks = size / MAX_BLOCK;
+	size_t tail = size - full_blocks * MAX_BLOCK;
+
+	size_t bound = full_blocks * (BLOCK_HEADER_SIZE + compress_block_bound(MAX_BLOCK));
+	if (tail > 0) bound += BLOCK_HEADER_SIZE + compress_block_bound(tail);
+
+	return WINDOW_BLOCK_SIZE + DICTIONARY_BLOCK_SIZE + bound + seek_table_size(blocks);
+}
+
+std::expected<size_t, lpz::Error> lpz::compress_into(std::span<const uint8_t> data, std::span<uint8_t> out, const CompressOptions& options) {
+	thread_local CompressContext context;
+	return compress_into(data, out, context, options);
+}
+
+std::expected<size_t, lpz::Error> lpz::compress_into(std::span<const uint8_t> data, std::span<uint8_t> out, CompressContext& context, const CompressOptions& options) {
+	return compress_buffer_into(data, out, context, nullptr, options);
+}
+
+std::expected<size_t, lpz::Error> lpz::decompress_into(std::span<const uint8_t> data, std::span<uint8_t> out) {
+	thread_local DecompressContext context;
+	return decompress_into(data, out, context);
+}
+
+std::expected<size_t, lpz::Error> lpz::decompress_into(std::span<const uint8_t> data, std::span<uint8_t> out, DecompressContext& context) {
+	return decompress_buffer_into(data, out, context, nullptr);
+}
+
+std::expected<size_t, lpz::Error> lpz::compress_into(std::span<const uint8_t> data, std::span<uint8_t> out, const Dictionary& dictionary, const CompressOptions& options) {
+	thread_local CompressContext context;
+	return compress_into(data, out, context, dictionary, options);
+}
+
+std::expected<size_t, lpz::Error> lpz::compress_into(std::span<const uint8_t> data, std::span<uint8_t> out, CompressContext& context, const Dictionary& dictionary, const CompressOptions& options) {
+	return compress_buffer_into(data, out, context, &dictionary, options);
+}
+
+std::expected<size_t, lpz::Error> lpz::decompress_into(std::span<const uint8_t> data, std::span<uint8_t> out, const Dictionary& dictionary) {
+	thread_local DecompressContext context;
+	return decompress_into(data, out, context, dictionary);
+}
+
+std::expected<size_t, lpz::Error> lpz::decompress_into(std::span<const uint8_t> data, std::span<uint8_t> out, DecompressContext& context, const Dictionary& dictionary) {
+	return decompress_buffer_into(data, out, context, &dictionary);
+}
+
+std::expected<uint64_t, lpz::Error> lpz::decompressed_size(std::span<const uint8_t> data) {
+	DecompressContext context;
+	return decompressed_size(data, context);
+}
+
+std::expected<uint64_t, lpz::Error> lpz::decompressed_size(std::span<const uint8_t> data, DecompressContext& context) {
+
+	if (data.size() == 0) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
+	}
+
+	auto index = read_seek_table(data);
+	if (!index) return std::unexpected(index.error());
+
+	if (!index->blocks.empty()) return index->offsets.back();
+
+	auto dictionary = stream_dictionary(data, nullptr);
+	if (!dictionary) return std::unexpected(dictionary.error());
+
+	auto in_blocks = split_blocks(data);
+	if (!in_blocks) return std::unexpected(in_blocks.error());
+
+	context.state().reserve(1);
+	auto& scratch = context.state().workers[0];
+
+	BlockCodes codes;
+	uint64_t size = 0;
+
+	for (auto& in_block : *in_blocks) {
+
+		auto decoded = lpz::entropy_decode_block(in_block, scratch.decoded, codes, scratch.tables);
+		if (!decoded) return std::unexpected(decoded.error());
+
+		size += scratch.decoded.size;
 	}
 
-	return out;
+	return size;
 
-}
\ No newline at end of file
+}
@@ -3,11 +3,20 @@
 #include <vector>
 #include <span>
 #include <expected>
+#include <functional>
+#include <memory>
 
 namespace lpz {
 
 	constexpr size_t MAX_BLOCK = 128 * 1024;
 
+	// Compression levels trade speed for ratio: higher levels search further for matches.
+	// MIN_LEVEL probes once per position and skips ahead through incompressible data, and
+	// MAX_LEVEL picks the cheapest parse by estimated encoded size, for write-once archives
+	constexpr int MIN_LEVEL = 1;
+	constexpr int MAX_LEVEL = 10;
+	constexpr int DEFAULT_LEVEL = 5;
+
 	enum class ErrorCode {
 		SystemError,
 		InputError,
@@ -18,7 +27,180 @@ namespace lpz {
 		std::string m;
 	};
 
+	struct CompressOptions {
+		unsigned threads = 1; // 0 = one per hardware thread
+		bool seek_table = false; // append a block index so decompress_range can seek
+		int level = DEFAULT_LEVEL; // MIN_LEVEL (fastest) to MAX_LEVEL (smallest)
+		bool linked_blocks = false; // let matches reach into the block before: smaller output, but
+		                            // blocks are expanded in order and seeks start from the first
+		size_t long_window = 0; // also find repeats of 64+ bytes up to this far back, at most
+		                        // 512 MiB; implies linked_blocks. Compressor and Decompressor
+		                        // each keep up to twice this much data, and Compressor a hash
+		                        // table of up to 32 MiB besides
+	};
+
+	struct DecompressOptions {
+		unsigned threads = 1; // 0 = one per hardware thread
+	};
+
+
+	// Work tables for compression: match finder tables and intermediate buffers for each
+	// worker thread. Reusing one context across calls avoids allocating and clearing them
+	// every time, which dominates for small inputs. A context must not be used by two calls
+	// at once; the overloads without one create a fresh context per call.
+	class CompressContext {
+	public:
+		CompressContext();
+		~CompressContext();
+		CompressContext(CompressContext&&) noexcept;
+		CompressContext& operator=(CompressContext&&) noexcept;
+
+		struct State;
+		State& state() { return *state_; }
+
+	private:
+		std::unique_ptr<State> state_;
+	};
+
+	// Work tables for decompression: Huffman decode tables and intermediate buffers
+	class DecompressContext {
+	public:
+		DecompressContext();
+		~DecompressContext();
+		DecompressContext(DecompressContext&&) noexcept;
+		DecompressContext& operator=(DecompressContext&&) noexcept;
+
+		struct State;
+		State& state() { return *state_; }
+
+	private:
+		std::unique_ptr<State> state_;
+	};
+
+
+	// Matches reach just under 64 KiB back, so no more of a dictionary than this is used
+	constexpr size_t MAX_DICTIONARY = 63 * 1024;
+	constexpr size_t DEFAULT_DICTIONARY = 32 * 1024;
+
+	// Content and entropy codes shared by many small inputs of one kind, such as messages or
+	// records, that are too short to compress well on their own. Compression with a dictionary
+	// parses each input as if the content came before it and starts from its codes. The match
+	// finder tables for the content are built once per level, on first use, and reused by
+	// every call; a dictionary may be used by several calls at once. Streams compressed with
+	// a dictionary only decompress with the same one.
+	class Dictionary {
+	public:
+		~Dictionary();
+		Dictionary(Dictionary&&) noexcept;
+		Dictionary& operator=(Dictionary&&) noexcept;
+
+		// Identifies the dictionary in the streams compressed with it
+		uint32_t id() const;
+
+		struct State;
+		const State& state() const { return *state_; }
+
+	private:
+		explicit Dictionary(std::unique_ptr<State> state);
+		friend std::expected<Dictionary, Error> load_dictionary(std::span<const uint8_t> data);
+
+		std::unique_ptr<State> state_;
+	};
+
+	// Loads a dictionary written by train_dictionary. Any other data is taken as the content of
+	// a dictionary without codes of its own
+	std::expected<Dictionary, Error> load_dictionary(std::span<const uint8_t> data);
+
+	// Builds a dictionary of at most `max_size` bytes of content from samples of the inputs it
+	// is meant for: the segments that recur across most samples, with the codes the samples
+	// get when compressed with them at `level`
+	std::expected<std::vector<uint8_t>, Error> train_dictionary(std::span<const std::span<const uint8_t>> samples, size_t max_size = DEFAULT_DICTIONARY, int level = DEFAULT_LEVEL);
+
+
+	std::expected<std::vector<uint8_t>, Error> compress(std::span<const uint8_t> data, const CompressOptions& options = {});
+	std::expected<std::vector<uint8_t>, Error> compress(std::span<const uint8_t> data, CompressContext& context, const CompressOptions& options = {});
+	std::expected<std::vector<uint8_t>, Error> decompress(std::span<const uint8_t> data, const DecompressOptions& options = {});
+	std::expected<std::vector<uint8_t>, Error> decompress(std::span<const uint8_t> data, DecompressContext& context, const DecompressOptions& options = {});
+
+	// With a dictionary, which the unlinked blocks and the first of each run of linked blocks
+	// reach back into. Streams compressed without one decompress as usual
+	std::expected<std::vector<uint8_t>, Error> compress(std::span<const uint8_t> data, const Dictionary& dictionary, const CompressOptions& options = {});
+	std::expected<std::vector<uint8_t>, Error> compress(std::span<const uint8_t> data, CompressContext& context, const Dictionary& dictionary, const CompressOptions& options = {});
+	std::expected<std::vector<uint8_t>, Error> decompress(std::span<const uint8_t> data, const Dictionary& dictionary, const DecompressOptions& options = {});
+	std::expected<std::vector<uint8_t>, Error> decompress(std::span<const uint8_t> data, DecompressContext& context, const Dictionary& dictionary, const DecompressOptions& options = {});
+
+	// Largest output compress_into can produce for `size` input bytes, whatever the options
+	size_t compress_bound(size_t size);
+
+	// Compress into / decompress from caller-owned memory on the calling thread. Without a
+	// context, work tables are kept per thread, so repeated calls do not allocate once warm.
+	// Both return the number of bytes written, or an InputError if `out` is too small.
+	std::expected<size_t, Error> compress_into(std::span<const uint8_t> data, std::span<uint8_t> out, const CompressOptions& options = {});
+	std::expected<size_t, Error> compress_into(std::span<const uint8_t> data, std::span<uint8_t> out, CompressContext& context, const CompressOptions& options = {});
+	std::expected<size_t, Error> decompress_into(std::span<const uint8_t> data, std::span<uint8_t> out);
+	std::expected<size_t, Error> decompress_into(std::span<const uint8_t> data, std::span<uint8_t> out, DecompressContext& context);
+	std::expected<size_t, Error> compress_into(std::span<const uint8_t> data, std::span<uint8_t> out, const Dictionary& dictionary, const CompressOptions& options = {});
+	std::expected<size_t, Error> compress_into(std::span<const uint8_t> data, std::span<uint8_t> out, CompressContext& context, const Dictionary& dictionary, const CompressOptions& options = {});
+	std::expected<size_t, Error> decompress_into(std::span<const uint8_t> data, std::span<uint8_t> out, const Dictionary& dictionary);
+	std::expected<size_t, Error> decompress_into(std::span<const uint8_t> data, std::span<uint8_t> out, DecompressContext& context, const Dictionary& dictionary);
+
+	// Size of the original data. Read straight from the seek table when the stream has one,
+	// otherwise each block is entropy-decoded to measure it, which streams compressed with a
+	// dictionary cannot be.
+	std::expected<uint64_t, Error> decompressed_size(std::span<const uint8_t> data);
+	std::expected<uint64_t, Error> decompressed_size(std::span<const uint8_t> data, DecompressContext& context);
 
-	std::expected<std::vector<uint8_t>, Error> compress(std::span<const uint8_t> data);
-	std::expected<std::vector<uint8_t>, Error> decompress(std::span<const uint8_t> data);
+	// Decompresses `length` bytes starting at `offset` of the original data, clamped to its end.
+	// Only the blocks covering the range are decoded when the stream carries a seek table;
+	// without one, blocks are decoded from the start until the range is covered. Streams
+	// compressed with a dictionary are not supported.
+	std::expected<std::vector<uint8_t>, Error> decompress_range(std::span<const uint8_t> data, uint64_t offset, uint64_t length, const DecompressOptions& options = {});
+	std::expected<std::vector<uint8_t>, Error> decompress_range(std::span<const uint8_t> data, uint64_t offset, uint64_t length, DecompressContext& context, const DecompressOptions& options = {});
+
+	// Receives each piece of output as soon as it is produced
+	using Sink = std::function<std::expected<void, Error>(std::span<const uint8_t>)>;
+
+	// Streaming compressor. Input is buffered until a block fills (threads * MAX_BLOCK bytes
+	// when compressing in parallel), then compressed and handed to the sink, so memory stays
+	// bounded regardless of input size, though a long_window raises the bound to match it.
+	// Output matches lpz::compress on the same input.
+	// Dictionaries are only taken by the whole-buffer functions.
+	class Compressor {
+	public:
+		explicit Compressor(Sink sink, const CompressOptions& options = {});
+		// Borrows `context`, which must outlive the compressor
+		Compressor(Sink sink, CompressContext& context, const CompressOptions& options = {});
+		~Compressor();
+		Compressor(Compressor&&) noexcept;
+		Compressor& operator=(Compressor&&) noexcept;
+
+		std::expected<void, Error> write(std::span<const uint8_t> data);
+		// Compresses any buffered input and writes the seek table if one was requested. Fails if
+		// no input was written, which lpz::compress does not take either
+		std::expected<void, Error> finish();
+
+	private:
+		struct State;
+		std::unique_ptr<State> state_;
+	};
+
+	// Streaming decompressor. Accepts the compressed stream in arbitrary slices and emits each
+	// block's output once the whole block has arrived; only an incomplete block is buffered.
+	class Decompressor {
+	public:
+		explicit Decompressor(Sink sink, const DecompressOptions& options = {});
+		// Borrows `context`, which must outlive the decompressor
+		Decompressor(Sink sink, DecompressContext& context, const DecompressOptions& options = {});
+		~Decompressor();
+		Decompressor(Decompressor&&) noexcept;
+		Decompressor& operator=(Decompressor&&) noexcept;
+
+		std::expected<void, Error> write(std::span<const uint8_t> data);
+		// Fails if the stream ended part-way through a block, or was empty
+		std::expected<void, Error> finish();
+
+	private:
+		struct State;
+		std::unique_ptr<State> state_;
+	};
 }
\ No newline at end of file
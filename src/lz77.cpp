@@ -1,13 +1,21 @@
 #include "lz77.h"
+#include "huffman.h"
 #include <cassert>
 #include <iostream>
+#include <array>
+#include <bit>
+#include <atomic>
+#include <cstring>
+#include <limits>
 
 namespace {
 
-	constexpr uint16_t MAX_DISTANCE = 65535;
-	constexpr uint32_t MAX_LENGTH = 2 * 1024;
+	using lpz::lz77::Format;
+	using lpz::lz77::RepOffsets;
+	using lpz::lz77::REP_CODES;
 
-	constexpr int MAX_CHAIN = 12;
+	constexpr uint16_t MAX_DISTANCE = static_cast<uint16_t>(lpz::lz77::WINDOW_SIZE - REP_CODES);
+	constexpr uint32_t MAX_LENGTH = 2 * 1024;
 
 	constexpr int MIN_MATCH = 4;
 	constexpr int MATCH_LENGTH_BIAS = MIN_MATCH;
@@ -17,249 +25,1776 @@ namespace {
 
 	static_assert(MIN_MATCH >= MATCH_LENGTH_BIAS);
 
+	enum class Strategy {
+		Fast,    // single hash probe per position, see encode_fast
+		Greedy,  // take the longest match found, optionally deferring to a better one
+		Optimal, // choose the cheapest parse by estimated encoded size
+	};
+
+	struct LevelParams {
+		int max_chain;
+		int lazy_steps;       // 0 = greedy, 1 = try a match at ip + 1, 2 = also at ip + 2
+		uint32_t nice_length; // stop searching once a match is this long
+		Strategy strategy = Strategy::Greedy;
+		bool binary_tree = false; // binary tree match finder, where max_chain bounds the tree depth
+	};
+
+	constexpr std::array<LevelParams, lpz::MAX_LEVEL + 1> LEVELS = { {
+		{   0, 0, 0 },
+		{   0, 0, 0, Strategy::Fast },
+		{   4, 0, 64 },
+		{   6, 0, 128 },
+		{   8, 0, 256 },
+		{  12, 0, MAX_LENGTH },
+		{  16, 1, MAX_LENGTH },
+		{  32, 1, MAX_LENGTH },
+		{  64, 2, MAX_LENGTH },
+		{ 128, 2, MAX_LENGTH },
+		{  48, 0, 128, Strategy::Optimal, true },
+	} };
+
+	// Optimal parsing prices each pass with statistics from the previous one, so a few passes
+	// let the parse and the code lengths it is priced with settle together
+	constexpr int OPTIMAL_PASSES = 2;
+	constexpr size_t MAX_CANDIDATES = 32;
+
+	// Copies may write up to this many bytes past their end, so they are only used while that
+	// much output space is left; the last bytes of a buffer are written exactly
+	constexpr size_t WILD_COPY = 32;
+
+	// The fast level's probe stride grows by one every 2^FAST_SKIP_STRENGTH misses in a row
+	constexpr uint32_t FAST_SKIP_STRENGTH = 6;
+
+	// A repeat offset match this long is taken without asking the match finder for a longer one
+	constexpr uint32_t REP_ACCEPT_LENGTH = 32;
+
+	// One in this many distances is counted when choosing how a stream codes them
+	constexpr size_t DISTANCE_SAMPLE_STEP = 4;
+
 	inline uint32_t read32(const void* p) {
 		uint32_t val;
 		std::memcpy(&val, p, sizeof(uint32_t));
 		return val;
 	}
 
+	inline uint64_t read64(const void* p) {
+		uint64_t val;
+		std::memcpy(&val, p, sizeof(uint64_t));
+		return val;
+	}
+
+	size_t common_length(const uint8_t* a, const uint8_t* b, size_t limit) {
+		size_t length = 0;
+		while (length + 8 <= limit) {
+			uint64_t diff = read64(a + length) ^ read64(b + length);
+			if (diff != 0) return length + std::countr_zero(diff) / 8;
+			length += 8;
+		}
+		while (length < limit && a[length] == b[length]) length++;
+		return length;
+	}
+
+	// Index of `distance` among `reps`, or REP_CODES if it is none of them
+	inline uint32_t rep_index(const RepOffsets& reps, size_t distance) {
+		for (uint32_t i = 0; i < REP_CODES; i++) {
+			if (reps[i] == distance) return i;
+		}
+		return REP_CODES;
+	}
+
+	// reps[index], picked without indexing so that the offsets can stay in registers
+	inline uint32_t rep_at(const RepOffsets& reps, uint32_t index) {
+		static_assert(REP_CODES == 3);
+		return index == 0 ? reps[0] : index == 1 ? reps[1] : reps[2];
+	}
+
+	// Moves reps[index] to the front, or pushes a new `distance` there when index is REP_CODES,
+	// without branches, as the index is hard to predict
+	inline void push_rep(RepOffsets& reps, uint32_t index, size_t distance) {
+		static_assert(REP_CODES == 3);
+		reps[2] = index >= 2 ? reps[1] : reps[2];
+		reps[1] = index >= 1 ? reps[0] : reps[1];
+		reps[0] = static_cast<uint32_t>(distance);
+	}
+
+	// Values 1 to REP_CODES of the distance field are repeat offsets in `format`
+	constexpr uint32_t rep_bias(Format format) {
+		return format == Format::RepeatOffsets ? REP_CODES : 0;
+	}
+
 	inline uint32_t hash(const uint8_t* p) {
 		uint32_t val = read32(p);
 		val *= 0x1e35a7bd;                 
 		return (val >> (32 - HASH_BITS)) & ((1u << HASH_BITS) - 1);
 	}
 
+	// Copies `length` bytes in 32-byte steps, writing and reading up to WILD_COPY bytes too many
+	inline void wild_copy(uint8_t* dst, const uint8_t* src, size_t length) {
+		uint8_t* const end = dst + length;
+		do {
+			std::memcpy(dst, src, 16);
+			std::memcpy(dst + 16, src + 16, 16);
+			dst += 32;
+			src += 32;
+		} while (dst < end);
+	}
 
-}
+	// Copies a match whose source may overlap it, writing up to WILD_COPY bytes past its end.
+	// Short distances first spread the repeating pattern so that the rest can be copied in
+	// 8-byte steps whose source lies fully behind the destination.
+	inline void copy_match(uint8_t* op, size_t distance, size_t length) {
 
-std::expected<std::vector<uint8_t>, lpz::Error> 
-lpz::lz77::encode(std::span<const uint8_t> input) {
+		const uint8_t* src = op - distance;
+		uint8_t* const end = op + length;
 
-	if (input.size() >= std::numeric_limits<uint32_t>::max())
-		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 compress: Input too large" });
-	if (input.empty())
-		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 compress: Empty Input" });
-	
-	std::vector<int32_t> head(HASH_SIZE, -1);
-	std::vector<int32_t> chain(input.size(), -1);
+		if (distance >= 32) {
+			wild_copy(op, src, length);
+			return;
+		}
+		if (distance >= 16) {
+			do {
+				std::memcpy(op, src, 16);
+				op += 16;
+				src += 16;
+			} while (op < end);
+			return;
+		}
+		if (distance == 1) {
+			std::memset(op, *src, length);
+			return;
+		}
 
-	std::vector<uint8_t> output;
-	output.reserve(input.size());
+		if (distance < 8) {
+			// Offsets that move `src` to the same phase of the pattern 4 and 8 bytes on
+			constexpr std::array<int, 8> SPREAD_4 = { 0, 1, 2, 1, 0, 4, 4, 4 };
+			constexpr std::array<int, 8> SPREAD_8 = { 0, 0, 0, -1, -4, 1, 2, 3 };
+
+			op[0] = src[0];
+			op[1] = src[1];
+			op[2] = src[2];
+			op[3] = src[3];
+			src += SPREAD_4[distance];
+			std::memcpy(op + 4, src, 4);
+			src -= SPREAD_8[distance];
+		}
+		else {
+			std::memcpy(op, src, 8);
+			src += 8;
+		}
+		op += 8;
+
+		while (op < end) {
+			std::memcpy(op, src, 8);
+			op += 8;
+			src += 8;
+		}
+	}
 
-	const uint8_t* const in_base = input.data();
-	const uint8_t* ip = in_base;
-	const uint8_t* const in_end = in_base + input.size();
-	const uint8_t* anchor = ip;
+	using lpz::lz77::Match;
+
+	// Which per-position links a match finder keeps besides the head table
+	enum class Links {
+		None,
+		Chain,
+		Tree,
+	};
+
+	// Positions a finder numbers its input from, and how many leading ones the tables hold already
+	struct Claim {
+		int32_t base;
+		int32_t inserted;
+	};
+
+	// Table entries are positions offset by `base`, which advances past each input. Entries left
+	// by earlier calls fall below it and are ignored, so the head table is only cleared when the
+	// offset would overflow. An input that starts with a digested dictionary instead has its
+	// tables copied from the digest, unless they still hold it from the last call. Returns the
+	// claim for `size` new positions.
+	Claim claim_positions(lpz::lz77::EncodeTables& tables, size_t size, Links links) {
+
+		const lpz::lz77::DictionaryTables* dictionary = tables.dictionary;
+		if (dictionary && (links != Links::Tree || !dictionary->tree.empty())) {
+
+			tables.base = static_cast<int32_t>(size);
+
+			// Tree walks rewrite the nodes they pass, so tree links are copied every time
+			if (links == Links::Tree) {
+				if (tables.tree.size() < 2 * size) tables.tree.resize(2 * size);
+				std::copy(dictionary->tree.begin(), dictionary->tree.end(), tables.tree.begin());
+				tables.head = dictionary->tree_head;
+				tables.primed = 0;
+				return { 0, static_cast<int32_t>(dictionary->tree_inserted) };
+			}
 
-	while (ip < in_end) {
+			if (tables.chain.size() < size) tables.chain.resize(size);
+			if (tables.primed != dictionary->serial) {
+				tables.head = dictionary->head;
+				std::copy(dictionary->chain.begin(), dictionary->chain.end(), tables.chain.begin());
+				tables.primed = dictionary->serial;
+			}
 
-		if (ip + std::max(3, MIN_MATCH) >= in_end) {
-			ip++;
-			continue;
+			return { 0, static_cast<int32_t>(dictionary->inserted) };
 		}
 
-		uint32_t best_length = 0;
-		uint16_t best_distance = 0;
+		tables.primed = 0;
+		if (tables.head.size() != HASH_SIZE || size > static_cast<size_t>(std::numeric_limits<int32_t>::max() - tables.base)) {
+			tables.head.assign(HASH_SIZE, -1);
+			tables.base = 0;
+		}
 
-		uint32_t next_hash = hash(ip);
+		int32_t base = tables.base;
+		tables.base += static_cast<int32_t>(size);
+		return { base, 0 };
+	}
 
-		uint32_t prev = head[next_hash];
-		head[next_hash] = static_cast<uint32_t>(ip - in_base);
+	// Hash chain match finder. Positions are inserted strictly in order, so lazy evaluation can
+	// look ahead without inserting a position twice.
+	class HashChain {
+	public:
+		HashChain(std::span<const uint8_t> input, lpz::lz77::EncodeTables& tables, const LevelParams& params)
+			: in_base(input.data()), in_end(input.data() + input.size()), params(params) {
+
+			// Every chain slot is written before it is read and is never cleared
+			Claim claim = claim_positions(tables, input.size(), Links::Chain);
+			if (tables.chain.size() < input.size()) tables.chain.resize(input.size());
+			base = claim.base;
+			next_insert = claim.inserted;
+
+			head = tables.head.data();
+			chain = tables.chain.data();
+		}
+
+		// Inserts every position before `ip` that is not in the table yet.
+		void insert_until(const uint8_t* ip) {
+			int32_t target = static_cast<int32_t>(ip - in_base);
+			for (; next_insert < target; next_insert++) {
+				if (in_base + next_insert + 3 >= in_end) {
+					next_insert = target;
+					break;
+				}
+				uint32_t h = hash(in_base + next_insert);
+				chain[next_insert] = head[h];
+				head[h] = base + next_insert;
+			}
+		}
 
-		chain[ip - in_base] = prev;
+		// Longest match for `ip` within the level's search budget, inserting `ip` as it goes.
+		Match find(const uint8_t* ip) {
+			return search(ip, [](Match) {});
+		}
+
+		// Every match for `ip` that is longer than all nearer ones, shortest first. Only the
+		// longest MAX_CANDIDATES are kept.
+		size_t find_all(const uint8_t* ip, std::array<Match, MAX_CANDIDATES>& out) {
+			size_t count = 0;
+			search(ip, [&](Match match) {
+				if (count == out.size()) count--;
+				out[count++] = match;
+			});
+			return count;
+		}
 
-		int chain_depth = 0;
+	private:
+		template <typename OnMatch>
+		Match search(const uint8_t* ip, OnMatch on_match) {
 
-		while (prev != -1 && chain_depth < MAX_CHAIN) {
+			insert_until(ip);
+
+			Match best;
+
+			uint32_t next_hash = hash(ip);
+
+			int32_t prev = head[next_hash];
+			head[next_hash] = base + static_cast<int32_t>(ip - in_base);
+
+			chain[ip - in_base] = prev;
+			next_insert = static_cast<int32_t>(ip - in_base) + 1;
+
+			const uint32_t max_length = static_cast<uint32_t>(std::min<ptrdiff_t>(in_end - ip, std::min(MAX_LENGTH, params.nice_length)));
+
+			int chain_depth = 0;
+
+			while (prev >= base && chain_depth < params.max_chain) {
 	
-			const uint8_t* match_ptr = in_base + prev;
+				const uint8_t* match_ptr = in_base + (prev - base);
 
-			uint32_t length = 0;
+				uint32_t length = 0;
+
+				if (ip - match_ptr > MAX_DISTANCE) {
+					break;
+				}
+
+				if (ip[best.length] != match_ptr[best.length]) {
+					prev = chain[prev - base];
+					chain_depth++;
+					continue;
+				}
+
+				while (
+					(ip + length + 4 <= in_end)
+					&& (read32(match_ptr + length) == read32(ip + length))
+					&& (length + 4 <= MAX_LENGTH)
+
+					) {
+
+					length+=4;
+				}
+				while (
+					(ip + length < in_end)
+					&& (match_ptr[length] == ip[length])
+					&& (length != MAX_LENGTH)
 
-			if (ip - match_ptr > MAX_DISTANCE) {
-				break;
-			}
 
-			if (ip[best_length] != match_ptr[best_length]) {
-				prev = chain[prev];
+					) {
+
+					length++;
+				}
+
+			
+				if (length > best.length) {
+					best.length = length;
+					best.distance = static_cast<uint16_t>(ip - match_ptr);
+					if (length >= MIN_MATCH) on_match(best);
+
+					if (length >= max_length) break;
+				}
+
+				prev = chain[prev - base];
 				chain_depth++;
-				continue;
 			}
 
-			while (
-				(ip + length + 4 <= in_end)
-				&& (read32(match_ptr + length) == read32(ip + length))
-				&& (length + 4 <= MAX_LENGTH)
+			return best;
+		}
 
-				) {
+		const uint8_t* in_base;
+		const uint8_t* in_end;
+		const LevelParams& params;
+
+		int32_t* head;
+		int32_t* chain;
+		int32_t base;
+		int32_t next_insert = 0;
+	};
+
+	// Binary tree match finder. Each hash bucket roots a tree of earlier positions ordered by
+	// the bytes that follow them, so a lookup walks one root-to-leaf path and sees matches in
+	// order of growing length, instead of scanning every earlier position in a chain. The same
+	// walk re-roots the tree at the new position, which keeps recent positions near the top.
+	class BinaryTree {
+	public:
+		BinaryTree(std::span<const uint8_t> input, lpz::lz77::EncodeTables& tables, const LevelParams& params)
+			: in_base(input.data()), in_end(input.data() + input.size()), params(params) {
+
+			// Both children of a position are written when it is inserted and never cleared
+			Claim claim = claim_positions(tables, input.size(), Links::Tree);
+			if (tables.tree.size() < 2 * input.size()) tables.tree.resize(2 * input.size());
+			base = claim.base;
+			next_insert = claim.inserted;
+
+			head = tables.head.data();
+			tree = tables.tree.data();
+		}
 
-				length+=4;
+		// Inserts every position before `ip` that is not in the tree yet.
+		void insert_until(const uint8_t* ip) {
+			int32_t target = static_cast<int32_t>(ip - in_base);
+			for (; next_insert < target; next_insert++) {
+				if (in_base + next_insert + 3 >= in_end) {
+					next_insert = target;
+					break;
+				}
+				search(in_base + next_insert, [](Match) {});
 			}
-			while (
-				(ip + length < in_end)
-				&& (match_ptr[length] == ip[length])
-				&& (length != MAX_LENGTH)
+		}
 
+		// Longest match for `ip` within the level's search budget, inserting `ip` as it goes.
+		Match find(const uint8_t* ip) {
+			insert_until(ip);
+			next_insert = static_cast<int32_t>(ip - in_base) + 1;
+			return extend(ip, search(ip, [](Match) {}));
+		}
 
-				) {
+		// Every match for `ip` that is longer than all nearer ones, shortest first. Only the
+		// longest MAX_CANDIDATES are kept.
+		size_t find_all(const uint8_t* ip, std::array<Match, MAX_CANDIDATES>& out) {
+			insert_until(ip);
+			next_insert = static_cast<int32_t>(ip - in_base) + 1;
 
-				length++;
-			}
+			size_t count = 0;
+			Match best = search(ip, [&](Match match) {
+				if (count == out.size()) count--;
+				out[count++] = match;
+			});
 
-			
-			if (length > best_length) {
-				best_length = length;
-				best_distance = static_cast<uint16_t>(ip - match_ptr);
+			if (count > 0) out[count - 1] = extend(ip, best);
+			return count;
+		}
+
+	private:
+		template <typename OnMatch>
+		Match search(const uint8_t* ip, OnMatch on_match) {
+
+			const int32_t pos = static_cast<int32_t>(ip - in_base);
+			const uint32_t max_length = static_cast<uint32_t>(std::min<ptrdiff_t>(in_end - ip, std::min(MAX_LENGTH, params.nice_length)));
+
+			uint32_t h = hash(ip);
+			int32_t cur = head[h];
+			head[h] = base + pos;
+
+			// Subtrees of positions whose bytes sort below (left) and above (right) `ip`. Bytes
+			// shared with every node on each side are skipped when comparing further down.
+			int32_t* left = &tree[2 * pos];
+			int32_t* right = &tree[2 * pos + 1];
+			uint32_t left_length = 0;
+			uint32_t right_length = 0;
+
+			Match best;
+			int depth = params.max_chain;
+
+			while (true) {
+
+				if (cur < base || pos - (cur - base) > MAX_DISTANCE || depth-- == 0) {
+					*left = -1;
+					*right = -1;
+					break;
+				}
+
+				const int32_t match_pos = cur - base;
+				const uint8_t* match_ptr = in_base + match_pos;
+				int32_t* pair = &tree[2 * match_pos];
+
+				uint32_t length = std::min(left_length, right_length);
+				while (length + 8 <= max_length) {
+					uint64_t diff = read64(match_ptr + length) ^ read64(ip + length);
+					if (diff != 0) {
+						length += std::countr_zero(diff) / 8;
+						break;
+					}
+					length += 8;
+				}
+				while (length < max_length && match_ptr[length] == ip[length]) {
+					length++;
+				}
+
+				if (length > best.length) {
+					best.length = length;
+					best.distance = static_cast<uint16_t>(pos - match_pos);
+					if (length >= MIN_MATCH) on_match(best);
+				}
+
+				// A node matching as far as we can compare takes its children with it, since the
+				// new position replaces it in the tree
+				if (length == max_length) {
+					*left = pair[0];
+					*right = pair[1];
+					break;
+				}
+
+				if (match_ptr[length] < ip[length]) {
+					*left = cur;
+					left = &pair[1];
+					cur = *left;
+					left_length = length;
+				}
+				else {
+					*right = cur;
+					right = &pair[0];
+					cur = *right;
+					right_length = length;
+				}
 			}
 
-			prev = chain[prev];
-			chain_depth++;
+			return best;
 		}
 
-		if (best_length < MIN_MATCH) {
-			ip++;
-			continue;
+		// The tree walk compares at most nice_length bytes; a match that long may run further
+		Match extend(const uint8_t* ip, Match match) {
+			if (match.length < std::min(MAX_LENGTH, params.nice_length)) return match;
+
+			const uint8_t* match_ptr = ip - match.distance;
+			const uint32_t limit = static_cast<uint32_t>(std::min<ptrdiff_t>(in_end - ip, MAX_LENGTH));
+			while (match.length < limit && match_ptr[match.length] == ip[match.length]) {
+				match.length++;
+			}
+			return match;
+		}
+
+		const uint8_t* in_base;
+		const uint8_t* in_end;
+		const LevelParams& params;
+
+		int32_t* head;
+		int32_t* tree;
+		int32_t base;
+		int32_t next_insert = 0;
+	};
+
+	uint8_t* write_length_extension(uint8_t* op, uint32_t extra) {
+		while (extra >= 255) {
+			*op++ = 255;
+			extra -= 255;
 		}
+		*op++ = static_cast<uint8_t>(extra);
+		return op;
+	}
+
+	// Writes the token and the literals in [anchor, ip) of a sequence whose match is `length` long
+	uint8_t* write_sequence_start(uint8_t* op, const uint8_t* anchor, const uint8_t* ip, uint32_t length) {
 
 		uint8_t token = 0;
 
-		uint32_t biased_match_length = best_length - MATCH_LENGTH_BIAS;
-		uint32_t literal_length = ip - anchor;
+		uint32_t biased_match_length = length - MATCH_LENGTH_BIAS;
+		uint32_t literal_length = static_cast<uint32_t>(ip - anchor);
 
 
 		token |= (literal_length >= 15 ? 15 : literal_length) << 4;
 		token |= (biased_match_length >= 15 ? 15 : biased_match_length);
 
-		output.push_back(token);
+		*op++ = token;
+
+		if (literal_length >= 15) {
+			op = write_length_extension(op, literal_length - 15);
+		}
+
+		memcpy(op, anchor, literal_length);
+		op += literal_length;
+
+		return op;
+	}
+
+	// Writes the sequences of one stream, coding each distance against the repeat offsets of
+	// the matches written before it, and logs the distance fields to `distances`
+	struct SequenceWriter {
+
+		SequenceWriter(uint8_t* op, Format format, std::vector<lpz::lz77::DistanceField>& distances)
+			: op(op), begin(op), bias(rep_bias(format)), distances(distances) {
+			distances.clear();
+		}
+
+		// Writes the literals in [anchor, ip) followed by a match of `length` at `distance`
+		void write(const uint8_t* anchor, const uint8_t* ip, uint32_t length, size_t distance) {
+
+			op = write_sequence_start(op, anchor, ip, length);
+			distances.push_back({ static_cast<uint32_t>(op - begin), static_cast<uint32_t>(distance) });
+
+			// Values past 0xFFFF take the long escape
+			const uint32_t index = rep_index(reps, distance);
+			const uint32_t value = index < REP_CODES && bias > 0 ? index + 1 : static_cast<uint32_t>(std::min<size_t>(distance + bias, 0x10000));
+			if (value <= 0xFFFF) {
+				const uint16_t short_value = static_cast<uint16_t>(value);
+				memcpy(op, &short_value, sizeof(short_value));
+				op += sizeof(short_value);
+			}
+			else {
+				const uint16_t escape = 0;
+				const uint32_t long_distance = static_cast<uint32_t>(distance);
+				memcpy(op, &escape, sizeof(escape));
+				memcpy(op + sizeof(escape), &long_distance, sizeof(long_distance));
+				op += sizeof(escape) + sizeof(long_distance);
+			}
+			push_rep(reps, index, distance);
+
+			uint32_t biased_match_length = length - MATCH_LENGTH_BIAS;
+			if (biased_match_length >= 15) {
+				op = write_length_extension(op, biased_match_length - 15);
+			}
+		}
+
+		uint8_t* op;
+		uint8_t* const begin;
+		const uint32_t bias;
+		std::vector<lpz::lz77::DistanceField>& distances;
+		RepOffsets reps = lpz::lz77::INITIAL_REPS;
+	};
+
+	// Length of the match at `ip` at `distance`, which reaches no further back than `lowest`,
+	// or 0 if it is shorter than MIN_MATCH
+	uint32_t rep_match_length(const uint8_t* ip, const uint8_t* lowest, const uint8_t* in_end, uint32_t distance) {
+
+		const size_t limit = std::min<size_t>(in_end - ip, MAX_LENGTH);
+		if (limit < MIN_MATCH || distance > static_cast<size_t>(ip - lowest) || distance > MAX_DISTANCE) return 0;
+
+		const uint8_t* match_ptr = ip - distance;
+		if (read32(match_ptr) != read32(ip)) return 0;
+		return static_cast<uint32_t>(MIN_MATCH + common_length(match_ptr + MIN_MATCH, ip + MIN_MATCH, limit - MIN_MATCH));
+	}
+
+	// Longest match at `ip` at one of `reps`
+	Match find_rep_match(const uint8_t* ip, const uint8_t* lowest, const uint8_t* in_end, const RepOffsets& reps) {
+		Match best;
+		for (uint32_t distance : reps) {
+			uint32_t length = rep_match_length(ip, lowest, in_end, distance);
+			if (length > best.length) best = { length, static_cast<uint16_t>(distance) };
+		}
+		return best;
+	}
+
+	// Writes the trailing literals in [anchor, end), which end the stream without a match.
+	uint8_t* write_last_literals(uint8_t* op, const uint8_t* anchor, const uint8_t* end) {
+
+		uint32_t literal_length = static_cast<uint32_t>(end - anchor);
+
+		uint8_t token = 0;
+		token |= (literal_length >= 15 ? 15 : literal_length) << 4;
+		*op++ = token;
 
 		if (literal_length >= 15) {
-			uint32_t extra = literal_length - 15;
-			while (extra >= 255) {
-				output.push_back(255);
-				extra -= 255;
+			op = write_length_extension(op, literal_length - 15);
+		}
+
+		memcpy(op, anchor, literal_length);
+		op += literal_length;
+
+		return op;
+	}
+
+	// Single-probe parse for the fastest level: one hash table slot per bucket, nothing
+	// inserted inside matches, and a probe stride that grows the longer no match turns up,
+	// so incompressible input is crossed with few hash lookups. Returns bytes written
+	size_t encode_fast(std::span<const uint8_t> input, std::span<uint8_t> out, lpz::lz77::EncodeTables& tables, size_t history, Format format) {
+
+		const Claim claim = claim_positions(tables, input.size(), Links::None);
+		const int32_t base = claim.base;
+		int32_t* const head = tables.head.data();
+
+		SequenceWriter writer(out.data(), format, tables.distances);
+
+		const uint8_t* const in_base = input.data();
+		const uint8_t* const in_end = in_base + input.size();
+		const uint8_t* ip = in_base + history;
+		const uint8_t* anchor = ip;
+
+		// Last position a 4-byte hash can be read from
+		const uint8_t* const match_limit = in_end - std::min<size_t>(input.size(), MIN_MATCH);
+
+		for (const uint8_t* p = in_base + claim.inserted; p < ip && p < match_limit; p++) {
+			head[hash(p)] = base + static_cast<int32_t>(p - in_base);
+		}
+
+		uint32_t attempts = 1u << FAST_SKIP_STRENGTH;
+
+		while (ip < match_limit) {
+
+			const int32_t pos = static_cast<int32_t>(ip - in_base);
+			const uint32_t h = hash(ip);
+			const int32_t prev = head[h];
+			head[h] = base + pos;
+
+			// Probes run ahead of matches pulled back and cut at MAX_LENGTH, so the head can
+			// hold this position or a later one
+			const int32_t distance = pos - (prev - base);
+			if (prev < base || distance <= 0 || distance > MAX_DISTANCE || read32(in_base + (prev - base)) != read32(ip)) {
+				ip += attempts++ >> FAST_SKIP_STRENGTH;
+				continue;
+			}
+
+			const uint8_t* match_ptr = in_base + (prev - base);
+
+			// Pull the match start back over literals it also covers
+			while (ip > anchor && match_ptr > in_base && ip[-1] == match_ptr[-1]) {
+				ip--;
+				match_ptr--;
+			}
+
+			const uint32_t limit = static_cast<uint32_t>(std::min<ptrdiff_t>(in_end - ip, MAX_LENGTH));
+			uint32_t length = MIN_MATCH;
+			while (length + 8 <= limit) {
+				uint64_t diff = read64(match_ptr + length) ^ read64(ip + length);
+				if (diff != 0) {
+					length += std::countr_zero(diff) / 8;
+					break;
+				}
+				length += 8;
+			}
+			while (length < limit && match_ptr[length] == ip[length]) {
+				length++;
 			}
-			output.push_back(static_cast<uint8_t>(extra));
+
+			writer.write(anchor, ip, length, static_cast<size_t>(ip - match_ptr));
+
+			ip += length;
+			anchor = ip;
+			attempts = 1u << FAST_SKIP_STRENGTH;
+
+			// One insert near the end of the match keeps back-to-back repeats cheap to find
+			if (ip < match_limit) {
+				head[hash(ip - 2)] = base + static_cast<int32_t>(ip - 2 - in_base);
+			}
+		}
+
+		writer.op = write_last_literals(writer.op, anchor, in_end);
+
+		return static_cast<size_t>(writer.op - out.data());
+	}
+
+	// Greedy parse, with lazy evaluation at the levels that ask for it. Returns bytes written
+	template <typename MatchFinder>
+	size_t encode_greedy(std::span<const uint8_t> input, std::span<uint8_t> out, lpz::lz77::EncodeTables& tables, const LevelParams& params, size_t history, Format format) {
+
+		MatchFinder finder(input, tables, params);
+		SequenceWriter writer(out.data(), format, tables.distances);
+
+		const uint8_t* const in_base = input.data();
+		const uint8_t* ip = in_base + history;
+		finder.insert_until(ip);
+
+		const uint8_t* const in_end = in_base + input.size();
+		const uint8_t* anchor = ip;
+
+		// The repeat offsets are tried first. A long repeat is taken as it is, and any other only
+		// gives way to a longer match from the finder
+		auto find = [&](const uint8_t* p) {
+			Match rep = find_rep_match(p, in_base, in_end, writer.reps);
+			if (rep.length >= REP_ACCEPT_LENGTH) return rep;
+			Match match = finder.find(p);
+			return match.length > rep.length ? match : rep;
+		};
+
+		while (ip < in_end) {
+
+			if (ip + std::max(3, MIN_MATCH) >= in_end) {
+				ip++;
+				continue;
+			}
+
+			Match match = find(ip);
+
+			if (match.length < MIN_MATCH) {
+				ip++;
+				continue;
+			}
+
+			// Lazy evaluation: defer to a longer match starting one or two bytes later, paying
+			// for the skipped bytes as literals.
+			while (params.lazy_steps > 0) {
+
+				if (ip + 1 + MIN_MATCH >= in_end) break;
+
+				Match next = find(ip + 1);
+				if (next.length > match.length) {
+					ip += 1;
+					match = next;
+					continue;
+				}
+
+				if (params.lazy_steps < 2 || ip + 2 + MIN_MATCH >= in_end) break;
+
+				Match skip = find(ip + 2);
+				if (skip.length > match.length + 1) {
+					ip += 2;
+					match = skip;
+					continue;
+				}
+
+				break;
+			}
+
+			writer.write(anchor, ip, match.length, match.distance);
+
+			ip += match.length;
+			anchor = ip;
+		}
+
+		writer.op = write_last_literals(writer.op, anchor, ip);
+
+		return static_cast<size_t>(writer.op - out.data());
+	}
+
+	// Bits each byte value costs in each field of a split block, from Huffman code lengths for
+	// the fields of `stream`. Every count is raised by one so symbols the previous pass never
+	// used still get a price.
+	using FieldPrices = std::array<std::array<uint32_t, 256>, lpz::lz77::FIELD_COUNT>;
+
+	FieldPrices symbol_prices(std::span<const uint8_t> stream, lpz::lz77::Fields& fields) {
+
+		FieldPrices prices;
+
+		if (!lpz::lz77::split_fields(stream, fields)) {
+			for (auto& field : fields) field.clear();
 		}
 
-		output.insert(output.end(), anchor, ip);
-		
-		output.insert(output.end(), reinterpret_cast<uint8_t*>(&best_distance), reinterpret_cast<uint8_t*>(&best_distance) + sizeof(best_distance));
+		for (size_t f = 0; f < lpz::lz77::FIELD_COUNT; f++) {
+
+			std::array<uint32_t, 256> histogram;
+			histogram.fill(1);
+			for (uint8_t value : fields[f]) {
+				histogram[value]++;
+			}
+
+			auto lengths = lpz::huffman::get_code_lengths(histogram);
+			std::copy(lengths.begin(), lengths.end(), prices[f].begin());
+		}
+
+		return prices;
+	}
+
+	uint32_t length_extension_price(const std::array<uint32_t, 256>& prices, uint32_t extra) {
+		return (extra / 255) * prices[255] + prices[extra % 255];
+	}
+
+	// Price of a match of `length`, with `code` in its distance field, that follows a run of
+	// `literals` literals, which pays for the token shared with that run
+	uint32_t match_price(const FieldPrices& prices, uint32_t literals, uint32_t length, uint16_t code) {
+
+		uint32_t biased_match_length = length - MATCH_LENGTH_BIAS;
+
+		uint8_t token = 0;
+		token |= (literals >= 15 ? 15 : literals) << 4;
+		token |= (biased_match_length >= 15 ? 15 : biased_match_length);
+
+		uint32_t price = prices[lpz::lz77::TOKENS][token] + prices[lpz::lz77::OFFSETS_LOW][code & 0xFF] + prices[lpz::lz77::OFFSETS_HIGH][code >> 8];
 
 		if (biased_match_length >= 15) {
-			uint32_t extra_length = biased_match_length - 15;
-			while (extra_length >= 255) {
-				output.push_back(255);
-				extra_length -= 255;
+			price += length_extension_price(prices[lpz::lz77::TOKENS], biased_match_length - 15);
+		}
+
+		return price;
+	}
+
+	// Finds the candidate matches at every position once, so each pricing pass can reuse them
+	template <typename MatchFinder>
+	void find_candidates(std::span<const uint8_t> input, lpz::lz77::EncodeTables& tables, const LevelParams& params, size_t history) {
+
+		MatchFinder finder(input, tables, params);
+
+		const size_t n = input.size() - history;
+		const uint8_t* const in_base = input.data() + history;
+		finder.insert_until(in_base);
+
+		auto& nodes = tables.parse;
+		auto& matches = tables.matches;
+		nodes.resize(n + 1);
+		matches.clear();
+
+		std::array<Match, MAX_CANDIDATES> candidates;
+
+		// Positions inside a match at least nice_length long are not searched from
+		size_t skip_until = 0;
+
+		for (size_t i = 0; i < n; i++) {
+
+			nodes[i].matches = static_cast<uint32_t>(matches.size());
+
+			if (i + std::max(3, MIN_MATCH) >= n || i < skip_until) continue;
+
+			size_t count = finder.find_all(in_base + i, candidates);
+			matches.insert(matches.end(), candidates.begin(), candidates.begin() + count);
+
+			if (count > 0 && candidates[count - 1].length >= params.nice_length) {
+				skip_until = i + candidates[count - 1].length;
+			}
+		}
+
+		nodes[n].matches = static_cast<uint32_t>(matches.size());
+	}
+
+	// One pass of price-based parsing: a shortest path over the input positions where each
+	// edge is a literal, one of the candidate matches at that position or a match at one of the
+	// repeat offsets the path brings there, then emitting the path. Returns bytes written
+	size_t parse_optimal(std::span<const uint8_t> input, std::span<uint8_t> out, lpz::lz77::EncodeTables& tables, const LevelParams& params, size_t history, Format format, const FieldPrices& prices) {
+
+		const size_t n = input.size() - history;
+		const uint8_t* const in_base = input.data() + history;
+		const uint8_t* const in_end = in_base + n;
+		const uint32_t bias = rep_bias(format);
+
+		auto& nodes = tables.parse;
+		const auto& matches = tables.matches;
+
+		nodes[0].price = 0;
+		nodes[0].literals = 0;
+		nodes[0].reps = lpz::lz77::INITIAL_REPS;
+		for (size_t i = 1; i <= n; i++) {
+			nodes[i].price = std::numeric_limits<uint32_t>::max();
+		}
+
+		auto relax = [&](size_t i, uint32_t price, uint32_t literals, uint32_t length, uint16_t distance) {
+			auto& target = nodes[i];
+			if (price < target.price) {
+				target.price = price;
+				target.literals = literals;
+				target.length = length;
+				target.distance = distance;
+			}
+		};
+
+		// As with the candidates, positions inside a repeat at least nice_length long are not
+		// checked for repeats
+		size_t rep_skip_until = 0;
+
+		for (size_t i = 0; i < n; i++) {
+
+			// Every step into i is priced by now, so the path's repeat offsets here are settled
+			auto& node = nodes[i];
+			if (i > 0) {
+				const size_t from = i - node.length;
+				node.reps = nodes[from].reps;
+				if (node.distance != 0) push_rep(node.reps, rep_index(node.reps, node.distance), node.distance);
+			}
+
+			const uint32_t node_price = node.price;
+			const uint32_t node_literals = node.literals;
+
+			uint32_t literals = node_literals + 1;
+			uint32_t literal_price = node_price + prices[lpz::lz77::LITERALS][in_base[i]];
+			if (literals >= 15 && (literals - 15) % 255 == 0) literal_price += prices[lpz::lz77::TOKENS][0];
+
+			relax(i + 1, literal_price, literals, 1, 0);
+
+			auto code = [&](uint16_t distance) {
+				const uint32_t index = bias > 0 ? rep_index(node.reps, distance) : REP_CODES;
+				return static_cast<uint16_t>(index < REP_CODES ? index + 1 : distance + bias);
+			};
+
+			// Repeats come first, and since their codes are the cheap ones, the candidates only
+			// price lengths past the longest repeat
+			uint32_t longest_rep = 0;
+
+			for (uint32_t r = 0; r < REP_CODES && i >= rep_skip_until; r++) {
+
+				// Right after a match, the last distance would only continue that match
+				if (r == 0 && node.distance != 0) continue;
+
+				const uint32_t distance = node.reps[r];
+				const uint32_t rep_length = rep_match_length(in_base + i, input.data(), in_end, distance);
+				if (rep_length >= params.nice_length) rep_skip_until = i + rep_length;
+
+				const uint16_t rep_code = code(static_cast<uint16_t>(distance));
+
+				for (uint32_t length = rep_length >= params.nice_length ? rep_length : MIN_MATCH; length <= rep_length; length++) {
+					relax(i + length, node_price + match_price(prices, node_literals, length, rep_code), 0, length, static_cast<uint16_t>(distance));
+				}
+				longest_rep = std::max(longest_rep, rep_length);
+			}
+
+			uint32_t length = std::max<uint32_t>(MIN_MATCH, longest_rep + 1);
+
+			for (uint32_t c = node.matches; c < nodes[i + 1].matches; c++) {
+
+				const Match match = matches[c];
+				const uint16_t match_code = code(match.distance);
+
+				// Long matches are taken whole rather than priced at every shorter length
+				if (match.length >= params.nice_length) {
+					length = std::max(length, match.length);
+				}
+
+				for (; length <= match.length; length++) {
+					relax(i + length, node_price + match_price(prices, node_literals, length, match_code), 0, length, match.distance);
+				}
 			}
-			output.push_back(static_cast<uint8_t>(extra_length));
 		}
 
-		for (uint32_t k = 1; k < best_length; k++) {
-			if (ip + k + 3 >= in_end) break;
+		// Walk the cheapest path back from the end, linking each step to the one after it
+		for (size_t i = n; i > 0; i -= nodes[i].length) {
+			nodes[i - nodes[i].length].next = static_cast<uint32_t>(i);
+		}
+
+		SequenceWriter writer(out.data(), format, tables.distances);
+
+		size_t anchor = 0;
 
-			uint32_t h = hash(ip+k);
-			chain[ip - in_base + k] = head[h];
-			head[h] = ip - in_base + k;
+		for (size_t i = 0; i < n; i = nodes[i].next) {
+
+			const auto& step = nodes[nodes[i].next];
+			if (step.distance == 0) continue;
+
+			writer.write(in_base + anchor, in_base + i, step.length, step.distance);
+			anchor = nodes[i].next;
 		}
 
-		ip += best_length;
-		anchor = ip;
+		writer.op = write_last_literals(writer.op, in_base + anchor, in_base + n);
+
+		return static_cast<size_t>(writer.op - out.data());
 	}
 
-	uint32_t literal_length = ip - anchor;
+	// Seeds prices from a greedy parse, then reparses with prices from the previous pass
+	size_t encode_optimal(std::span<const uint8_t> input, std::span<uint8_t> out, lpz::lz77::EncodeTables& tables, const LevelParams& params, size_t history, Format format) {
 
+		const LevelParams& seed_params = LEVELS[lpz::MAX_LEVEL - 1];
+		size_t size = seed_params.binary_tree
+			? encode_greedy<BinaryTree>(input, out, tables, seed_params, history, format)
+			: encode_greedy<HashChain>(input, out, tables, seed_params, history, format);
 
-	uint8_t token = 0;
-	token |= (literal_length >= 15 ? 15 : literal_length) << 4;
-	output.push_back(token);
+		if (params.binary_tree) find_candidates<BinaryTree>(input, tables, params, history);
+		else find_candidates<HashChain>(input, tables, params, history);
 
+		for (int pass = 0; pass < OPTIMAL_PASSES; pass++) {
+			size = parse_optimal(input, out, tables, params, history, format, symbol_prices(out.first(size), tables.fields));
+		}
 
-	if (literal_length >= 15) {
+		return size;
+	}
+}
 
-		uint32_t extra = literal_length - 15;
-		while (extra >= 255) {
-			output.push_back(255);
-			extra -= 255;
+namespace {
+
+	// Rewrites `parsed`, an encoding of input[history, end) in `format`, with `long_matches`,
+	// which count from input[history], in place of the bytes they cover. What is left of a match
+	// they cut into is kept while at least MIN_MATCH long. Each sequence still costs no more than
+	// its bytes as literals, so the output stays within encode_bound. Returns bytes written
+	size_t lay_long_matches(std::span<const uint8_t> input, size_t history, std::span<const uint8_t> parsed, std::span<const lpz::lz77::LongMatch> long_matches, uint8_t* out, Format format, std::vector<lpz::lz77::DistanceField>& distances) {
+
+		const uint8_t* const in_base = input.data() + history;
+		const uint8_t* anchor = in_base;
+		SequenceWriter writer(out, format, distances);
+		size_t next = 0;
+
+		auto write_piece = [&](const uint8_t* begin, const uint8_t* end, uint16_t distance) {
+			if (end - begin < MIN_MATCH) return;
+			writer.write(anchor, begin, static_cast<uint32_t>(end - begin), distance);
+			anchor = end;
+		};
+
+		auto write_long = [&](const lpz::lz77::LongMatch& match) {
+			writer.write(anchor, in_base + match.position, match.length, match.distance);
+			anchor = in_base + match.position + match.length;
+			next++;
+		};
+
+		auto read_length_extension = [](const uint8_t*& ptr, size_t& length) {
+			uint8_t len_byte;
+			do {
+				len_byte = *ptr++;
+				length += len_byte;
+			} while (len_byte == 255);
+		};
+
+		// The parse was just written by this encoder, so it is walked without checks
+		const uint8_t* ptr = parsed.data();
+		const uint8_t* const end = ptr + parsed.size();
+		const uint8_t* ip = in_base;
+		const uint32_t bias = rep_bias(format);
+		RepOffsets parsed_reps = lpz::lz77::INITIAL_REPS;
+
+		while (ptr < end) {
+
+			uint8_t token = *ptr++;
+
+			size_t literal_length = (token & 0xF0) >> 4;
+			if (literal_length == 15) read_length_extension(ptr, literal_length);
+
+			ptr += literal_length;
+			ip += literal_length;
+
+			if (ptr >= end) break;
+
+			uint16_t code;
+			memcpy(&code, ptr, sizeof(code));
+			ptr += sizeof(code);
+
+			// The parse has no long distances, so no code is 0
+			const uint32_t index = code <= bias ? code - 1u : REP_CODES;
+			const uint16_t distance = static_cast<uint16_t>(index < REP_CODES ? rep_at(parsed_reps, index) : code - bias);
+			push_rep(parsed_reps, index, distance);
+
+			size_t biased_match_length = token & 0x0F;
+			if (biased_match_length == 15) read_length_extension(ptr, biased_match_length);
+
+			const uint8_t* const match_end = ip + biased_match_length + MATCH_LENGTH_BIAS;
+			const uint8_t* piece = std::max(ip, anchor);
+
+			while (next < long_matches.size() && in_base + long_matches[next].position < match_end) {
+				write_piece(piece, in_base + long_matches[next].position, distance);
+				write_long(long_matches[next]);
+				piece = std::max(piece, anchor);
+			}
+
+			write_piece(piece, match_end, distance);
+			ip = match_end;
 		}
-		output.push_back(static_cast<uint8_t>(extra));
+
+		while (next < long_matches.size()) write_long(long_matches[next]);
+
+		writer.op = write_last_literals(writer.op, anchor, input.data() + input.size());
+
+		return static_cast<size_t>(writer.op - out);
 	}
 
-	output.insert(output.end(), anchor, ip);
+	// Repeat codes usually make distances cheaper, but where one distance dominates, as in
+	// fixed-stride records, it codes smaller as the one value it is than spread over the repeat
+	// codes. Rewrites `stream`, in the RepeatOffsets format with its distance fields at
+	// `distances`, without repeat codes unless they save bits, since blocks without them
+	// decode faster
+	void choose_distance_codes(std::span<uint8_t> stream, std::span<const lpz::lz77::DistanceField> distances) {
+
+		// Repeats of long distances have no 2-byte value of their own
+		for (const auto& field : distances) {
+			const uint8_t* value = stream.data() + field.position;
+			if (field.distance > MAX_DISTANCE && (value[0] != 0 || value[1] != 0)) return;
+		}
+
+		// A sample of the fields is enough to tell the two apart
+		std::array<std::array<uint32_t, 256>, 2> coded = {};
+		std::array<std::array<uint32_t, 256>, 2> explicit_codes = {};
+
+		for (size_t i = 0; i < distances.size(); i += DISTANCE_SAMPLE_STEP) {
+			const uint8_t* value = stream.data() + distances[i].position;
+			coded[0][value[0]]++;
+			coded[1][value[1]]++;
+
+			const uint32_t explicit_value = value[0] == 0 && value[1] == 0 ? 0 : distances[i].distance + REP_CODES;
+			explicit_codes[0][explicit_value & 0xFF]++;
+			explicit_codes[1][explicit_value >> 8]++;
+		}
+
+		auto bits = [](const std::array<std::array<uint32_t, 256>, 2>& histograms) {
+			size_t total = 0;
+			for (const auto& histogram : histograms) {
+				auto lengths = lpz::huffman::get_code_lengths(histogram);
+				for (size_t v = 0; v < 256; v++) total += size_t(histogram[v]) * lengths[v];
+			}
+			return total;
+		};
+
+		if (bits(explicit_codes) > bits(coded)) return;
+
+		for (const auto& field : distances) {
+			uint8_t* value = stream.data() + field.position;
+			if (value[0] == 0 && value[1] == 0) continue;
+			const uint16_t explicit_value = static_cast<uint16_t>(field.distance + REP_CODES);
+			memcpy(value, &explicit_value, sizeof(explicit_value));
+		}
+	}
+
+	size_t parse(std::span<const uint8_t> input, std::span<uint8_t> out, lpz::lz77::EncodeTables& tables, const LevelParams& params, size_t history, Format format) {
+		if (params.strategy == Strategy::Fast) return encode_fast(input, out, tables, history, format);
+		if (params.strategy == Strategy::Optimal) return encode_optimal(input, out, tables, params, history, format);
+		if (params.binary_tree) return encode_greedy<BinaryTree>(input, out, tables, params, history, format);
+		return encode_greedy<HashChain>(input, out, tables, params, history, format);
+	}
+
+	// Long-distance matching hashes every MIN_LONG_MATCH byte window with a rolling hash and
+	// enters one in 2^LONG_HASH_RATE_LOG, picked by the hash, so a repeat enters the same windows
+	// as the bytes it repeats. The table takes about one bucket per 2^LONG_TABLE_SHIFT bytes of
+	// window
+	constexpr int LONG_HASH_RATE_LOG = 5;
+	constexpr int LONG_TABLE_SHIFT = 7;
+	constexpr int MIN_LONG_TABLE_LOG = 12;
+	constexpr int MAX_LONG_TABLE_LOG = 22;
+	constexpr uint64_t LONG_HASH_PRIME = 0x9E3779B185EBCA87;
+
+	// Table entries keep LONG_TAG_BITS more bits of the hash above the position, so most
+	// candidates that cannot match are dropped without reading their data
+	constexpr int LONG_TAG_BITS = 24;
+	constexpr int LONG_POSITION_BITS = 64 - LONG_TAG_BITS;
+	constexpr uint64_t LONG_POSITION_MASK = (uint64_t(1) << LONG_POSITION_BITS) - 1;
+
+	constexpr uint64_t long_hash_power() {
+		uint64_t power = 1;
+		for (uint32_t i = 0; i < lpz::lz77::MIN_LONG_MATCH; i++) power *= LONG_HASH_PRIME;
+		return power;
+	}
+
+	// What the byte leaving the window weighs once the hash is rolled, so it is taken out
+	// apart from the multiply the next hash waits on
+	constexpr uint64_t LONG_HASH_POWER = long_hash_power();
+
+	uint64_t long_hash(const uint8_t* p) {
+		uint64_t hash = 0;
+		for (uint32_t i = 0; i < lpz::lz77::MIN_LONG_MATCH; i++) hash = hash * LONG_HASH_PRIME + p[i];
+		return hash;
+	}
+
+}
+
+void lpz::lz77::reset_long_matches(LongMatchTable& table, size_t window) {
+	int table_log = std::clamp(static_cast<int>(std::bit_width(window)) - LONG_TABLE_SHIFT, MIN_LONG_TABLE_LOG, MAX_LONG_TABLE_LOG);
+	table.head.assign(size_t(1) << table_log, 0);
+	table.window = std::min(window, MAX_LONG_WINDOW);
+}
+
+void lpz::lz77::find_long_matches(std::span<const uint8_t> data, size_t start, uint64_t offset, LongMatchTable& table, std::vector<LongMatch>& out) {
+
+	if (table.head.empty() || start > data.size() || data.size() - start < MIN_LONG_MATCH) return;
 
+	const int table_log = std::countr_zero(table.head.size());
+	const int select_shift = 64 - table_log - LONG_HASH_RATE_LOG;
+	const int tag_shift = select_shift - LONG_TAG_BITS;
+	const uint64_t select_mask = (uint64_t(1) << LONG_HASH_RATE_LOG) - 1;
+
+	const uint8_t* const base = data.data();
+	const size_t end = data.size();
+
+	size_t pos = start;
+	size_t matched_until = start; // end of the last match, which the next only extends back to
+	uint64_t hash = long_hash(base + pos);
+
+	while (true) {
+
+		if (((hash >> select_shift) & select_mask) == 0) {
+
+			uint64_t& slot = table.head[hash >> (64 - table_log)];
+			const uint64_t tag = (hash >> tag_shift) << LONG_POSITION_BITS;
+			const uint64_t candidate = (slot & ~LONG_POSITION_MASK) == tag ? slot & LONG_POSITION_MASK : 0;
+			slot = tag | ((offset + pos + 1) & LONG_POSITION_MASK);
+
+			// Windows inside a match are only entered, so later repeats find the nearest copy.
+			// Nearer repeats are left to the match finders
+			const size_t at = candidate > offset ? static_cast<size_t>(candidate - 1 - offset) : pos;
+			const size_t distance = pos - at;
+
+			if (pos >= matched_until && at < pos && distance > WINDOW_SIZE && distance <= table.window) {
+
+				size_t length = common_length(base + at, base + pos, end - pos);
+
+				if (length >= MIN_LONG_MATCH) {
+					size_t back = 0;
+					while (pos - back > matched_until && at - back > 0 && base[pos - back - 1] == base[at - back - 1]) back++;
+
+					out.push_back({ pos - back - start, static_cast<uint32_t>(length + back), static_cast<uint32_t>(distance) });
+					matched_until = pos + length;
+				}
+			}
+		}
+
+		if (end - pos <= MIN_LONG_MATCH) return;
+		hash = hash * LONG_HASH_PRIME - base[pos] * LONG_HASH_POWER + base[pos + MIN_LONG_MATCH];
+		pos++;
+	}
+}
+
+size_t lpz::lz77::encode_bound(size_t size) {
+	return size + size / 255 + 16;
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error> 
+lpz::lz77::encode(std::span<const uint8_t> input, int level, Format format) {
+
+	EncodeTables tables;
+	std::vector<uint8_t> output(encode_bound(input.size()));
+
+	auto size = encode_into(input, output, tables, level, 0, {}, format);
+	if (!size) return std::unexpected(size.error());
+
+	output.resize(*size);
 	return output;
+}
+
+std::expected<size_t, lpz::Error>
+lpz::lz77::encode_into(std::span<const uint8_t> input, std::span<uint8_t> out, EncodeTables& tables, int level, size_t history, std::span<const LongMatch> long_matches, Format format, const DictionaryTables* dictionary) {
+
+	if (input.size() >= std::numeric_limits<int32_t>::max())
+		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 compress: Input too large" });
+	if (input.size() <= history)
+		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 compress: Empty Input" });
+	if (out.size() < encode_bound(input.size() - history))
+		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 compress: Output buffer too small" });
+	if (level < MIN_LEVEL || level > MAX_LEVEL)
+		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 compress: Invalid level" });
+	if (dictionary && dictionary->size != history)
+		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 compress: Dictionary is not the history" });
+
+	size_t covered = 0;
+	for (const auto& match : long_matches) {
+		if (match.position < covered || match.position > input.size() - history ||
+			match.length < MIN_MATCH || match.length > input.size() - history - match.position || match.distance == 0)
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 compress: Invalid long match" });
+		covered = match.position + match.length;
+	}
+
+	const LevelParams& params = LEVELS[level];
+	tables.dictionary = dictionary;
 
+	size_t size;
+	if (long_matches.empty()) {
+		size = parse(input, out, tables, params, history, format);
+	}
+	else {
+		if (tables.parsed.size() < encode_bound(input.size() - history)) {
+			tables.parsed.resize(encode_bound(input.size() - history));
+		}
+
+		size_t parsed = parse(input, tables.parsed, tables, params, history, format);
+		size = lay_long_matches(input, history, { tables.parsed.data(), parsed }, long_matches, out.data(), format, tables.distances);
+	}
+
+	// The chain slots of the input are rewritten before they are read, so putting back the head
+	// slots it hashed to leaves the tables holding the dictionary for the next call. Inputs that
+	// hash to most slots are cheaper to copy the whole head for
+	tables.dictionary = nullptr;
+	if (dictionary && tables.primed == dictionary->serial) {
+		if (input.size() - dictionary->inserted < HASH_SIZE) {
+			for (size_t p = dictionary->inserted; p + MIN_MATCH <= input.size(); p++) {
+				uint32_t h = hash(input.data() + p);
+				tables.head[h] = dictionary->head[h];
+			}
+		}
+		else tables.primed = 0;
+	}
+
+	if (format == Format::RepeatOffsets) choose_distance_codes(out.first(size), tables.distances);
+	return size;
 }
 
-std::expected<std::vector<uint8_t>, lpz::Error>
-lpz::lz77::decode(std::span<const uint8_t> data) {
+lpz::lz77::Format lpz::lz77::drop_repeat_offsets(std::span<uint8_t> stream, const EncodeTables& tables) {
+
+	for (const auto& field : tables.distances) {
+		uint16_t value;
+		memcpy(&value, stream.data() + field.position, sizeof(value));
+		if (value != 0 && value <= REP_CODES) return Format::RepeatOffsets;
+	}
+
+	// Explicit values are the distance plus REP_CODES, and long escapes read the same in both
+	for (const auto& field : tables.distances) {
+		uint16_t value;
+		memcpy(&value, stream.data() + field.position, sizeof(value));
+		if (value == 0) continue;
+		value = static_cast<uint16_t>(value - REP_CODES);
+		memcpy(stream.data() + field.position, &value, sizeof(value));
+	}
+
+	return Format::Plain;
+}
+
+void lpz::lz77::digest_dictionary(std::span<const uint8_t> dictionary, int level, DictionaryTables& out) {
+
+	static std::atomic<uint64_t> next_serial = 1;
+
+	// Every finder enters each position into the head table the same way, so both leave the
+	// same head behind
+	EncodeTables tables;
+	HashChain chain(dictionary, tables, LEVELS[level]);
+	chain.insert_until(dictionary.data() + dictionary.size());
+
+	out.size = dictionary.size();
+	out.inserted = dictionary.size() >= 3 ? dictionary.size() - 3 : 0;
+	out.chain.assign(tables.chain.begin(), tables.chain.begin() + out.inserted);
+	out.head = std::move(tables.head);
+	out.tree.clear();
+	out.tree_head.clear();
+	out.tree_inserted = 0;
+
+	// A tree search compares up to nice_length bytes, which for the last positions of the
+	// dictionary would run into the input after it. Those are left for each call to insert
+	const size_t reach = std::max<size_t>(LEVELS[level].nice_length, MIN_MATCH);
+	if (LEVELS[level].binary_tree && dictionary.size() > reach) {
+		EncodeTables tree_tables;
+		BinaryTree tree(dictionary, tree_tables, LEVELS[level]);
+		out.tree_inserted = dictionary.size() - reach;
+		tree.insert_until(dictionary.data() + out.tree_inserted);
+		out.tree.assign(tree_tables.tree.begin(), tree_tables.tree.begin() + 2 * out.tree_inserted);
+		out.tree_head = std::move(tree_tables.head);
+	}
+
+	out.serial = next_serial++;
+}
+
+std::expected<size_t, lpz::Error>
+lpz::lz77::decoded_size(std::span<const uint8_t> data) {
 
-	if (data.size() >= std::numeric_limits<uint32_t>::max())
-		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Input too large" });
 	if (data.empty())
 		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Empty Input" });
 
-	std::vector<uint8_t> out;
-	out.reserve(data.size() * 3);
-
 	const uint8_t* ptr = data.data();
 	const uint8_t* end = ptr + data.size();
 
+	size_t size = 0;
+
 	while (ptr < end) {
 
 		uint8_t token = *ptr++;
 
-		uint32_t literal_length = (token & 0xF0) >> 4;
+		size_t literal_length = (token & 0xF0) >> 4;
 
 		if (literal_length == 15) {
 			uint8_t len_byte;
 			do {
+				if (ptr >= end) return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated literal length" });
 				len_byte = *ptr++;
 				literal_length += len_byte;
 			} while (len_byte == 255);
 		}
 
-		if (literal_length > 0) {
-			out.insert(out.end(), ptr, ptr + literal_length);
-			ptr += literal_length;
-		}
+		if (static_cast<size_t>(end - ptr) < literal_length)
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated literals" });
+
+		ptr += literal_length;
+		size += literal_length;
 
 		if (ptr >= end) break;
 
-		uint32_t biased_match_length = token & 0x0F;
+		size_t biased_match_length = token & 0x0F;
+
+		if (end - ptr < static_cast<ptrdiff_t>(sizeof(uint16_t)))
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated distance" });
 
-		uint16_t match_distance;
-		memcpy(&match_distance, ptr, sizeof(match_distance));
+		const bool long_distance = ptr[0] == 0 && ptr[1] == 0;
+		ptr += sizeof(uint16_t);
 
-		ptr += sizeof(match_distance);
+		if (long_distance) {
+			if (end - ptr < static_cast<ptrdiff_t>(sizeof(uint32_t)))
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated distance" });
+			ptr += sizeof(uint32_t);
+		}
 
 		if (biased_match_length == 15) {
 			uint8_t len_byte;
 			do {
+				if (ptr >= end) return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated match length" });
 				len_byte = *ptr++;
 				biased_match_length += len_byte;
 			} while (len_byte == 255);
 		}
 
-		const uint8_t* match_start = out.data() + out.size() - match_distance;
-		uint32_t match_length = biased_match_length + MATCH_LENGTH_BIAS;
-		size_t start_index = out.size() - match_distance;
+		size += biased_match_length + MATCH_LENGTH_BIAS;
+	}
+
+	return size;
+}
+
+namespace {
+
+	template <Format format>
+	std::expected<size_t, lpz::Error> decode_stream(std::span<const uint8_t> data, std::span<uint8_t> out) {
+
+		using lpz::Error, lpz::ErrorCode;
+
+		if (data.empty())
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Empty Input" });
+
+		const uint8_t* ptr = data.data();
+		const uint8_t* end = ptr + data.size();
+
+		uint8_t* const out_begin = out.data();
+		uint8_t* const out_end = out_begin + out.size();
+		uint8_t* op = out_begin;
+
+		constexpr uint32_t bias = rep_bias(format);
+		RepOffsets reps = lpz::lz77::INITIAL_REPS;
+
+		while (ptr < end) {
+
+			uint8_t token = *ptr++;
+
+			size_t literal_length = (token & 0xF0) >> 4;
+
+			if (literal_length == 15) {
+				uint8_t len_byte;
+				do {
+					if (ptr >= end) return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated literal length" });
+					len_byte = *ptr++;
+					literal_length += len_byte;
+				} while (len_byte == 255);
+			}
+
+			if (static_cast<size_t>(end - ptr) < literal_length)
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated literals" });
+			if (static_cast<size_t>(out_end - op) < literal_length)
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Output buffer too small" });
+
+			if (static_cast<size_t>(end - ptr) >= literal_length + WILD_COPY && static_cast<size_t>(out_end - op) >= literal_length + WILD_COPY) {
+				wild_copy(op, ptr, literal_length);
+			}
+			else {
+				memcpy(op, ptr, literal_length);
+			}
+			op += literal_length;
+			ptr += literal_length;
+
+			if (ptr >= end) break;
+
+			size_t biased_match_length = token & 0x0F;
+
+			if (end - ptr < static_cast<ptrdiff_t>(sizeof(uint16_t)))
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated distance" });
+
+			uint16_t code;
+			memcpy(&code, ptr, sizeof(code));
+			ptr += sizeof(code);
+
+			size_t match_distance = code - bias;
+			uint32_t index = REP_CODES;
+			if (code == 0) {
+				if (end - ptr < static_cast<ptrdiff_t>(sizeof(uint32_t)))
+					return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated distance" });
+				uint32_t long_distance;
+				memcpy(&long_distance, ptr, sizeof(long_distance));
+				ptr += sizeof(long_distance);
+				match_distance = long_distance;
+			}
+			else if (code <= bias) {
+				index = code - 1;
+				match_distance = rep_at(reps, index);
+			}
+			if constexpr (format == Format::RepeatOffsets)
+				push_rep(reps, index, match_distance);
+
+			if (biased_match_length == 15) {
+				uint8_t len_byte;
+				do {
+					if (ptr >= end) return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated match length" });
+					len_byte = *ptr++;
+					biased_match_length += len_byte;
+				} while (len_byte == 255);
+			}
 
-		if (match_distance >= match_length) {
-			const uint8_t* src = out.data() + start_index;
-			out.insert(out.end(), src, src + match_length);
+			size_t match_length = biased_match_length + MATCH_LENGTH_BIAS;
+
+			if (match_distance == 0 || match_distance > static_cast<size_t>(op - out_begin))
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Invalid match distance" });
+			if (static_cast<size_t>(out_end - op) < match_length)
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Output buffer too small" });
+
+			if (static_cast<size_t>(out_end - op) >= match_length + WILD_COPY) {
+				copy_match(op, match_distance, match_length);
+				op += match_length;
+			}
+			else if (match_distance >= match_length) {
+				memcpy(op, op - match_distance, match_length);
+				op += match_length;
+			}
+			else {
+				const uint8_t* src = op - match_distance;
+				for (size_t k = 0; k < match_length; ++k) {
+					*op++ = src[k];
+				}
+			}
 		}
-		else {
 
-			if (out.capacity() < out.size() + match_length) {
-				out.reserve(out.size() + match_length);
+		return static_cast<size_t>(op - out_begin);
+	}
+
+	template <Format format>
+	std::expected<size_t, lpz::Error> decode_fields(const lpz::lz77::FieldsView& fields, std::span<uint8_t> out, size_t history, std::span<const uint8_t> dictionary) {
+
+		using lpz::Error, lpz::ErrorCode;
+
+		const uint8_t* ptr = fields[lpz::lz77::TOKENS].data();
+		const uint8_t* const end = ptr + fields[lpz::lz77::TOKENS].size();
+		const uint8_t* literal_ptr = fields[lpz::lz77::LITERALS].data();
+		const uint8_t* const literal_end = literal_ptr + fields[lpz::lz77::LITERALS].size();
+		const uint8_t* low_ptr = fields[lpz::lz77::OFFSETS_LOW].data();
+		const uint8_t* high_ptr = fields[lpz::lz77::OFFSETS_HIGH].data();
+		const size_t match_count = fields[lpz::lz77::OFFSETS_LOW].size();
+
+		if (ptr == end)
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Empty Input" });
+		if (fields[lpz::lz77::OFFSETS_HIGH].size() != match_count)
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Distance fields differ in length" });
+
+		const uint8_t* const low_end = low_ptr + match_count;
+
+		if (history > out.size())
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: History larger than output" });
+
+		uint8_t* const out_begin = out.data();
+		uint8_t* const out_end = out_begin + out.size();
+		uint8_t* op = out_begin + history;
+
+		constexpr uint32_t bias = rep_bias(format);
+		RepOffsets reps = lpz::lz77::INITIAL_REPS;
+
+		while (ptr < end) {
+
+			uint8_t token = *ptr++;
+
+			size_t literal_length = (token & 0xF0) >> 4;
+
+			if (literal_length == 15) {
+				uint8_t len_byte;
+				do {
+					if (ptr >= end) return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated literal length" });
+					len_byte = *ptr++;
+					literal_length += len_byte;
+				} while (len_byte == 255);
+			}
+
+			if (static_cast<size_t>(literal_end - literal_ptr) < literal_length)
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated literals" });
+			if (static_cast<size_t>(out_end - op) < literal_length)
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Output buffer too small" });
+
+			if (static_cast<size_t>(literal_end - literal_ptr) >= literal_length + WILD_COPY && static_cast<size_t>(out_end - op) >= literal_length + WILD_COPY) {
+				wild_copy(op, literal_ptr, literal_length);
 			}
+			else if (literal_length > 0) {
+				memcpy(op, literal_ptr, literal_length); // an empty literal field has no data pointer
+			}
+			op += literal_length;
+			literal_ptr += literal_length;
+
+			if (ptr >= end) break;
+
+			if (low_ptr >= low_end)
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated distance" });
+
+			const uint32_t code = *low_ptr++ | (static_cast<uint32_t>(*high_ptr++) << 8);
 
-			const uint8_t* src = out.data() + start_index;
-			for (uint32_t k = 0; k < match_length; ++k) {
-				out.push_back(src[k]);
+			size_t match_distance = code - bias;
+			uint32_t index = REP_CODES;
+			if (code == 0) {
+				if (low_end - low_ptr < 2)
+					return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated distance" });
+				match_distance = low_ptr[0] | (static_cast<size_t>(high_ptr[0]) << 8) | (static_cast<size_t>(low_ptr[1]) << 16) | (static_cast<size_t>(high_ptr[1]) << 24);
+				low_ptr += 2;
+				high_ptr += 2;
+			}
+			else if (code <= bias) {
+				index = code - 1;
+				match_distance = rep_at(reps, index);
+			}
+			if constexpr (format == Format::RepeatOffsets)
+				push_rep(reps, index, match_distance);
+
+			size_t biased_match_length = token & 0x0F;
+
+			if (biased_match_length == 15) {
+				uint8_t len_byte;
+				do {
+					if (ptr >= end) return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Truncated match length" });
+					len_byte = *ptr++;
+					biased_match_length += len_byte;
+				} while (len_byte == 255);
+			}
+
+			size_t match_length = biased_match_length + MATCH_LENGTH_BIAS;
+
+			if (static_cast<size_t>(out_end - op) < match_length)
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Output buffer too small" });
+
+			if (match_distance == 0 || match_distance > static_cast<size_t>(op - out_begin)) [[unlikely]] {
+
+				// Matches reaching back past the output start in the dictionary
+				const size_t back = match_distance - static_cast<size_t>(op - out_begin);
+				if (match_distance == 0 || back > dictionary.size())
+					return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Invalid match distance" });
+
+				const size_t from_dictionary = std::min(back, match_length);
+				memcpy(op, dictionary.data() + dictionary.size() - back, from_dictionary);
+				for (size_t k = from_dictionary; k < match_length; ++k) {
+					op[k] = out_begin[k - back];
+				}
+				op += match_length;
+			}
+			else if (static_cast<size_t>(out_end - op) >= match_length + WILD_COPY) {
+				copy_match(op, match_distance, match_length);
+				op += match_length;
+			}
+			else if (match_distance >= match_length) {
+				memcpy(op, op - match_distance, match_length);
+				op += match_length;
+			}
+			else {
+				const uint8_t* src = op - match_distance;
+				for (size_t k = 0; k < match_length; ++k) {
+					*op++ = src[k];
+				}
 			}
 		}
+
+		if (literal_ptr != literal_end || low_ptr != low_end)
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Unused field data" });
+
+		return static_cast<size_t>(op - out_begin) - history;
 	}
 
+}
+
+std::expected<size_t, lpz::Error>
+lpz::lz77::decode_into(std::span<const uint8_t> data, std::span<uint8_t> out, Format format) {
+	if (format == Format::Plain) return decode_stream<Format::Plain>(data, out);
+	return decode_stream<Format::RepeatOffsets>(data, out);
+}
+
+std::expected<std::vector<uint8_t>, lpz::Error>
+lpz::lz77::decode(std::span<const uint8_t> data, Format format) {
+
+	if (data.size() >= std::numeric_limits<uint32_t>::max())
+		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Input too large" });
+	if (data.empty())
+		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 decompress: Empty Input" });
+
+	auto size = decoded_size(data);
+	if (!size) return std::unexpected(size.error());
+
+	std::vector<uint8_t> out(*size);
+
+	auto written = decode_into(data, out, format);
+	if (!written) return std::unexpected(written.error());
+
 	return out;
 }
+
+std::expected<void, lpz::Error>
+lpz::lz77::split_fields(std::span<const uint8_t> data, Fields& out) {
+
+	if (data.empty())
+		return std::unexpected(Error{ ErrorCode::InputError, "LZ77 split: Empty Input" });
+
+	// No field can be longer than the whole stream
+	std::array<uint8_t*, FIELD_COUNT> field_ptrs;
+	for (size_t f = 0; f < FIELD_COUNT; f++) {
+		out[f].resize(data.size());
+		field_ptrs[f] = out[f].data();
+	}
+
+	uint8_t*& literal_ptr = field_ptrs[LITERALS];
+	uint8_t*& token_ptr = field_ptrs[TOKENS];
+
+	const uint8_t* ptr = data.data();
+	const uint8_t* end = ptr + data.size();
+
+	auto copy_length_extension = [&]() -> bool {
+		uint8_t len_byte;
+		do {
+			if (ptr >= end) return false;
+			len_byte = *ptr++;
+			*token_ptr++ = len_byte;
+		} while (len_byte == 255);
+		return true;
+	};
+
+	while (ptr < end) {
+
+		uint8_t token = *ptr++;
+		*token_ptr++ = token;
+
+		size_t literal_length = (token & 0xF0) >> 4;
+
+		if (literal_length == 15) {
+			const uint8_t* ext = ptr;
+			if (!copy_length_extension())
+				return std::unexpected(Error{ ErrorCode::InputError, "LZ77 split: Truncated literal length" });
+			for (; ext < ptr; ext++) literal_length += *ext;
+		}
+
+		if (static_cast<size_t>(end - ptr) < literal_length)
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 split: Truncated literals" });
+
+		memcpy(literal_ptr, ptr, literal_length);
+		literal_ptr += literal_length;
+		ptr += literal_length;
+
+		if (ptr >= end) break;
+
+		if (end - ptr < static_cast<ptrdiff_t>(sizeof(uint16_t)))
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 split: Truncated distance" });
+
+		// A long distance follows its escape as two more low and high byte pairs
+		const size_t distance_size = ptr[0] == 0 && ptr[1] == 0 ? sizeof(uint16_t) + sizeof(uint32_t) : sizeof(uint16_t);
+		if (static_cast<size_t>(end - ptr) < distance_size)
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 split: Truncated distance" });
+
+		for (size_t i = 0; i < distance_size; i += 2) {
+			*field_ptrs[OFFSETS_LOW]++ = ptr[i];
+			*field_ptrs[OFFSETS_HIGH]++ = ptr[i + 1];
+		}
+		ptr += distance_size;
+
+		if ((token & 0x0F) == 15 && !copy_length_extension())
+			return std::unexpected(Error{ ErrorCode::InputError, "LZ77 split: Truncated match length" });
+	}
+
+	for (size_t f = 0; f < FIELD_COUNT; f++) {
+		out[f].resize(static_cast<size_t>(field_ptrs[f] - out[f].data()));
+	}
+
+	return {};
+}
+
+std::expected<size_t, lpz::Error>
+lpz::lz77::decode_fields_into(const FieldsView& fields, std::span<uint8_t> out, size_t history, Format format, std::span<const uint8_t> dictionary) {
+	if (format == Format::Plain) return decode_fields<Format::Plain>(fields, out, history, dictionary);
+	return decode_fields<Format::RepeatOffsets>(fields, out, history, dictionary);
+}
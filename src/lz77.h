@@ -1,12 +1,157 @@
 #pragma once
 #include "lpz.h"
 #include <vector>
+#include <array>
 #include <span>
 #include <expected>
 
 namespace lpz::lz77 {
 
-	std::expected<std::vector<uint8_t>, Error> encode(std::span<const uint8_t> data);
-	std::expected<std::vector<uint8_t>, Error> decode(std::span<const uint8_t> data);
+	// Farthest back a 2-byte distance can reach, so also the most history a block is parsed with
+	constexpr size_t WINDOW_SIZE = 65535;
+
+	// Long-distance matching finds repeats of at least MIN_LONG_MATCH bytes beyond WINDOW_SIZE
+	// and up to MAX_LONG_WINDOW back. Their distances do not fit the 2 bytes of a match: a
+	// distance of 0, which no match has, is followed by the distance as a u32
+	constexpr size_t MAX_LONG_WINDOW = size_t(1) << 29;
+	constexpr uint32_t MIN_LONG_MATCH = 64;
+
+	// How the 2 bytes of a match's distance are read. In the RepeatOffsets format, 1 to REP_CODES
+	// stand for the last REP_CODES distances, most recent first, and larger values are the
+	// distance plus REP_CODES, which leaves the match finders WINDOW_SIZE - REP_CODES of reach.
+	// Plain, which legacy Compressed blocks use, holds the distance itself
+	enum class Format : uint8_t {
+		Plain,
+		RepeatOffsets,
+	};
+
+	// Every match moves its distance to the front of the repeat offsets, which each stream
+	// starts with INITIAL_REPS
+	constexpr uint32_t REP_CODES = 3;
+	using RepOffsets = std::array<uint32_t, REP_CODES>;
+	constexpr RepOffsets INITIAL_REPS = { 1, 4, 8 };
+
+	// Copy `length` bytes starting `distance` bytes back
+	struct Match {
+		uint32_t length = 0;
+		uint16_t distance = 0;
+	};
+
+	// Cheapest known way to reach one input position during optimal parsing
+	struct ParseNode {
+		uint32_t price;
+		uint32_t literals;  // length of the literal run ending here
+		uint32_t length;    // length of the step reaching here, 1 for a literal
+		uint16_t distance;  // 0 for a literal
+		uint32_t next;      // position the chosen path moves to next
+		uint32_t matches;   // first of this position's candidates in EncodeTables::matches
+		RepOffsets reps;    // repeat offsets once the cheapest path reaches here
+	};
+
+	// Where a parse wrote the distance field of a match, and the distance it codes
+	struct DistanceField {
+		uint32_t position;
+		uint32_t distance;
+	};
+
+	// Match finder tables with a dictionary inserted at one level, digested once so that inputs
+	// that start with the dictionary copy them rather than insert it again
+	struct DictionaryTables {
+		std::vector<int32_t> head;
+		std::vector<int32_t> chain;
+		std::vector<int32_t> tree; // only for the levels with a binary tree match finder
+		std::vector<int32_t> tree_head; // head table once the tree holds tree_inserted positions
+		size_t size = 0;           // of the dictionary
+		size_t inserted = 0;       // positions whose hashed bytes all lie in the dictionary
+		size_t tree_inserted = 0;  // positions whose tree search stays within the dictionary
+		uint64_t serial = 0;       // tells digests apart, unique in the process
+	};
+
+	// The fields of an LZ77 stream stored apart, so each can be entropy coded with its own
+	// statistics. Tokens keep their length extension bytes; distances are split by byte.
+	enum Field : size_t {
+		LITERALS,
+		TOKENS,
+		OFFSETS_LOW,
+		OFFSETS_HIGH,
+		FIELD_COUNT,
+	};
+
+	using Fields = std::array<std::vector<uint8_t>, FIELD_COUNT>;
+	using FieldsView = std::array<std::span<const uint8_t>, FIELD_COUNT>;
+
+	// Match finder tables, kept between calls so they are only allocated and cleared once
+	struct EncodeTables {
+		std::vector<int32_t> head;
+		std::vector<int32_t> chain;
+		std::vector<int32_t> tree; // binary tree children, two per position, for high levels
+		int32_t base = 0;
+
+		// Optimal parsing state, only used at MAX_LEVEL
+		std::vector<ParseNode> parse;
+		std::vector<Match> matches;
+		Fields fields; // of the previous pass, which prices the next
+
+		std::vector<uint8_t> parsed; // the parse long matches are laid over
+		std::vector<DistanceField> distances; // of the last parse written
+
+		const DictionaryTables* dictionary = nullptr; // the input of the call in progress starts with
+		uint64_t primed = 0; // serial of the dictionary whose head and chain the tables still hold
+	};
+
+	// `length` bytes, `position` bytes into a block, that repeat those `distance` bytes before
+	struct LongMatch {
+		size_t position;
+		uint32_t length;
+		uint32_t distance;
+	};
+
+	// Rolling hash table of long-distance matching, carried from block to block. Holds the
+	// stream position, plus one, of the last window hashed to each bucket, under a tag
+	struct LongMatchTable {
+		std::vector<uint64_t> head;
+		size_t window = 0;
+	};
+
+	// Largest encoded size of `size` input bytes
+	size_t encode_bound(size_t size);
+
+	std::expected<std::vector<uint8_t>, Error> encode(std::span<const uint8_t> data, int level = DEFAULT_LEVEL, Format format = Format::RepeatOffsets);
+	// Encodes into `out`, which must hold at least encode_bound(data.size()) bytes. Returns bytes
+	// written. The first `history` bytes of `data` are not encoded, only matched against: they
+	// are data the decoder already has in front of the output. `long_matches`, in order and
+	// within the encoded part of `data`, whose start they count from, replace what the match
+	// finders found for their bytes; they may reach further back than `data` does. A
+	// `dictionary` digested from the `history` bytes saves inserting them
+	std::expected<size_t, Error> encode_into(std::span<const uint8_t> data, std::span<uint8_t> out, EncodeTables& tables, int level = DEFAULT_LEVEL, size_t history = 0, std::span<const LongMatch> long_matches = {}, Format format = Format::RepeatOffsets, const DictionaryTables* dictionary = nullptr);
+
+	// Rewrites `stream`, which encode_into last wrote with `tables` in Format::RepeatOffsets, in
+	// Format::Plain when none of its matches take a repeat code, so decoding it need not track
+	// them. Returns the format `stream` is left in
+	Format drop_repeat_offsets(std::span<uint8_t> stream, const EncodeTables& tables);
+
+	// Inserts `dictionary` into `out` as the match finders of `level` would. Tables digested at
+	// a level with a binary tree match finder serve every level, others the remaining levels
+	void digest_dictionary(std::span<const uint8_t> dictionary, int level, DictionaryTables& out);
+
+	// Empties `table` and sizes it for repeats up to `window` bytes back
+	void reset_long_matches(LongMatchTable& table, size_t window);
+	// Appends to `out` the long matches in the block data[start, end), where data[0] is at
+	// stream position `offset`, and enters the block into `table`. Blocks go in stream order,
+	// each with the table's window of data in front of it, or as much as the stream has
+	void find_long_matches(std::span<const uint8_t> data, size_t start, uint64_t offset, LongMatchTable& table, std::vector<LongMatch>& out);
+	std::expected<std::vector<uint8_t>, Error> decode(std::span<const uint8_t> data, Format format = Format::RepeatOffsets);
+
+	// Size of the output `data` decodes to, found by walking the tokens without copying
+	std::expected<size_t, Error> decoded_size(std::span<const uint8_t> data);
+	// Decodes into `out`, which must be at least decoded_size(data) bytes. Returns bytes written
+	std::expected<size_t, Error> decode_into(std::span<const uint8_t> data, std::span<uint8_t> out, Format format = Format::RepeatOffsets);
+
+	// Splits the LZ77 stream `data` into its fields, reusing the capacity of `out`
+	std::expected<void, Error> split_fields(std::span<const uint8_t> data, Fields& out);
+	// Decodes straight from split fields into `out`, after the first `history` bytes, which
+	// matches may reach back into, and past them into the end of `dictionary`. Returns bytes
+	// written
+	std::expected<size_t, Error> decode_fields_into(const FieldsView& fields, std::span<uint8_t> out, size_t history = 0, Format format = Format::RepeatOffsets, std::span<const uint8_t> dictionary = {});
 
 }
\ No newline at end of file
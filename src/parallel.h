@@ -0,0 +1,62 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <algorithm>
+#include <type_traits>
+
+namespace lpz {
+
+	inline unsigned resolve_threads(unsigned threads, size_t jobs) {
+
+		if (threads == 0) {
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+
+		return static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(jobs, 1)));
+	}
+
+	// Runs f(0) .. f(count - 1) across `threads` workers. The calling thread takes part,
+	// and the first exception thrown by any job is rethrown once all workers have joined.
+	// f may also take the worker number (0 .. threads - 1) to pick per-worker state.
+	template <typename F>
+	void parallel_for(size_t count, unsigned threads, F&& f) {
+
+		auto run = [&](size_t i, unsigned worker) {
+			if constexpr (std::is_invocable_v<F&, size_t, unsigned>) f(i, worker);
+			else f(i);
+		};
+
+		if (threads <= 1) {
+			for (size_t i = 0; i < count; i++) run(i, 0);
+			return;
+		}
+
+		std::atomic<size_t> next = 0;
+		std::exception_ptr exception;
+		std::mutex exception_mutex;
+
+		auto worker = [&](unsigned id) {
+			try {
+				for (size_t i = next++; i < count; i = next++) run(i, id);
+			}
+			catch (...) {
+				std::lock_guard lock(exception_mutex);
+				if (!exception) exception = std::current_exception();
+				next = count;
+			}
+		};
+
+		{
+			std::vector<std::jthread> pool;
+			pool.reserve(threads - 1);
+			for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker, t);
+			worker(0);
+		}
+
+		if (exception) std::rethrow_exception(exception);
+	}
+
+}
@@ -0,0 +1,415 @@
+#include "lpz.h"
+#include "block.h"
+#include "parallel.h"
+#include "context.h"
+#include <cstring>
+#include <limits>
+
+struct lpz::Compressor::State {
+	Sink sink;
+	CompressOptions options;
+	size_t batch_size;
+
+	CompressContext owned_context;
+	CompressContext* context = &owned_context;
+
+	std::vector<uint8_t> pending;
+	std::vector<uint8_t> linked_input; // end of the input so far, for linked blocks to match into, then the batch
+	uint64_t input_offset = 0;         // stream position of linked_input[0]
+	std::vector<std::span<const uint8_t>> in_blocks;
+	std::vector<size_t> histories;
+	std::vector<std::vector<lz77::LongMatch>> long_matches;
+	std::vector<PreparedBlock> prepared;
+	std::vector<std::expected<void, Error>> prepare_results;
+	BlockCodes codes;
+	std::vector<std::vector<uint8_t>> out_blocks;
+	std::vector<std::expected<size_t, Error>> out_sizes;
+	std::vector<uint8_t> frame;
+	std::vector<SeekEntry> seek_entries;
+	bool started = false;
+	bool finished = false;
+
+	std::expected<void, Error> compress_batch(std::span<const uint8_t> data) {
+
+		if (options.long_window > lz77::MAX_LONG_WINDOW) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Long window too large" });
+		}
+
+		auto& context_state = context->state();
+
+		if (!started && options.long_window > 0) {
+			lz77::reset_long_matches(context_state.long_matches, options.long_window);
+			frame.resize(WINDOW_BLOCK_SIZE);
+			write_window_block(frame.data(), options.long_window);
+			auto res = sink(frame);
+			if (!res) return res;
+		}
+		started = true;
+
+		// Linked blocks see the input before this batch, as far back as they reach
+		const bool linked = options.linked_blocks || options.long_window > 0;
+		std::span<const uint8_t> input = data;
+		size_t start = 0;
+		if (linked) {
+			input_offset += trim_history(linked_input, std::max(lz77::WINDOW_SIZE, options.long_window));
+			start = linked_input.size();
+			linked_input.insert(linked_input.end(), data.begin(), data.end());
+			input = linked_input;
+		}
+
+		in_blocks.clear();
+		histories.clear();
+		for (size_t pos = start; pos < input.size(); pos += MAX_BLOCK) {
+			size_t history = linked ? std::min(lz77::WINDOW_SIZE, pos) : 0;
+			in_blocks.push_back(input.subspan(pos - history, history + std::min(MAX_BLOCK, input.size() - pos)));
+			histories.push_back(history);
+		}
+
+		if (options.seek_table && seek_entries.size() + in_blocks.size() > MAX_SEEK_ENTRIES) {
+			return std::unexpected(Error{ ErrorCode::InputError, "Input too large for a seek table" });
+		}
+
+		if (long_matches.size() < in_blocks.size()) long_matches.resize(in_blocks.size());
+		for (size_t i = 0; i < in_blocks.size(); i++) {
+			long_matches[i].clear();
+			if (options.long_window == 0) continue;
+			const size_t pos = start + i * MAX_BLOCK;
+			lz77::find_long_matches(input.first(pos + in_blocks[i].size() - histories[i]), pos, input_offset, context_state.long_matches, long_matches[i]);
+		}
+
+		unsigned threads = resolve_threads(options.threads, in_blocks.size());
+		context_state.reserve(threads);
+
+		if (prepared.size() < in_blocks.size()) prepared.resize(in_blocks.size());
+		if (out_blocks.size() < in_blocks.size()) out_blocks.resize(in_blocks.size());
+		prepare_results.resize(in_blocks.size());
+		out_sizes.resize(in_blocks.size());
+
+		// As in lpz::compress: parse in parallel, choose codes in block order, carrying them
+		// from batch to batch, then entropy code in parallel
+		lpz::parallel_for(in_blocks.size(), threads, [&](size_t i, unsigned worker) {
+			prepare_results[i] = lpz::prepare_block(in_blocks[i], prepared[i], context_state.workers[worker], options.level, histories[i], long_matches[i]);
+		});
+
+		for (size_t i = 0; i < in_blocks.size(); i++) {
+			if (!prepare_results[i]) return std::unexpected(Error{ ErrorCode::SystemError, "Block compression failed: " + prepare_results[i].error().m });
+			lpz::plan_block(prepared[i], codes);
+		}
+
+		// Each block is written together with its header, so it can be emitted in place.
+		lpz::parallel_for(in_blocks.size(), threads, [&](size_t i) {
+			out_blocks[i].resize(BLOCK_HEADER_SIZE + compress_block_bound(prepared[i].size));
+			out_sizes[i] = lpz::write_block(prepared[i], out_blocks[i]);
+		});
+
+		for (size_t i = 0; i < in_blocks.size(); i++) {
+
+			auto& comp_size = out_sizes[i];
+			if (!comp_size) return std::unexpected(Error{ ErrorCode::SystemError, "Block compression failed: " + comp_size.error().m });
+
+			std::span<const uint8_t> frame_data(out_blocks[i].data(), *comp_size);
+
+			if (options.seek_table) {
+				seek_entries.push_back({ static_cast<uint32_t>(frame_data.size()), static_cast<uint32_t>(prepared[i].size) });
+			}
+
+			auto res = sink(frame_data);
+			if (!res) return res;
+		}
+
+		return {};
+	}
+};
+
+lpz::Compressor::Compressor(Sink sink, const CompressOptions& options)
+	: state_(std::make_unique<State>()) {
+
+	state_->sink = std::move(sink);
+	state_->options = options;
+	state_->batch_size = resolve_threads(options.threads, std::numeric_limits<size_t>::max()) * MAX_BLOCK;
+	state_->pending.reserve(state_->batch_size);
+}
+
+lpz::Compressor::Compressor(Sink sink, CompressContext& context, const CompressOptions& options)
+	: Compressor(std::move(sink), options) {
+
+	state_->context = &context;
+}
+
+lpz::Compressor::~Compressor() = default;
+lpz::Compressor::Compressor(Compressor&&) noexcept = default;
+lpz::Compressor& lpz::Compressor::operator=(Compressor&&) noexcept = default;
+
+std::expected<void, lpz::Error> lpz::Compressor::write(std::span<const uint8_t> data) {
+
+	auto& s = *state_;
+
+	if (s.finished) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Compressor already finished" });
+	}
+
+	while (!data.empty()) {
+
+		// Whole batches can be compressed straight from the caller's buffer.
+		if (s.pending.empty() && data.size() >= s.batch_size) {
+			auto res = s.compress_batch(data.first(s.batch_size));
+			if (!res) return res;
+			data = data.subspan(s.batch_size);
+			continue;
+		}
+
+		size_t take = std::min(s.batch_size - s.pending.size(), data.size());
+		s.pending.insert(s.pending.end(), data.begin(), data.begin() + take);
+		data = data.subspan(take);
+
+		if (s.pending.size() == s.batch_size) {
+			auto res = s.compress_batch(s.pending);
+			if (!res) return res;
+			s.pending.clear();
+		}
+	}
+
+	return {};
+}
+
+std::expected<void, lpz::Error> lpz::Compressor::finish() {
+
+	auto& s = *state_;
+
+	if (s.finished) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Compressor already finished" });
+	}
+	s.finished = true;
+
+	if (!s.pending.empty()) {
+		auto res = s.compress_batch(s.pending);
+		if (!res) return res;
+		s.pending.clear();
+	}
+
+	// As with lpz::compress, there is no stream of no data
+	if (!s.started) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
+	}
+
+	if (s.options.seek_table && !s.seek_entries.empty()) {
+		s.frame.clear();
+		write_seek_table(s.frame, s.seek_entries);
+		return s.sink(s.frame);
+	}
+
+	return {};
+}
+
+
+struct lpz::Decompressor::State {
+	Sink sink;
+	unsigned threads;
+
+	DecompressContext owned_context;
+	DecompressContext* context = &owned_context;
+
+	std::vector<uint8_t> pending;
+	uint64_t skip = 0;
+	std::vector<Block> ready;
+	BlockCodes codes;
+	std::vector<BlockCodes> block_codes;
+	size_t window = lz77::WINDOW_SIZE; // output linked blocks reach back into, raised by a window block
+	std::vector<uint8_t> previous;      // output of the run of linked blocks so far, or its last `window` bytes and more
+	std::vector<std::vector<uint8_t>> outputs; // output of each later run of linked blocks in the batch
+	std::vector<size_t> offsets;        // where each block's output starts in that of its run
+	std::vector<size_t> chains;
+	std::vector<std::expected<void, Error>> results;
+	bool started = false; // whether any of the stream has arrived
+
+	// Queues a data block, or takes the window from a window block
+	std::expected<void, Error> add_block(Block block) {
+
+		if (block.type != BlockType::Window) {
+			ready.push_back(block);
+			return {};
+		}
+
+		auto value = read_window_block(block.payload);
+		if (!value) return std::unexpected(value.error());
+
+		window = *value;
+		return {};
+	}
+
+	std::expected<void, Error> flush() {
+
+		if (ready.empty()) return {};
+
+		auto& context_state = context->state();
+		context_state.reserve(threads);
+
+		block_codes.resize(ready.size());
+		offsets.resize(ready.size());
+		results.resize(ready.size());
+
+		// The codes each block starts from, carried from batch to batch
+		for (size_t i = 0; i < ready.size(); i++) {
+			block_codes[i] = codes;
+			auto advanced = lpz::advance_block_codes(ready[i], codes);
+			if (!advanced) return std::unexpected(Error{ ErrorCode::SystemError, "Block decompression failed: " + advanced.error().m });
+		}
+
+		// Runs of linked blocks are decoded in order, each block onto the end of the output of
+		// its run, and the runs in parallel. The first run continues the one before the batch
+		chains.clear();
+		for (size_t i = 0; i < ready.size(); i++) {
+			if (i == 0 || ready[i].type != BlockType::LinkedSplit) chains.push_back(i);
+		}
+
+		if (outputs.size() < chains.size()) outputs.resize(chains.size());
+
+		auto output = [&](size_t c) -> std::vector<uint8_t>& { return c == 0 ? previous : outputs[c]; };
+
+		lpz::parallel_for(chains.size(), std::min<unsigned>(threads, static_cast<unsigned>(chains.size())), [&](size_t c, unsigned worker) {
+			auto& out = output(c);
+			const size_t last = c + 1 < chains.size() ? chains[c + 1] : ready.size();
+			for (size_t i = chains[c]; i < last; i++) {
+				offsets[i] = ready[i].type == BlockType::LinkedSplit ? out.size() : 0;
+				results[i] = lpz::decompress_block(ready[i], out, block_codes[i], context_state.workers[worker]);
+			}
+		});
+
+		for (size_t c = 0; c < chains.size(); c++) {
+			const auto& out = output(c);
+			const size_t last = c + 1 < chains.size() ? chains[c + 1] : ready.size();
+			for (size_t i = chains[c]; i < last; i++) {
+				if (!results[i]) return std::unexpected(Error{ ErrorCode::SystemError, "Block decompression failed: " + results[i].error().m });
+				const size_t end = i + 1 < last ? offsets[i + 1] : out.size();
+				auto res = sink(std::span<const uint8_t>(out).subspan(offsets[i], end - offsets[i]));
+				if (!res) return res;
+			}
+		}
+
+		if (chains.size() > 1) std::swap(previous, outputs[chains.size() - 1]);
+		trim_history(previous, window);
+
+		ready.clear();
+		return {};
+	}
+};
+
+lpz::Decompressor::Decompressor(Sink sink, const DecompressOptions& options)
+	: state_(std::make_unique<State>()) {
+
+	state_->sink = std::move(sink);
+	state_->threads = resolve_threads(options.threads, std::numeric_limits<size_t>::max());
+}
+
+lpz::Decompressor::Decompressor(Sink sink, DecompressContext& context, const DecompressOptions& options)
+	: Decompressor(std::move(sink), options) {
+
+	state_->context = &context;
+}
+
+lpz::Decompressor::~Decompressor() = default;
+lpz::Decompressor::Decompressor(Decompressor&&) noexcept = default;
+lpz::Decompressor& lpz::Decompressor::operator=(Decompressor&&) noexcept = default;
+
+std::expected<void, lpz::Error> lpz::Decompressor::write(std::span<const uint8_t> data) {
+
+	auto& s = *state_;
+
+	if (!data.empty()) s.started = true;
+
+	while (!data.empty()) {
+
+		if (s.skip > 0) {
+			size_t take = static_cast<size_t>(std::min<uint64_t>(s.skip, data.size()));
+			s.skip -= take;
+			data = data.subspan(take);
+			continue;
+		}
+
+		// Finish a block that straddles the previous write before looking at new ones.
+		if (!s.pending.empty()) {
+
+			if (s.pending.size() < BLOCK_HEADER_SIZE) {
+				size_t take = std::min(BLOCK_HEADER_SIZE - s.pending.size(), data.size());
+				s.pending.insert(s.pending.end(), data.begin(), data.begin() + take);
+				data = data.subspan(take);
+				if (s.pending.size() < BLOCK_HEADER_SIZE) continue;
+			}
+
+			uint32_t value;
+			memcpy(&value, s.pending.data(), sizeof(value));
+			auto header = decode_block_header(value);
+			if (!header) return std::unexpected(header.error());
+
+			if (header->type == BlockType::Dictionary) return std::unexpected(Error{ ErrorCode::InputError, "Stream needs a dictionary, which streaming decompression does not take" });
+			if (!is_data_block(header->type) && header->type != BlockType::Window) {
+				s.skip = header->size;
+				s.pending.clear();
+				continue;
+			}
+
+			size_t needed = BLOCK_HEADER_SIZE + header->size;
+			size_t take = std::min(needed - s.pending.size(), data.size());
+			s.pending.insert(s.pending.end(), data.begin(), data.begin() + take);
+			data = data.subspan(take);
+
+			if (s.pending.size() < needed) continue;
+
+			auto res = s.add_block({ header->type, std::span<const uint8_t>(s.pending).subspan(BLOCK_HEADER_SIZE) });
+			if (!res) return res;
+			res = s.flush();
+			if (!res) return res;
+
+			s.pending.clear();
+			continue;
+		}
+
+		if (data.size() < BLOCK_HEADER_SIZE) {
+			s.pending.assign(data.begin(), data.end());
+			break;
+		}
+
+		uint32_t value;
+		memcpy(&value, data.data(), sizeof(value));
+		auto header = decode_block_header(value);
+		if (!header) return std::unexpected(header.error());
+
+		if (header->type == BlockType::Dictionary) return std::unexpected(Error{ ErrorCode::InputError, "Stream needs a dictionary, which streaming decompression does not take" });
+		if (!is_data_block(header->type) && header->type != BlockType::Window) {
+			s.skip = header->size;
+			data = data.subspan(BLOCK_HEADER_SIZE);
+			continue;
+		}
+
+		if (data.size() - BLOCK_HEADER_SIZE < header->size) {
+			s.pending.assign(data.begin(), data.end());
+			break;
+		}
+
+		auto added = s.add_block({ header->type, data.subspan(BLOCK_HEADER_SIZE, header->size) });
+		if (!added) return added;
+		data = data.subspan(BLOCK_HEADER_SIZE + header->size);
+
+		if (s.ready.size() >= s.threads) {
+			auto res = s.flush();
+			if (!res) return res;
+		}
+	}
+
+	// Queued blocks point into the caller's buffer, so they must be decoded before returning.
+	return s.flush();
+}
+
+std::expected<void, lpz::Error> lpz::Decompressor::finish() {
+
+	auto& s = *state_;
+
+	if (!s.started) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Input block empty" });
+	}
+	if (!s.pending.empty() || s.skip > 0) {
+		return std::unexpected(Error{ ErrorCode::InputError, "Truncated stream" });
+	}
+
+	return {};
+}
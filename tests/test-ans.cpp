@@ -0,0 +1,95 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <numeric>
+#include "ans.h"
+#include "huffman.h"
+#include "test-common.h"
+
+#pragma warning(disable : 6326)
+
+TEST(AnsTest, BasicTest) {
+
+    auto input = readFile("tests/sample/enwik6");
+
+    auto compressed = lpz::ans::encode(input);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+    auto decompressed = lpz::ans::decode(*compressed);
+    if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+
+    EXPECT_EQ(input, *decompressed);
+}
+
+TEST(AnsTest, EmptyTest) {
+
+    std::vector<uint8_t> input = {};
+
+    auto compressed = lpz::ans::encode(input);
+    EXPECT_EQ(compressed.error().c, lpz::ErrorCode::InputError);
+
+    auto decompressed = lpz::ans::decode(input);
+    EXPECT_EQ(decompressed.error().c, lpz::ErrorCode::InputError);
+
+}
+
+TEST(AnsTest, SmallInputs) {
+
+    auto sample = readFile("tests/sample/enwik4");
+
+    // Sizes around the two states and the 8-byte reader window, and a single repeated symbol
+    std::vector<std::vector<uint8_t>> inputs;
+    for (size_t size : { 1, 2, 3, 4, 5, 7, 8, 9, 17, 100 }) {
+        inputs.emplace_back(sample.begin(), sample.begin() + size);
+    }
+    inputs.emplace_back(1000, uint8_t(42));
+
+    for (auto& input : inputs) {
+        auto compressed = lpz::ans::encode(input);
+        if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+        auto decompressed = lpz::ans::decode(*compressed);
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+
+        EXPECT_EQ(input, *decompressed);
+    }
+
+}
+
+TEST(AnsTest, SkewedBeatsHuffman) {
+
+    // One symbol at 90%: Huffman spends a whole bit on it, ANS about 0.15
+    std::vector<uint8_t> input(100000);
+    for (size_t i = 0; i < input.size(); i++) {
+        input[i] = (i * 2654435761u) % 10 == 0 ? static_cast<uint8_t>(1 + i % 7) : 0;
+    }
+
+    auto counts = lpz::ans::normalize_counts(lpz::create_histogram(input), input.size());
+    EXPECT_EQ(std::accumulate(counts.counts.begin(), counts.counts.end(), 0u), 1u << counts.table_log);
+
+    auto ans = lpz::ans::encode(input);
+    if (!ans) throw std::runtime_error("Compression failed: " + ans.error().m);
+    auto huffman = lpz::huffman::encode(input);
+    if (!huffman) throw std::runtime_error("Compression failed: " + huffman.error().m);
+
+    EXPECT_LT(ans->size(), huffman->size() * 3 / 4);
+
+    auto decompressed = lpz::ans::decode(*ans);
+    if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+    EXPECT_EQ(input, *decompressed);
+
+}
+
+TEST(AnsTest, Corrupted) {
+
+    auto input = readFile("tests/sample/enwik4");
+
+    auto compressed = lpz::ans::encode(input);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+
+    auto truncated = std::vector<uint8_t>(compressed->begin(), compressed->end() - 16);
+    EXPECT_EQ(lpz::ans::decode(truncated).error().c, lpz::ErrorCode::InputError);
+
+    auto flipped = *compressed;
+    flipped[flipped.size() / 2] ^= 0x10;
+    auto decompressed = lpz::ans::decode(flipped);
+    EXPECT_TRUE(!decompressed || *decompressed != input);
+
+}
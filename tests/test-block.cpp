@@ -1,7 +1,9 @@
 #include <gtest/gtest.h>
 #include <fstream>
 #include <chrono>
+#include <algorithm>
 #include "lz77.h"
+#include "huffman.h"
 #include "block.h"
 #include "test-common.h"
 
@@ -61,3 +63,153 @@ TEST(BlockTest, SingleCharStream) {
 }
 
 
+TEST(BlockTest, SplitBlock) {
+
+    auto input = readFile("tests/sample/enwik4");
+
+    auto compressed = lpz::compress_block(input);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+
+    auto header = lpz::read_block_header(*compressed);
+    if (!header) throw std::runtime_error("Bad header: " + header.error().m);
+    EXPECT_EQ(header->type, lpz::BlockType::Split);
+    EXPECT_EQ(header->size + lpz::BLOCK_HEADER_SIZE, compressed->size());
+
+    // Corrupting the stream sizes must be caught rather than read past the block
+    auto corrupt = *compressed;
+    corrupt[lpz::BLOCK_HEADER_SIZE + 4 + 1] ^= 0x80;
+    auto decompressed = lpz::decompress_block(corrupt);
+    EXPECT_FALSE(decompressed);
+
+}
+
+TEST(BlockTest, CompressedBlockStillDecodes) {
+
+    auto input = readFile("tests/sample/enwik4");
+
+    // Single stream blocks from before the split format, and so before repeat offsets
+    auto lz77 = lpz::lz77::encode(input, lpz::DEFAULT_LEVEL, lpz::lz77::Format::Plain);
+    if (!lz77) throw std::runtime_error("Compression failed: " + lz77.error().m);
+    auto payload = lpz::huffman::encode(*lz77);
+    if (!payload) throw std::runtime_error("Compression failed: " + payload.error().m);
+
+    std::vector<uint8_t> block;
+    lpz::write_block_header(block, { lpz::BlockType::Compressed, static_cast<uint32_t>(payload->size()) });
+    block.insert(block.end(), payload->begin(), payload->end());
+
+    auto decompressed = lpz::decompress_block(block);
+    if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+
+    EXPECT_EQ(input, *decompressed);
+
+}
+
+TEST(BlockTest, RepeatedCodes) {
+
+    auto sample = readFile("tests/sample/enwik6");
+
+    // Two blocks of the same kind of text, the second coded with the codes of the first
+    std::span<const uint8_t> first(sample.data(), 64 * 1024);
+    std::span<const uint8_t> second(sample.data() + 64 * 1024, 4 * 1024);
+
+    lpz::BlockCompressScratch scratch;
+    lpz::BlockCodes codes;
+    std::vector<std::vector<uint8_t>> blocks;
+
+    for (auto data : { first, second }) {
+        auto prepared = lpz::prepare_block(data, scratch.prepared, scratch);
+        if (!prepared) throw std::runtime_error("Compression failed: " + prepared.error().m);
+
+        lpz::plan_block(scratch.prepared, codes);
+
+        std::vector<uint8_t> block(lpz::BLOCK_HEADER_SIZE + lpz::compress_block_bound(data.size()));
+        auto size = lpz::write_block(scratch.prepared, block);
+        if (!size) throw std::runtime_error("Compression failed: " + size.error().m);
+        block.resize(*size);
+        blocks.push_back(std::move(block));
+    }
+
+    auto alone = lpz::compress_block(second);
+    if (!alone) throw std::runtime_error("Compression failed: " + alone.error().m);
+    EXPECT_LT(blocks[1].size(), alone->size());
+
+    lpz::BlockCodes decode_codes;
+    lpz::BlockDecompressScratch decode_scratch;
+    std::vector<uint8_t> out;
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        auto header = lpz::read_block_header(blocks[i]);
+        ASSERT_TRUE(header);
+        auto res = lpz::decompress_block({ header->type, std::span<const uint8_t>(blocks[i]).subspan(lpz::BLOCK_HEADER_SIZE) }, out, decode_codes, decode_scratch);
+        if (!res) throw std::runtime_error("Decompression failed: " + res.error().m);
+
+        auto expected = i == 0 ? first : second;
+        EXPECT_TRUE(std::equal(expected.begin(), expected.end(), out.begin(), out.end()));
+    }
+
+    // Without the codes of the first block the second cannot be decoded
+    auto decompressed = lpz::decompress_block(blocks[1]);
+    EXPECT_EQ(decompressed.error().c, lpz::ErrorCode::InputError);
+
+}
+
+TEST(BlockTest, AnsStreams) {
+
+    // Random bytes with copies from 100 bytes back: every match has the same offset, which
+    // Huffman codes in no less than a bit and ANS in a fraction of one
+    std::vector<uint8_t> input(64 * 1024);
+    uint32_t state = 1;
+    for (size_t i = 0; i < input.size(); i++) {
+        const uint32_t value = next_random(state);
+        input[i] = i < 100 || (value >> 24) < 128 ? static_cast<uint8_t>(value >> 8) : input[i - 100];
+    }
+
+    lpz::BlockCompressScratch scratch;
+    lpz::BlockCodes codes;
+    auto prepared = lpz::prepare_block(input, scratch.prepared, scratch);
+    if (!prepared) throw std::runtime_error("Compression failed: " + prepared.error().m);
+    lpz::plan_block(scratch.prepared, codes);
+
+    EXPECT_NE(std::find(scratch.prepared.modes.begin(), scratch.prepared.modes.end(), lpz::StreamMode::Ans), scratch.prepared.modes.end());
+
+    auto compressed = lpz::compress_block(input);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+    auto decompressed = lpz::decompress_block(*compressed);
+    if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+
+    EXPECT_EQ(input, *decompressed);
+
+}
+
+TEST(BlockTest, StoredAndRleBlocks) {
+
+    auto noise = random_bytes(100000, 7);
+    std::vector<uint8_t> run(100000, 'z');
+
+    auto stored = lpz::compress_block(noise, lpz::MAX_LEVEL);
+    if (!stored) throw std::runtime_error("Compression failed: " + stored.error().m);
+    auto rle = lpz::compress_block(run);
+    if (!rle) throw std::runtime_error("Compression failed: " + rle.error().m);
+
+    EXPECT_EQ(lpz::read_block_header(*stored)->type, lpz::BlockType::Stored);
+    EXPECT_EQ(stored->size(), lpz::BLOCK_HEADER_SIZE + noise.size());
+    EXPECT_EQ(lpz::read_block_header(*rle)->type, lpz::BlockType::Rle);
+    EXPECT_EQ(rle->size(), lpz::BLOCK_HEADER_SIZE + 5);
+
+    for (auto [compressed, input] : { std::pair{ &*stored, &noise }, std::pair{ &*rle, &run } }) {
+        auto decompressed = lpz::decompress_block(*compressed);
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(*input, *decompressed);
+    }
+
+    // An RLE payload is exactly its size and byte
+    auto corrupt = *rle;
+    lpz::write_block_header(corrupt.data(), { lpz::BlockType::Rle, 4 });
+    EXPECT_EQ(lpz::decompress_block(corrupt).error().c, lpz::ErrorCode::InputError);
+
+    // and never runs for zero bytes
+    corrupt = *rle;
+    std::fill_n(corrupt.begin() + lpz::BLOCK_HEADER_SIZE, 4, uint8_t(0));
+    EXPECT_EQ(lpz::decompress_block(corrupt).error().c, lpz::ErrorCode::InputError);
+
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <fstream>
 #include <vector>
+#include <cstdint>
 
 inline std::vector<uint8_t> readFile(const std::string& filename) {
     std::ifstream file(filename, std::ios::binary | std::ios::ate);
@@ -18,3 +19,18 @@ inline std::vector<uint8_t> readFile(const std::string& filename) {
 
     return buffer;
 }
+
+// Steps the linear congruential generator test data is drawn from, and returns its new state
+inline uint32_t next_random(uint32_t& state) {
+    state = state * 1664525 + 1013904223;
+    return state;
+}
+
+// `size` bytes of noise, the same for the same seed
+inline std::vector<uint8_t> random_bytes(size_t size, uint32_t seed) {
+    std::vector<uint8_t> bytes(size);
+    for (auto& value : bytes) {
+        value = static_cast<uint8_t>(next_random(seed) >> 24);
+    }
+    return bytes;
+}
@@ -0,0 +1,127 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <algorithm>
+#include "lpz.h"
+#include "test-common.h"
+
+namespace {
+
+    // Log records of one service: the same keys and a handful of recurring values around
+    // numbers that vary from record to record
+    std::vector<std::vector<uint8_t>> make_records(size_t count, uint32_t seed) {
+
+        const char* levels[] = { "info", "warn", "error", "debug" };
+        const char* services[] = { "auth", "billing", "search", "storage", "gateway" };
+        const char* events[] = { "request completed", "cache miss", "retrying upstream call", "session refreshed", "rate limit exceeded" };
+
+        auto next = [&](uint32_t range) {
+            return (next_random(seed) >> 8) % range;
+        };
+
+        std::vector<std::vector<uint8_t>> records;
+        for (size_t i = 0; i < count; i++) {
+            std::string record = "{\"timestamp\": \"2024-05-" + std::to_string(10 + next(20)) + "T" + std::to_string(10 + next(14)) + ":" + std::to_string(10 + next(50)) + ":" + std::to_string(10 + next(50)) + "Z\", "
+                "\"level\": \"" + levels[next(4)] + "\", \"service\": \"" + services[next(5)] + "\", \"event\": \"" + events[next(5)] + "\", "
+                "\"request_id\": \"" + std::to_string(next(1u << 30)) + "\", \"latency_ms\": " + std::to_string(next(5000)) + ", "
+                "\"region\": \"eu-west-1\", \"host\": \"node-" + std::to_string(next(64)) + ".cluster.internal\", \"version\": \"3.14.2\"}\n";
+            records.emplace_back(record.begin(), record.end());
+        }
+        return records;
+    }
+
+}
+
+TEST(DictionaryTest, TrainedDictionary) {
+
+    auto records = make_records(600, 1);
+    std::vector<std::span<const uint8_t>> samples(records.begin(), records.begin() + 500);
+
+    auto trained = lpz::train_dictionary(samples, 16 * 1024);
+    if (!trained) throw std::runtime_error("Training failed: " + trained.error().m);
+    EXPECT_LE(trained->size(), 16 * 1024 + 1024);
+
+    auto dictionary = lpz::load_dictionary(*trained);
+    if (!dictionary) throw std::runtime_error("Loading failed: " + dictionary.error().m);
+
+    auto other = lpz::load_dictionary(std::span<const uint8_t>(records[0]));
+    if (!other) throw std::runtime_error("Loading failed: " + other.error().m);
+    EXPECT_NE(dictionary->id(), other->id());
+
+    // Records the dictionary was not trained on still shrink to a fraction of their size
+    // without it
+    size_t plain_size = 0;
+    size_t dictionary_size = 0;
+
+    for (size_t i = 500; i < records.size(); i++) {
+
+        auto plain = lpz::compress(records[i]);
+        if (!plain) throw std::runtime_error("Compression failed: " + plain.error().m);
+        auto compressed = lpz::compress(records[i], *dictionary);
+        if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+        plain_size += plain->size();
+        dictionary_size += compressed->size();
+
+        auto decompressed = lpz::decompress(*compressed, *dictionary);
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(records[i], *decompressed);
+
+        EXPECT_EQ(lpz::decompress(*compressed).error().c, lpz::ErrorCode::InputError);
+        EXPECT_EQ(lpz::decompress(*compressed, *other).error().c, lpz::ErrorCode::InputError);
+        EXPECT_EQ(lpz::decompress_range(*compressed, 0, 10).error().c, lpz::ErrorCode::InputError);
+
+        // Streams compressed without a dictionary ignore one
+        auto undictionary = lpz::decompress(*plain, *dictionary);
+        if (!undictionary) throw std::runtime_error("Decompression failed: " + undictionary.error().m);
+        EXPECT_EQ(records[i], *undictionary);
+    }
+
+    EXPECT_LT(dictionary_size * 2, plain_size);
+}
+
+TEST(DictionaryTest, RawContent) {
+
+    auto text = readFile("tests/sample/enwik6");
+    std::span<const uint8_t> content(text.data(), 32 * 1024);
+    std::vector<uint8_t> input(text.begin() + 100000, text.begin() + 100000 + 2 * lpz::MAX_BLOCK + 5000);
+
+    auto dictionary = lpz::load_dictionary(content);
+    if (!dictionary) throw std::runtime_error("Loading failed: " + dictionary.error().m);
+
+    EXPECT_EQ(lpz::load_dictionary({}).error().c, lpz::ErrorCode::InputError);
+    EXPECT_EQ(lpz::load_dictionary(std::span<const uint8_t>(text).first(lpz::MAX_DICTIONARY + 1)).error().c, lpz::ErrorCode::InputError);
+
+    lpz::CompressContext compress_context;
+    lpz::DecompressContext decompress_context;
+
+    for (int level : { lpz::MIN_LEVEL, lpz::DEFAULT_LEVEL, lpz::MAX_LEVEL }) {
+        for (bool linked : { false, true }) {
+
+            lpz::CompressOptions options{ .level = level, .linked_blocks = linked };
+
+            auto compressed = lpz::compress(input, compress_context, *dictionary, options);
+            if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+            auto threaded = lpz::compress(input, *dictionary, { .threads = 4, .level = level, .linked_blocks = linked });
+            if (!threaded) throw std::runtime_error("Compression failed: " + threaded.error().m);
+            EXPECT_EQ(*compressed, *threaded);
+
+            std::vector<uint8_t> into(lpz::compress_bound(input.size()));
+            auto size = lpz::compress_into(input, into, compress_context, *dictionary, options);
+            if (!size) throw std::runtime_error("Compression failed: " + size.error().m);
+            into.resize(*size);
+            EXPECT_EQ(*compressed, into);
+
+            for (unsigned threads : { 1u, 4u }) {
+                auto decompressed = lpz::decompress(*compressed, decompress_context, *dictionary, { .threads = threads });
+                if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+                EXPECT_EQ(input, *decompressed);
+            }
+
+            std::vector<uint8_t> decompressed(input.size());
+            auto written = lpz::decompress_into(*compressed, decompressed, *dictionary);
+            if (!written) throw std::runtime_error("Decompression failed: " + written.error().m);
+            EXPECT_EQ(input, decompressed);
+
+            EXPECT_EQ(lpz::decompress_into(*compressed, decompressed).error().c, lpz::ErrorCode::InputError);
+        }
+    }
+}
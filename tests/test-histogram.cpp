@@ -0,0 +1,37 @@
+#include <gtest/gtest.h>
+#include "histogram.h"
+#include "test-common.h"
+
+#pragma warning(disable : 6326)
+
+TEST(HistogramTest, MatchesSimpleCount) {
+
+    auto sample = readFile("tests/sample/enwik4");
+
+    // Sizes that leave every possible tail after the 16-byte steps
+    for (size_t size = 0; size < 40; size++) {
+        for (size_t offset : { size_t(0), size_t(3), size_t(1000) }) {
+            std::span<const uint8_t> data(sample.data() + offset, size);
+
+            lpz::Histogram expected = {};
+            for (uint8_t value : data) expected[value]++;
+
+            EXPECT_EQ(lpz::create_histogram(data), expected);
+        }
+    }
+
+    lpz::Histogram expected = {};
+    for (uint8_t value : sample) expected[value]++;
+    EXPECT_EQ(lpz::create_histogram(sample), expected);
+
+}
+
+TEST(HistogramTest, SingleValue) {
+
+    std::vector<uint8_t> zeros(100003, 0);
+
+    auto histogram = lpz::create_histogram(zeros);
+    EXPECT_EQ(histogram[0], zeros.size());
+    for (size_t s = 1; s < histogram.size(); s++) EXPECT_EQ(histogram[s], 0u);
+
+}
@@ -1,6 +1,10 @@
 #include <gtest/gtest.h>
 #include <fstream>
 #include <chrono>
+#include <cmath>
+#include <utility>
+#include <tuple>
+#include <algorithm>
 #include "huffman.h"
 #include "test-common.h"
 
@@ -57,3 +61,236 @@ TEST(HuffmanTest, SingleCharStream) {
 
 }
 
+
+TEST(HuffmanTest, CodeLengths) {
+
+    // Fibonacci weights push an unlimited Huffman code far past the length limit
+    std::array<uint32_t, 256> histogram = {};
+    uint32_t a = 1, b = 1;
+    for (int i = 0; i < 30; i++) {
+        histogram[i] = a;
+        a = std::exchange(b, a + b);
+    }
+
+    auto lengths = lpz::huffman::get_code_lengths(histogram);
+
+    double kraft = 0;
+    for (int i = 0; i < 256; i++) {
+        EXPECT_EQ(lengths[i] == 0, histogram[i] == 0);
+        EXPECT_LE(lengths[i], 14);
+        if (lengths[i] > 0) kraft += std::ldexp(1.0, -lengths[i]);
+    }
+    EXPECT_DOUBLE_EQ(kraft, 1.0);
+
+    EXPECT_EQ(lpz::huffman::get_code_lengths({}), (std::array<uint8_t, 256>{}));
+}
+
+TEST(HuffmanTest, Interleaved) {
+
+    auto sample = readFile("tests/sample/enwik6");
+
+    // Sizes that leave some streams short or empty, as well as a large input
+    for (size_t size : { size_t(1), size_t(2), size_t(3), size_t(5), size_t(37), size_t(4096), sample.size() }) {
+
+        std::span<const uint8_t> input(sample.data(), size);
+
+        std::vector<uint8_t> compressed(lpz::huffman::encode_interleaved_bound(size));
+        auto compressed_size = lpz::huffman::encode_interleaved_into(input, compressed);
+        if (!compressed_size) throw std::runtime_error("Compression failed: " + compressed_size.error().m);
+        compressed.resize(*compressed_size);
+
+        auto decoded_size = lpz::huffman::decoded_size(compressed);
+        ASSERT_TRUE(decoded_size);
+        EXPECT_EQ(*decoded_size, size);
+
+        lpz::huffman::DecodeTable table;
+        std::vector<uint8_t> decompressed(size);
+        auto decompressed_size = lpz::huffman::decode_interleaved_into(compressed, decompressed, table);
+        if (!decompressed_size) throw std::runtime_error("Decompression failed: " + decompressed_size.error().m);
+
+        EXPECT_TRUE(std::equal(input.begin(), input.end(), decompressed.begin()));
+    }
+
+}
+
+TEST(HuffmanTest, InterleavedTruncated) {
+
+    auto input = readFile("tests/sample/enwik4");
+
+    std::vector<uint8_t> compressed(lpz::huffman::encode_interleaved_bound(input.size()));
+    auto compressed_size = lpz::huffman::encode_interleaved_into(input, compressed);
+    if (!compressed_size) throw std::runtime_error("Compression failed: " + compressed_size.error().m);
+
+    lpz::huffman::DecodeTable table;
+    std::vector<uint8_t> decompressed(input.size());
+
+    auto truncated = std::span<const uint8_t>(compressed).first(*compressed_size - 16);
+    auto result = lpz::huffman::decode_interleaved_into(truncated, decompressed, table);
+    EXPECT_EQ(result.error().c, lpz::ErrorCode::InputError);
+
+    // A jump table pointing past the end of the data
+    compressed[256 + sizeof(uint32_t) + 3] = 0xFF;
+    result = lpz::huffman::decode_interleaved_into(std::span<const uint8_t>(compressed).first(*compressed_size), decompressed, table);
+    EXPECT_EQ(result.error().c, lpz::ErrorCode::InputError);
+
+}
+
+TEST(HuffmanTest, LongCodes) {
+
+    // Fibonacci counts push the rarest symbols past the primary table bits, so they decode
+    // through subtables
+    std::vector<uint8_t> input;
+    uint32_t a = 1, b = 1;
+    for (int symbol = 0; symbol < 20; symbol++) {
+        input.insert(input.end(), a, static_cast<uint8_t>(symbol));
+        std::tie(a, b) = std::make_pair(b, a + b);
+    }
+    for (size_t i = 0; i < input.size(); i++) {
+        std::swap(input[i], input[(i * 7919) % input.size()]);
+    }
+
+    std::array<uint32_t, 256> histogram = {};
+    for (uint8_t value : input) histogram[value]++;
+    auto lengths = lpz::huffman::get_code_lengths(histogram);
+    EXPECT_GT(*std::max_element(lengths.begin(), lengths.end()), 11);
+
+    auto compressed = lpz::huffman::encode(input);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+    auto decompressed = lpz::huffman::decode(*compressed);
+    if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+    EXPECT_EQ(input, *decompressed);
+
+    std::vector<uint8_t> interleaved(lpz::huffman::encode_interleaved_bound(input.size()));
+    auto interleaved_size = lpz::huffman::encode_interleaved_into(input, interleaved);
+    if (!interleaved_size) throw std::runtime_error("Compression failed: " + interleaved_size.error().m);
+    interleaved.resize(*interleaved_size);
+
+    lpz::huffman::DecodeTable table;
+    std::vector<uint8_t> out(input.size());
+    auto out_size = lpz::huffman::decode_interleaved_into(interleaved, out, table);
+    if (!out_size) throw std::runtime_error("Decompression failed: " + out_size.error().m);
+    EXPECT_EQ(input, out);
+
+}
+
+TEST(HuffmanTest, CompactCodeLengths) {
+
+    auto input = readFile("tests/sample/enwik4");
+    auto lengths = lpz::huffman::get_code_lengths(lpz::create_histogram(input));
+
+    std::vector<uint8_t> compact(lpz::huffman::CODE_LENGTHS_BOUND);
+    size_t size = lpz::huffman::write_code_lengths(lengths, compact.data());
+    EXPECT_LE(size, lpz::huffman::CODE_LENGTHS_BOUND);
+
+    lpz::huffman::CodeLengths read;
+    auto read_size = lpz::huffman::read_code_lengths({ compact.data(), size }, read);
+    ASSERT_TRUE(read_size);
+    EXPECT_EQ(*read_size, size);
+    EXPECT_EQ(read, lengths);
+
+    // Text uses few of the byte values, and the unused ones fold into zero runs
+    EXPECT_LT(size, 100u);
+
+    read_size = lpz::huffman::read_code_lengths({ compact.data(), size - 1 }, read);
+    EXPECT_EQ(read_size.error().c, lpz::ErrorCode::InputError);
+
+    // A code with nothing but a single symbol
+    lpz::huffman::CodeLengths single = {};
+    single[255] = 1;
+    size = lpz::huffman::write_code_lengths(single, compact.data());
+    read_size = lpz::huffman::read_code_lengths({ compact.data(), size }, read);
+    ASSERT_TRUE(read_size);
+    EXPECT_EQ(read, single);
+
+}
+
+TEST(HuffmanTest, ExactBoundBuffer) {
+
+    auto sample = readFile("tests/sample/enwik4");
+
+    // The encoder stores whole words while it can, so buffers of exactly the bound must take
+    // the byte-wise tail without writing past their end
+    for (size_t size : { 1, 3, 4, 5, 17, 1000, 10000 }) {
+        std::vector<uint8_t> input(sample.begin(), sample.begin() + size);
+        auto histogram = lpz::create_histogram(input);
+        auto lengths = lpz::huffman::get_code_lengths(histogram);
+        size_t bits = lpz::huffman::encoded_bits(histogram, lengths);
+
+        for (bool interleaved : { false, true }) {
+            std::vector<uint8_t> encoded(lpz::huffman::encode_bits_bound(bits, interleaved));
+            auto written = lpz::huffman::encode_bits_into(input, lengths, bits, encoded, interleaved);
+            ASSERT_TRUE(written);
+
+            lpz::huffman::DecodeTable table;
+            ASSERT_TRUE(lpz::huffman::build_decode_table(lengths, table));
+
+            std::vector<uint8_t> decoded(input.size());
+            ASSERT_TRUE(lpz::huffman::decode_bits_into({ encoded.data(), *written }, decoded, table, interleaved));
+            EXPECT_EQ(input, decoded);
+        }
+    }
+
+}
+
+TEST(HuffmanTest, FastLengthsMatchPackageMerge) {
+
+    auto sample = readFile("tests/sample/enwik6");
+
+    std::vector<std::array<uint32_t, 256>> histograms;
+    for (size_t pos = 0; pos + 4096 <= sample.size(); pos += 65536) {
+        histograms.push_back(lpz::create_histogram({ sample.data() + pos, 4096 }));
+    }
+
+    // Fibonacci counts over 30 symbols need codes past the limit, which takes the fallback
+    std::array<uint32_t, 256> deep = {};
+    uint32_t a = 1, b = 1;
+    for (int symbol = 0; symbol < 30; symbol++) {
+        deep[symbol] = a;
+        std::tie(a, b) = std::make_pair(b, a + b);
+    }
+    histograms.push_back(deep);
+
+    for (auto& histogram : histograms) {
+        auto fast = lpz::huffman::get_code_lengths(histogram);
+        auto merged = lpz::huffman::package_merge_code_lengths(histogram);
+        EXPECT_EQ(lpz::huffman::encoded_bits(histogram, fast), lpz::huffman::encoded_bits(histogram, merged));
+        EXPECT_LE(*std::max_element(fast.begin(), fast.end()), 14);
+    }
+
+}
+
+TEST(HuffmanTest, DecodeTableCache) {
+
+    auto sample = readFile("tests/sample/enwik4");
+
+    auto text = lpz::huffman::get_code_lengths(lpz::create_histogram(sample));
+    lpz::huffman::CodeLengths flat;
+    flat.fill(8);
+
+    lpz::huffman::DecodeTableCache cache;
+    auto first = lpz::huffman::get_decode_table(text, cache);
+    ASSERT_TRUE(first);
+    auto other = lpz::huffman::get_decode_table(flat, cache);
+    ASSERT_TRUE(other);
+    EXPECT_NE(*first, *other);
+
+    // Coming back to a code finds its table where it was built
+    auto again = lpz::huffman::get_decode_table(text, cache);
+    ASSERT_TRUE(again);
+    EXPECT_EQ(*first, *again);
+
+    size_t bits = lpz::huffman::encoded_bits(lpz::create_histogram(sample), text);
+    std::vector<uint8_t> encoded(lpz::huffman::encode_bits_bound(bits, false));
+    auto written = lpz::huffman::encode_bits_into(sample, text, bits, encoded, false);
+    ASSERT_TRUE(written);
+    std::vector<uint8_t> decoded(sample.size());
+    ASSERT_TRUE(lpz::huffman::decode_bits_into({ encoded.data(), *written }, decoded, **again, false));
+    EXPECT_EQ(sample, decoded);
+
+    // An oversubscribed code fails without leaving a table behind for it
+    lpz::huffman::CodeLengths bad;
+    bad.fill(1);
+    EXPECT_EQ(lpz::huffman::get_decode_table(bad, cache).error().c, lpz::ErrorCode::InputError);
+    EXPECT_EQ(lpz::huffman::get_decode_table(bad, cache).error().c, lpz::ErrorCode::InputError);
+
+}
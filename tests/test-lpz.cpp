@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 #include <fstream>
 #include <chrono>
+#include <algorithm>
+#include <limits>
 #include "lz77.h"
 #include "test-common.h"
 
@@ -25,6 +27,11 @@ TEST(LPZTest, EmptyTest) {
     EXPECT_EQ(compressed.error().c, lpz::ErrorCode::InputError);
     auto decompressed = lpz::decompress(input);
     EXPECT_EQ(decompressed.error().c, lpz::ErrorCode::InputError);
+    EXPECT_EQ(lpz::decompress_range(input, 0, 1).error().c, lpz::ErrorCode::InputError);
+
+    // The streaming compressor makes no empty stream for them either
+    lpz::Compressor compressor([](std::span<const uint8_t>) -> std::expected<void, lpz::Error> { return {}; });
+    EXPECT_EQ(compressor.finish().error().c, lpz::ErrorCode::InputError);
 }
 
 TEST(LPZTest, SingleChar) {
@@ -48,3 +55,310 @@ TEST(LPZTest, SingleCharStream) {
     if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
     EXPECT_EQ(input, *decompressed);
 }
+
+TEST(LPZTest, MultithreadedMatchesSingleThreaded) {
+
+    auto input = readFile("tests/sample/enwik7");
+
+    auto single = lpz::compress(input);
+    if (!single) throw std::runtime_error("Compression failed: " + single.error().m);
+
+    for (unsigned threads : { 2u, 4u, 0u }) {
+        auto multi = lpz::compress(input, { .threads = threads });
+        if (!multi) throw std::runtime_error("Compression failed: " + multi.error().m);
+        EXPECT_EQ(*single, *multi);
+    }
+}
+
+TEST(LPZTest, MultithreadedDecompress) {
+
+    auto input = readFile("tests/sample/enwik7");
+
+    auto compressed = lpz::compress(input);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+
+    for (unsigned threads : { 2u, 4u, 0u }) {
+        auto decompressed = lpz::decompress(*compressed, { .threads = threads });
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(input, *decompressed);
+    }
+}
+
+TEST(LPZTest, TruncatedInput) {
+
+    auto input = readFile("tests/sample/enwik6");
+
+    auto compressed = lpz::compress(input);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+
+    compressed->resize(compressed->size() - 1);
+    auto decompressed = lpz::decompress(*compressed);
+    EXPECT_EQ(decompressed.error().c, lpz::ErrorCode::InputError);
+}
+
+TEST(LPZTest, SeekTableRoundTrip) {
+
+    auto input = readFile("tests/sample/enwik7");
+
+    auto compressed = lpz::compress(input, { .seek_table = true });
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+    auto decompressed = lpz::decompress(*compressed);
+    if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+    EXPECT_EQ(input, *decompressed);
+}
+
+TEST(LPZTest, DecompressRange) {
+
+    auto input = readFile("tests/sample/enwik7");
+
+    auto indexed = lpz::compress(input, { .seek_table = true });
+    if (!indexed) throw std::runtime_error("Compression failed: " + indexed.error().m);
+    auto plain = lpz::compress(input);
+    if (!plain) throw std::runtime_error("Compression failed: " + plain.error().m);
+
+    const std::pair<uint64_t, uint64_t> ranges[] = {
+        { 0, 10 },
+        { lpz::MAX_BLOCK - 5, 10 },
+        { 3 * lpz::MAX_BLOCK + 17, 2 * lpz::MAX_BLOCK },
+        { input.size() - 1000, 1000 },
+        { input.size() - 10, 1000 },
+        { input.size(), 10 },
+    };
+
+    for (auto [offset, length] : ranges) {
+
+        size_t end = static_cast<size_t>(std::min<uint64_t>(offset + length, input.size()));
+        std::vector<uint8_t> expected(input.begin() + offset, input.begin() + end);
+
+        for (auto* compressed : { &*indexed, &*plain }) {
+            auto range = lpz::decompress_range(*compressed, offset, length);
+            if (!range) throw std::runtime_error("Decompression failed: " + range.error().m);
+            EXPECT_EQ(expected, *range);
+        }
+    }
+
+    auto past_end = lpz::decompress_range(*indexed, input.size() + 1, 1);
+    EXPECT_EQ(past_end.error().c, lpz::ErrorCode::InputError);
+}
+
+TEST(LPZTest, CompressIntoMatchesCompress) {
+
+    auto input = readFile("tests/sample/enwik7");
+
+    auto expected = lpz::compress(input, { .seek_table = true });
+    if (!expected) throw std::runtime_error("Compression failed: " + expected.error().m);
+
+    std::vector<uint8_t> compressed(lpz::compress_bound(input.size()));
+    auto size = lpz::compress_into(input, compressed, { .seek_table = true });
+    if (!size) throw std::runtime_error("Compression failed: " + size.error().m);
+    compressed.resize(*size);
+    EXPECT_EQ(*expected, compressed);
+
+    auto decompressed_size = lpz::decompressed_size(compressed);
+    if (!decompressed_size) throw std::runtime_error("Size query failed: " + decompressed_size.error().m);
+    EXPECT_EQ(*decompressed_size, input.size());
+
+    std::vector<uint8_t> decompressed(input.size());
+    auto decompressed_bytes = lpz::decompress_into(compressed, decompressed);
+    if (!decompressed_bytes) throw std::runtime_error("Decompression failed: " + decompressed_bytes.error().m);
+    EXPECT_EQ(*decompressed_bytes, input.size());
+    EXPECT_EQ(input, decompressed);
+}
+
+TEST(LPZTest, IntoBufferTooSmall) {
+
+    auto input = readFile("tests/sample/enwik4");
+
+    std::vector<uint8_t> compressed(100);
+    auto size = lpz::compress_into(input, compressed);
+    EXPECT_EQ(size.error().c, lpz::ErrorCode::InputError);
+
+    compressed.resize(lpz::compress_bound(input.size()));
+    size = lpz::compress_into(input, compressed);
+    if (!size) throw std::runtime_error("Compression failed: " + size.error().m);
+    compressed.resize(*size);
+
+    std::vector<uint8_t> decompressed(input.size() - 1);
+    auto decompressed_bytes = lpz::decompress_into(compressed, decompressed);
+    EXPECT_EQ(decompressed_bytes.error().c, lpz::ErrorCode::InputError);
+}
+
+TEST(LPZTest, ContextReuse) {
+
+    auto input = readFile("tests/sample/enwik6");
+
+    lpz::CompressContext compress_context;
+    lpz::DecompressContext decompress_context;
+
+    // Messages of varying size through one pair of contexts must match fresh-context results.
+    for (size_t size : { size_t(1000), size_t(16000), size_t(300), lpz::MAX_BLOCK * 3 + 5, size_t(4000) }) {
+
+        std::span<const uint8_t> message(input.data() + size, size);
+
+        auto expected = lpz::compress(message);
+        if (!expected) throw std::runtime_error("Compression failed: " + expected.error().m);
+
+        auto compressed = lpz::compress(message, compress_context);
+        if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+        EXPECT_EQ(*expected, *compressed);
+
+        std::vector<uint8_t> into(lpz::compress_bound(size));
+        auto into_size = lpz::compress_into(message, into, compress_context);
+        if (!into_size) throw std::runtime_error("Compression failed: " + into_size.error().m);
+        into.resize(*into_size);
+        EXPECT_EQ(*expected, into);
+
+        auto decompressed = lpz::decompress(*compressed, decompress_context, { .threads = 2 });
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_TRUE(std::ranges::equal(message, *decompressed));
+    }
+}
+
+TEST(LPZTest, Levels) {
+
+    auto input = readFile("tests/sample/enwik6");
+
+    size_t previous_size = std::numeric_limits<size_t>::max();
+
+    for (int level : { lpz::MIN_LEVEL, lpz::DEFAULT_LEVEL, lpz::MAX_LEVEL }) {
+        auto compressed = lpz::compress(input, { .level = level });
+        if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+        EXPECT_LE(compressed->size(), previous_size) << "level " << level;
+        previous_size = compressed->size();
+
+        auto decompressed = lpz::decompress(*compressed);
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(input, *decompressed);
+    }
+
+    auto invalid = lpz::compress(input, { .level = lpz::MAX_LEVEL + 1 });
+    EXPECT_EQ(invalid.error().c, lpz::ErrorCode::InputError);
+}
+
+TEST(LPZTest, LinkedBlocks) {
+
+    // A pattern that repeats every 40000 bytes: independent blocks have to store it again
+    // in each block, linked blocks only once
+    auto pattern = random_bytes(40000, 1);
+    std::vector<uint8_t> input;
+    for (int i = 0; i < 10; i++) input.insert(input.end(), pattern.begin(), pattern.end());
+
+    auto independent = lpz::compress(input);
+    if (!independent) throw std::runtime_error("Compression failed: " + independent.error().m);
+    auto linked = lpz::compress(input, { .seek_table = true, .linked_blocks = true });
+    if (!linked) throw std::runtime_error("Compression failed: " + linked.error().m);
+    EXPECT_LT(linked->size(), independent->size() / 2);
+
+    for (unsigned threads : { 1u, 4u }) {
+        auto decompressed = lpz::decompress(*linked, { .threads = threads });
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(input, *decompressed);
+    }
+
+    std::vector<uint8_t> compressed(lpz::compress_bound(input.size()));
+    auto size = lpz::compress_into(input, compressed, { .seek_table = true, .linked_blocks = true });
+    if (!size) throw std::runtime_error("Compression failed: " + size.error().m);
+    compressed.resize(*size);
+    EXPECT_EQ(*linked, compressed);
+
+    std::vector<uint8_t> decompressed(input.size());
+    auto decompressed_bytes = lpz::decompress_into(*linked, decompressed);
+    if (!decompressed_bytes) throw std::runtime_error("Decompression failed: " + decompressed_bytes.error().m);
+    EXPECT_EQ(input, decompressed);
+
+    // Ranges inside later blocks decode the blocks they are linked to first, with the seek
+    // table or without it
+    auto unindexed = lpz::compress(input, { .linked_blocks = true });
+    if (!unindexed) throw std::runtime_error("Compression failed: " + unindexed.error().m);
+
+    for (uint64_t offset : { uint64_t(10), 2 * lpz::MAX_BLOCK - 100, 3 * lpz::MAX_BLOCK + 5 }) {
+        std::vector<uint8_t> expected(input.begin() + offset, input.begin() + offset + 1000);
+        for (auto* stream : { &*linked, &*unindexed }) {
+            auto range = lpz::decompress_range(*stream, offset, 1000);
+            if (!range) throw std::runtime_error("Decompression failed: " + range.error().m);
+            EXPECT_EQ(expected, *range);
+        }
+    }
+}
+
+TEST(LPZTest, MixedBlocks) {
+
+    // Text, a run, noise and text again: Split, Rle and Stored blocks in one stream
+    auto text = readFile("tests/sample/enwik6");
+    std::vector<uint8_t> input(text.begin(), text.begin() + 200000);
+    input.insert(input.end(), 300000, 0);
+    auto noise = random_bytes(300000, 3);
+    input.insert(input.end(), noise.begin(), noise.end());
+    input.insert(input.end(), text.begin() + 200000, text.begin() + 400000);
+
+    for (bool linked : { false, true }) {
+        auto compressed = lpz::compress(input, { .seek_table = true, .level = lpz::MAX_LEVEL, .linked_blocks = linked });
+        if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+        EXPECT_LT(compressed->size(), 300000 + 200000);
+
+        for (unsigned threads : { 1u, 4u }) {
+            auto decompressed = lpz::decompress(*compressed, { .threads = threads });
+            if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+            EXPECT_EQ(input, *decompressed);
+        }
+
+        auto range = lpz::decompress_range(*compressed, 450000, 200000);
+        if (!range) throw std::runtime_error("Decompression failed: " + range.error().m);
+        EXPECT_TRUE(std::equal(range->begin(), range->end(), input.begin() + 450000));
+    }
+}
+
+TEST(LPZTest, LongWindow) {
+
+    // The same 400000 bytes of noise between fresh noise, repeating further back than linked
+    // blocks reach
+    auto repeated = random_bytes(400000, 5);
+    std::vector<uint8_t> input;
+    for (uint32_t i = 0; i < 6; i++) {
+        input.insert(input.end(), repeated.begin(), repeated.end());
+        auto fresh = random_bytes(200000, 100 + i);
+        input.insert(input.end(), fresh.begin(), fresh.end());
+    }
+
+    const lpz::CompressOptions options = { .seek_table = true, .long_window = 1 << 20 };
+
+    auto linked = lpz::compress(input, { .linked_blocks = true });
+    if (!linked) throw std::runtime_error("Compression failed: " + linked.error().m);
+    auto compressed = lpz::compress(input, options);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+    EXPECT_LT(compressed->size(), linked->size() / 2);
+
+    for (unsigned threads : { 1u, 4u }) {
+        auto decompressed = lpz::decompress(*compressed, { .threads = threads });
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(input, *decompressed);
+    }
+
+    std::vector<uint8_t> out(lpz::compress_bound(input.size()));
+    auto size = lpz::compress_into(input, out, options);
+    if (!size) throw std::runtime_error("Compression failed: " + size.error().m);
+    EXPECT_TRUE(std::ranges::equal(*compressed, std::span(out).first(*size)));
+
+    std::vector<uint8_t> decompressed(input.size());
+    auto decompressed_bytes = lpz::decompress_into(*compressed, decompressed);
+    if (!decompressed_bytes) throw std::runtime_error("Decompression failed: " + decompressed_bytes.error().m);
+    EXPECT_EQ(input, decompressed);
+
+    auto total = lpz::decompressed_size(*compressed);
+    if (!total) throw std::runtime_error("Size failed: " + total.error().m);
+    EXPECT_EQ(*total, input.size());
+
+    auto unindexed = lpz::compress(input, { .long_window = 1 << 20 });
+    if (!unindexed) throw std::runtime_error("Compression failed: " + unindexed.error().m);
+
+    for (uint64_t offset : { uint64_t(100), uint64_t(1900000), input.size() - 5000 }) {
+        std::vector<uint8_t> expected(input.begin() + offset, input.begin() + offset + 3000);
+        for (auto* stream : { &*compressed, &*unindexed }) {
+            auto range = lpz::decompress_range(*stream, offset, 3000);
+            if (!range) throw std::runtime_error("Decompression failed: " + range.error().m);
+            EXPECT_EQ(expected, *range);
+        }
+    }
+
+    EXPECT_EQ(lpz::compress(input, { .long_window = lpz::lz77::MAX_LONG_WINDOW + 1 }).error().c, lpz::ErrorCode::InputError);
+}
@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 #include <fstream>
 #include <chrono>
+#include <algorithm>
+#include <string_view>
 #include "lz77.h"
 #include "test-common.h"
 
@@ -49,3 +51,296 @@ TEST(LZ77Test, SingleCharStream) {
     if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
     EXPECT_EQ(input, *decompressed);
 }
+
+TEST(LZ77Test, TablesReuse) {
+
+    auto input = readFile("tests/sample/enwik6");
+
+    lpz::lz77::EncodeTables tables;
+    std::vector<uint8_t> out(lpz::lz77::encode_bound(input.size()));
+
+    for (size_t size : { input.size(), size_t(5000), size_t(70000) }) {
+
+        std::span<const uint8_t> message(input.data() + input.size() - size, size);
+
+        auto expected = lpz::lz77::encode(message);
+        if (!expected) throw std::runtime_error("Compression failed: " + expected.error().m);
+
+        auto written = lpz::lz77::encode_into(message, out, tables);
+        if (!written) throw std::runtime_error("Compression failed: " + written.error().m);
+        EXPECT_TRUE(std::ranges::equal(*expected, std::span(out).first(*written)));
+    }
+}
+
+TEST(LZ77Test, AllLevels) {
+
+    auto input = readFile("tests/sample/enwik6");
+
+    for (int level = lpz::MIN_LEVEL; level <= lpz::MAX_LEVEL; level++) {
+        auto compressed = lpz::lz77::encode(input, level);
+        if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+        auto decompressed = lpz::lz77::decode(*compressed);
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(input, *decompressed) << "level " << level;
+    }
+
+    EXPECT_EQ(lpz::lz77::encode(input, 0).error().c, lpz::ErrorCode::InputError);
+    EXPECT_EQ(lpz::lz77::encode(input, lpz::MAX_LEVEL + 1).error().c, lpz::ErrorCode::InputError);
+}
+
+TEST(LZ77Test, LongMatches) {
+
+    // Repeats far longer than the match finders compare before stopping early
+    std::vector<uint8_t> input(200000, 0);
+    auto noise = random_bytes(1000, 12345);
+    std::copy(noise.begin(), noise.end(), input.begin());
+    for (size_t i = 1000; i < 150000; i++) {
+        input[i] = input[i - 1000];
+    }
+
+    for (int level : { lpz::MIN_LEVEL, lpz::DEFAULT_LEVEL, lpz::MAX_LEVEL }) {
+        auto compressed = lpz::lz77::encode(input, level);
+        if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+        EXPECT_LT(compressed->size(), 3000) << "level " << level;
+        auto decompressed = lpz::lz77::decode(*compressed);
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(input, *decompressed) << "level " << level;
+    }
+}
+
+TEST(LZ77Test, Incompressible) {
+
+    auto input = random_bytes(300000, 987654321);
+    // A repeat after the noise, which the fast level may skip over
+    std::copy(input.end() - 25000, input.end() - 20000, input.end() - 5000);
+
+    for (int level : { lpz::MIN_LEVEL, lpz::DEFAULT_LEVEL }) {
+        auto compressed = lpz::lz77::encode(input, level);
+        if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+        EXPECT_LE(compressed->size(), lpz::lz77::encode_bound(input.size()));
+        if (level == lpz::DEFAULT_LEVEL) {
+            EXPECT_LT(compressed->size(), input.size());
+        }
+        auto decompressed = lpz::lz77::decode(*compressed);
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(input, *decompressed) << "level " << level;
+    }
+}
+
+TEST(LZ77Test, RepeatedNoise) {
+
+    // Noise repeating every 40000 bytes: the fast level probes ahead through each repeat
+    // before pulling the match back, and the match ends at MAX_LENGTH short of the probes
+    auto input = random_bytes(40000, 1);
+    for (size_t i = 40000; i < 131072; i++) {
+        input.push_back(input[i - 40000]);
+    }
+
+    for (int level : { lpz::MIN_LEVEL, lpz::DEFAULT_LEVEL }) {
+        auto compressed = lpz::lz77::encode(input, level);
+        if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+        EXPECT_LT(compressed->size(), 45000) << "level " << level;
+        auto decompressed = lpz::lz77::decode(*compressed);
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(input, *decompressed) << "level " << level;
+    }
+}
+
+TEST(LZ77Test, OverlappingMatches) {
+
+    // Runs of every short period, which decode as matches overlapping their own output
+    std::vector<uint8_t> input;
+    for (size_t period = 1; period <= 40; period++) {
+        for (size_t i = 0; i < period * 7 + 3; i++) {
+            input.push_back(static_cast<uint8_t>('a' + (i % period) + period));
+        }
+    }
+
+    auto compressed = lpz::lz77::encode(input);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+
+    // Copies may run ahead, but never past the output span
+    std::vector<uint8_t> out(input.size() + 64, 0xEE);
+    auto written = lpz::lz77::decode_into(*compressed, std::span(out).first(input.size()));
+    if (!written) throw std::runtime_error("Decompression failed: " + written.error().m);
+
+    EXPECT_EQ(*written, input.size());
+    EXPECT_TRUE(std::ranges::equal(input, std::span(out).first(input.size())));
+    EXPECT_TRUE(std::ranges::all_of(std::span(out).subspan(input.size()), [](uint8_t b) { return b == 0xEE; }));
+}
+
+TEST(LZ77Test, SplitFields) {
+
+    auto input = readFile("tests/sample/enwik4");
+
+    auto compressed = lpz::lz77::encode(input);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+
+    lpz::lz77::Fields fields;
+    auto split = lpz::lz77::split_fields(*compressed, fields);
+    if (!split) throw std::runtime_error("Split failed: " + split.error().m);
+
+    EXPECT_EQ(fields[lpz::lz77::OFFSETS_LOW].size(), fields[lpz::lz77::OFFSETS_HIGH].size());
+
+    lpz::lz77::FieldsView view;
+    std::copy(fields.begin(), fields.end(), view.begin());
+
+    std::vector<uint8_t> decompressed(input.size());
+    auto size = lpz::lz77::decode_fields_into(view, decompressed);
+    if (!size) throw std::runtime_error("Decompression failed: " + size.error().m);
+
+    EXPECT_EQ(*size, input.size());
+    EXPECT_EQ(input, decompressed);
+
+    // Leftover literals mean the fields do not belong together
+    fields[lpz::lz77::LITERALS].push_back(0);
+    std::copy(fields.begin(), fields.end(), view.begin());
+    EXPECT_EQ(lpz::lz77::decode_fields_into(view, decompressed).error().c, lpz::ErrorCode::InputError);
+}
+
+TEST(LZ77Test, LongDistanceMatches) {
+
+    // Noise repeated 300000 bytes later, far past the window of the match finders
+    auto input = random_bytes(300000, 7);
+    input.insert(input.end(), input.begin() + 1000, input.begin() + 101000);
+
+    lpz::lz77::LongMatchTable table;
+    lpz::lz77::reset_long_matches(table, 1 << 20);
+    std::vector<lpz::lz77::LongMatch> long_matches;
+    lpz::lz77::find_long_matches(input, 0, 0, table, long_matches);
+
+    ASSERT_FALSE(long_matches.empty());
+    EXPECT_EQ(long_matches[0].distance, 299000u);
+
+    lpz::lz77::EncodeTables tables;
+    std::vector<uint8_t> out(lpz::lz77::encode_bound(input.size()));
+
+    for (int level : { lpz::MIN_LEVEL, lpz::DEFAULT_LEVEL }) {
+        auto written = lpz::lz77::encode_into(input, out, tables, level, 0, long_matches);
+        if (!written) throw std::runtime_error("Compression failed: " + written.error().m);
+        EXPECT_LT(*written, 302000) << "level " << level;
+
+        auto decompressed = lpz::lz77::decode(std::span(out).first(*written));
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(input, *decompressed) << "level " << level;
+    }
+
+    // Matches have to stay inside the data, in order
+    std::vector<lpz::lz77::LongMatch> outside = { { input.size() - 10, 64, 1000 } };
+    EXPECT_EQ(lpz::lz77::encode_into(input, out, tables, lpz::DEFAULT_LEVEL, 0, outside).error().c, lpz::ErrorCode::InputError);
+}
+
+TEST(LZ77Test, RepeatOffsets) {
+
+    // Records numbered in a few places: after each number a record matches the one before
+    // again, at the distance its previous match used. Names of different lengths vary that
+    // distance from record to record, so no one distance would code as cheaply
+    std::vector<uint8_t> input;
+    const std::string_view names[] = { "sensor", "probe", "thermometer", "gauge-unit" };
+    uint32_t state = 3;
+    for (size_t i = 0; i < 5000; i++) {
+        const size_t start = input.size();
+        const std::string record = std::string("{\"id\": 0, \"value\": 0, \"unit\": \"mV\", \"name\": \"") + std::string(names[next_random(state) >> 30]) + "\"}";
+        input.insert(input.end(), record.begin(), record.end());
+        for (size_t field : { size_t(7), size_t(19), size_t(32) }) {
+            input[start + field] = static_cast<uint8_t>(i);
+            input[start + field + 1] = static_cast<uint8_t>(i >> 8);
+        }
+    }
+
+    for (auto format : { lpz::lz77::Format::Plain, lpz::lz77::Format::RepeatOffsets }) {
+        auto compressed = lpz::lz77::encode(input, lpz::DEFAULT_LEVEL, format);
+        if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+        auto decompressed = lpz::lz77::decode(*compressed, format);
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(input, *decompressed);
+
+        lpz::lz77::Fields fields;
+        auto split = lpz::lz77::split_fields(*compressed, fields);
+        if (!split) throw std::runtime_error("Split failed: " + split.error().m);
+        lpz::lz77::FieldsView view;
+        std::copy(fields.begin(), fields.end(), view.begin());
+        std::vector<uint8_t> out(input.size());
+        auto size = lpz::lz77::decode_fields_into(view, out, 0, format);
+        if (!size) throw std::runtime_error("Decompression failed: " + size.error().m);
+        EXPECT_EQ(input, out);
+
+        if (format == lpz::lz77::Format::RepeatOffsets) {
+            // Most matches pick up a distance used just before
+            const auto& high = fields[lpz::lz77::OFFSETS_HIGH];
+            const auto& low = fields[lpz::lz77::OFFSETS_LOW];
+            size_t reps = 0;
+            for (size_t i = 0; i < low.size(); i++) {
+                reps += high[i] == 0 && low[i] >= 1 && low[i] <= lpz::lz77::REP_CODES;
+            }
+            EXPECT_GT(reps * 2, low.size());
+        }
+    }
+}
+
+TEST(LZ77Test, DropRepeatOffsets) {
+
+    // Noise that repeats once, which no repeat code helps with, and text, where some do
+    auto noise = random_bytes(20000, 11);
+    noise.insert(noise.end(), noise.begin() + 1000, noise.begin() + 11000);
+    auto text = readFile("tests/sample/enwik6");
+    text.resize(100000);
+
+    std::vector<uint8_t> out(lpz::lz77::encode_bound(text.size()));
+    lpz::lz77::EncodeTables tables;
+
+    for (auto [input, expected] : { std::pair{ &noise, lpz::lz77::Format::Plain }, std::pair{ &text, lpz::lz77::Format::RepeatOffsets } }) {
+        auto size = lpz::lz77::encode_into(*input, out, tables);
+        if (!size) throw std::runtime_error("Compression failed: " + size.error().m);
+
+        auto format = lpz::lz77::drop_repeat_offsets(std::span(out).first(*size), tables);
+        EXPECT_EQ(format, expected);
+
+        auto decompressed = lpz::lz77::decode(std::span(out).first(*size), format);
+        if (!decompressed) throw std::runtime_error("Decompression failed: " + decompressed.error().m);
+        EXPECT_EQ(*input, *decompressed);
+    }
+}
+
+TEST(LZ77Test, DictionaryTables) {
+
+    auto input = readFile("tests/sample/enwik6");
+    std::span<const uint8_t> dictionary(input.data(), 30000);
+
+    // Messages parsed after the digested dictionary come out as when it is inserted with them,
+    // on the first call, on one that reuses the tables, and after a call without it. Some go
+    // on with the bytes around the end of the dictionary, which its last positions match into
+    std::vector<std::vector<uint8_t>> messages;
+    for (size_t offset : { dictionary.size() - 200, size_t(100000), dictionary.size(), size_t(200000) }) {
+        messages.emplace_back(dictionary.begin(), dictionary.end());
+        messages.back().insert(messages.back().end(), input.begin() + offset, input.begin() + offset + 3000);
+    }
+
+    std::vector<uint8_t> out(lpz::lz77::encode_bound(input.size()));
+    std::vector<uint8_t> expected(out.size());
+
+    for (int level = lpz::MIN_LEVEL; level <= lpz::MAX_LEVEL; level++) {
+
+        lpz::lz77::DictionaryTables digest;
+        lpz::lz77::digest_dictionary(dictionary, level, digest);
+
+        lpz::lz77::EncodeTables tables;
+        for (int call = 0; call < 5; call++) {
+
+            const auto& message = messages[call % messages.size()];
+
+            lpz::lz77::EncodeTables fresh;
+            auto expected_size = lpz::lz77::encode_into(message, expected, fresh, level, dictionary.size());
+            if (!expected_size) throw std::runtime_error("Compression failed: " + expected_size.error().m);
+
+            if (call == 2) {
+                auto other = lpz::lz77::encode_into(std::span(input).first(100000), out, tables, level);
+                if (!other) throw std::runtime_error("Compression failed: " + other.error().m);
+            }
+
+            auto size = lpz::lz77::encode_into(message, out, tables, level, dictionary.size(), {}, lpz::lz77::Format::RepeatOffsets, &digest);
+            if (!size) throw std::runtime_error("Compression failed: " + size.error().m);
+            EXPECT_TRUE(std::ranges::equal(std::span(expected).first(*expected_size), std::span(out).first(*size))) << "level " << level << ", call " << call;
+        }
+    }
+}
@@ -0,0 +1,139 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <chrono>
+#include "lpz.h"
+#include "test-common.h"
+
+#pragma warning(disable : 6326)
+
+namespace {
+
+    lpz::Sink append_to(std::vector<uint8_t>& out) {
+        return [&out](std::span<const uint8_t> data) -> std::expected<void, lpz::Error> {
+            out.insert(out.end(), data.begin(), data.end());
+            return {};
+        };
+    }
+
+    void write_in_chunks(auto& stream, std::span<const uint8_t> data, size_t chunk) {
+        for (size_t pos = 0; pos < data.size(); pos += chunk) {
+            auto res = stream.write(data.subspan(pos, std::min(chunk, data.size() - pos)));
+            if (!res) throw std::runtime_error("Stream write failed: " + res.error().m);
+        }
+        auto res = stream.finish();
+        if (!res) throw std::runtime_error("Stream finish failed: " + res.error().m);
+    }
+
+}
+
+TEST(StreamTest, MatchesCompress) {
+
+    auto input = readFile("tests/sample/enwik7");
+
+    auto expected = lpz::compress(input, { .seek_table = true });
+    if (!expected) throw std::runtime_error("Compression failed: " + expected.error().m);
+
+    for (size_t chunk : { size_t(1000), lpz::MAX_BLOCK, size_t(3) * lpz::MAX_BLOCK + 7 }) {
+        std::vector<uint8_t> compressed;
+        lpz::Compressor compressor(append_to(compressed), { .seek_table = true });
+        write_in_chunks(compressor, input, chunk);
+        EXPECT_EQ(*expected, compressed);
+    }
+}
+
+TEST(StreamTest, RoundTrip) {
+
+    auto input = readFile("tests/sample/enwik6");
+
+    std::vector<uint8_t> compressed;
+    lpz::Compressor compressor(append_to(compressed), { .threads = 4, .seek_table = true });
+    write_in_chunks(compressor, input, 50000);
+
+    for (size_t chunk : { size_t(1), size_t(3), size_t(4096), compressed.size() }) {
+        std::vector<uint8_t> decompressed;
+        lpz::Decompressor decompressor(append_to(decompressed), { .threads = 2 });
+        write_in_chunks(decompressor, compressed, chunk);
+        EXPECT_EQ(input, decompressed);
+    }
+}
+
+TEST(StreamTest, LinkedBlocks) {
+
+    auto input = readFile("tests/sample/enwik6");
+
+    auto expected = lpz::compress(input, { .linked_blocks = true });
+    if (!expected) throw std::runtime_error("Compression failed: " + expected.error().m);
+
+    // The history of the first block of each batch comes from the batch before
+    for (unsigned threads : { 1u, 3u }) {
+        std::vector<uint8_t> compressed;
+        lpz::Compressor compressor(append_to(compressed), { .threads = threads, .linked_blocks = true });
+        write_in_chunks(compressor, input, 50000);
+        EXPECT_EQ(*expected, compressed);
+    }
+
+    for (size_t chunk : { size_t(4096), expected->size() }) {
+        std::vector<uint8_t> decompressed;
+        lpz::Decompressor decompressor(append_to(decompressed), { .threads = 2 });
+        write_in_chunks(decompressor, *expected, chunk);
+        EXPECT_EQ(input, decompressed);
+    }
+}
+
+TEST(StreamTest, LongWindow) {
+
+    // A repeat 700000 bytes back, many times over, so both ends trim what they keep
+    auto input = random_bytes(700000, 9);
+    for (size_t i = 0; i < 3000000; i++) {
+        input.push_back(i % 1000000 < 600000 ? input[i] : static_cast<uint8_t>(i * 7));
+    }
+
+    const lpz::CompressOptions options = { .long_window = 800000 };
+
+    auto expected = lpz::compress(input, options);
+    if (!expected) throw std::runtime_error("Compression failed: " + expected.error().m);
+    EXPECT_LT(expected->size(), input.size() / 2);
+
+    for (unsigned threads : { 1u, 3u }) {
+        std::vector<uint8_t> compressed;
+        lpz::Compressor compressor(append_to(compressed), { .threads = threads, .long_window = 800000 });
+        write_in_chunks(compressor, input, 300000);
+        EXPECT_EQ(*expected, compressed);
+    }
+
+    for (size_t chunk : { size_t(4096), expected->size() }) {
+        std::vector<uint8_t> decompressed;
+        lpz::Decompressor decompressor(append_to(decompressed), { .threads = 2 });
+        write_in_chunks(decompressor, *expected, chunk);
+        EXPECT_EQ(input, decompressed);
+    }
+}
+
+TEST(StreamTest, TruncatedInput) {
+
+    auto input = readFile("tests/sample/enwik6");
+
+    auto compressed = lpz::compress(input);
+    if (!compressed) throw std::runtime_error("Compression failed: " + compressed.error().m);
+
+    std::vector<uint8_t> decompressed;
+    lpz::Decompressor decompressor(append_to(decompressed));
+
+    auto res = decompressor.write(std::span<const uint8_t>(*compressed).first(compressed->size() - 1));
+    if (!res) throw std::runtime_error("Stream write failed: " + res.error().m);
+    EXPECT_EQ(decompressor.finish().error().c, lpz::ErrorCode::InputError);
+}
+
+TEST(StreamTest, EmptyStream) {
+
+    // Empty input is rejected, as by lpz::compress and lpz::decompress
+    std::vector<uint8_t> compressed;
+    lpz::Compressor compressor(append_to(compressed));
+    EXPECT_EQ(compressor.finish().error().c, lpz::ErrorCode::InputError);
+    EXPECT_TRUE(compressed.empty());
+
+    std::vector<uint8_t> decompressed;
+    lpz::Decompressor decompressor(append_to(decompressed));
+    EXPECT_EQ(decompressor.finish().error().c, lpz::ErrorCode::InputError);
+    EXPECT_TRUE(decompressed.empty());
+}